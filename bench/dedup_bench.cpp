@@ -0,0 +1,136 @@
+// Dedup of repeated artifacts: a Codec pair in temporary stores carries an
+// artifact cold, then again unchanged, with a few bytes flipped, and shifted
+// by an insertion near the front. Reports wire bytes against stream bytes
+// per transfer, then the chunker's and the encoder/decoder's throughput.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "dedup.hpp"
+
+namespace dd = kq::dedup;
+
+namespace {
+
+constexpr size_t readSize = 8192;   // the relay's TCP read size
+
+double seconds(std::chrono::steady_clock::duration d)
+{
+    return std::chrono::duration<double>(d).count();
+}
+
+std::vector<char> randomBytes(size_t n, std::mt19937& rng)
+{
+    std::vector<char> data(n);
+    for (auto& c : data)
+        c = static_cast<char>(rng());
+    return data;
+}
+
+struct Pair {
+    explicit Pair(std::string const& dir, uint64_t capacity)
+    {
+        std::filesystem::remove_all(dir);
+        ok = from.open(dir + "/from", capacity) && to.open(dir + "/to", capacity);
+        std::vector<char> hello, ignored;
+        to.hello(hello);
+        ok = ok && from.decode(hello.data(), hello.size(), ignored);
+        hello.clear();
+        from.hello(hello);
+        ok = ok && to.decode(hello.data(), hello.size(), ignored);
+    }
+
+    dd::Codec from;
+    dd::Codec to;
+    bool ok = false;
+};
+
+struct Transfer {
+    size_t wire = 0;
+    double encodeSec = 0;
+    double decodeSec = 0;
+    bool ok = false;
+};
+
+Transfer send(Pair& pair, std::vector<char> const& data)
+{
+    Transfer t;
+    std::vector<char> wire, decoded;
+    wire.reserve(data.size() + data.size() / 64);
+    decoded.reserve(data.size());
+    auto start = std::chrono::steady_clock::now();
+    for (size_t pos = 0; pos < data.size(); pos += readSize) {
+        size_t n = std::min(readSize, data.size() - pos);
+        pair.from.encode(data.data() + pos, n, pos + n == data.size(), wire);
+    }
+    auto encoded = std::chrono::steady_clock::now();
+    t.ok = pair.to.decode(wire.data(), wire.size(), decoded) && decoded == data;
+    t.encodeSec = seconds(encoded - start);
+    t.decodeSec = seconds(std::chrono::steady_clock::now() - encoded);
+    t.wire = wire.size();
+    return t;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    bool quick = argc > 1 && std::strcmp(argv[1], "--quick") == 0;
+    size_t size = quick ? 8 << 20 : 128 << 20;
+    std::mt19937 rng(11);
+    auto dir = (std::filesystem::temp_directory_path() / "kq-dedup-bench").string();
+
+    auto artifact = randomBytes(size, rng);
+    auto modified = artifact;
+    for (size_t i = 1; i <= 16; ++i)
+        modified[size / 17 * i] ^= 0x55;
+    auto shifted = artifact;
+    shifted.insert(shifted.begin() + 4096, 100, 'x');
+
+    Pair pair(dir, 2 * static_cast<uint64_t>(size) + (64 << 20));
+    if (!pair.ok) {
+        std::printf("cannot open stores in %s\n", dir.c_str());
+        return 1;
+    }
+    std::printf("%zu MiB artifact, %zu B reads\n\n", size >> 20, readSize);
+    std::printf("%-28s %12s %12s %9s %12s %12s\n", "transfer", "stream", "wire", "ratio",
+        "encode MB/s", "decode MB/s");
+    struct Step {
+        char const* name;
+        std::vector<char> const* data;
+    };
+    for (auto [name, data] : {Step{"cold", &artifact}, Step{"identical", &artifact},
+             Step{"16 bytes flipped", &modified}, Step{"100 bytes inserted", &shifted}}) {
+        Transfer t = send(pair, *data);
+        if (!t.ok) {
+            std::printf("%s: decoded stream differs\n", name);
+            return 1;
+        }
+        double mb = static_cast<double>(data->size()) / 1e6;
+        std::printf("%-28s %12zu %12zu %8.2f%% %12.0f %12.0f\n", name, data->size(), t.wire,
+            100.0 * static_cast<double>(t.wire) / static_cast<double>(data->size()),
+            mb / t.encodeSec, mb / t.decodeSec);
+    }
+
+    // The chunker alone, as the lower bound on encode cost.
+    dd::Chunker chunker;
+    size_t chunks = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t pos = 0; pos < artifact.size(); pos += readSize) {
+        chunker.feed(artifact.data() + pos, std::min(readSize, artifact.size() - pos), false,
+            [&](char const*, size_t, size_t) { ++chunks; }, [](char const*, size_t) {});
+    }
+    double sec = seconds(std::chrono::steady_clock::now() - start);
+    std::printf("\nchunker alone: %.0f MB/s, %zu chunks, %.0f B average\n",
+        static_cast<double>(artifact.size()) / 1e6 / sec, chunks,
+        static_cast<double>(artifact.size()) / static_cast<double>(chunks));
+
+    std::filesystem::remove_all(dir);
+    return 0;
+}
@@ -0,0 +1,142 @@
+// Simulation of DVC fragmentation: a TCP reader feeds writes into a channel
+// whose messages are cut into fixed-size PDUs (MS-RDPEDYC 2.2.3), and every
+// PDU pays its DVC header plus a fixed per-PDU cost for the virtual channel
+// and RDP framing around it. Reports PDUs per MB, how full they are, and
+// goodput (payload / wire bytes) per write-sizing configuration.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "dvc_chunking.hpp"
+
+namespace {
+
+constexpr size_t rdpChunk = 1600;        // what the simulated RDP stack uses
+constexpr size_t perPduOverhead = 8 + 12; // CHANNEL_PDU_HEADER + security/TPKT share
+
+struct Totals {
+    uint64_t payload = 0;
+    uint64_t wire = 0;
+    uint64_t pdus = 0;
+    uint64_t writes = 0;
+};
+
+// Wire bytes of one message, fragmented at `chunk`.
+void sendMessage(size_t len, size_t chunk, Totals& t)
+{
+    size_t pdus = kq::DvcChunking(chunk).pdusFor(len);
+    size_t lenBytes = pdus == 1 ? 0 : len <= 0xFF ? 1 : len <= 0xFFFF ? 2 : 4;
+    t.payload += len;
+    t.wire += len + pdus * (kq::DvcChunking::dataHeaderSize + perPduOverhead) + lenBytes;
+    t.pdus += pdus;
+    t.writes += 1;
+}
+
+struct Read {
+    size_t len;
+    bool morePending;   // more data was already readable after this read
+};
+
+// A bulk copy: full 8 KiB reads with data always waiting, then a tail.
+std::vector<Read> bulk(uint64_t bytes)
+{
+    std::vector<Read> reads;
+    for (uint64_t sent = 0; sent < bytes; sent += 8192)
+        reads.push_back({8192, sent + 8192 < bytes});
+    return reads;
+}
+
+// read_some sizes spread over 1..8 KiB, usually with more waiting.
+std::vector<Read> mixed(uint64_t bytes, std::mt19937& rng)
+{
+    std::uniform_int_distribution<size_t> size(1, 8192);
+    std::bernoulli_distribution pending(0.8);
+    std::vector<Read> reads;
+    for (uint64_t sent = 0; sent < bytes;) {
+        size_t n = size(rng);
+        sent += n;
+        reads.push_back({n, sent < bytes && pending(rng)});
+    }
+    return reads;
+}
+
+// Keystrokes and screen updates of an SSH session: small, nothing waiting.
+std::vector<Read> interactive(uint64_t bytes, std::mt19937& rng)
+{
+    std::uniform_int_distribution<size_t> size(20, 400);
+    std::vector<Read> reads;
+    for (uint64_t sent = 0; sent < bytes;) {
+        size_t n = size(rng);
+        sent += n;
+        reads.push_back({n, false});
+    }
+    return reads;
+}
+
+// `alignTo` 0 writes every read as it comes, like the relay before PDU
+// alignment; otherwise writes are sized with DvcChunking at that chunk size.
+Totals run(std::vector<Read> const& reads, size_t alignTo)
+{
+    kq::DvcChunking chunking(alignTo);
+    Totals t;
+    size_t buffered = 0;
+    for (auto const& r : reads) {
+        buffered += r.len;
+        if (size_t len = chunking.writeSize(buffered, r.morePending)) {
+            sendMessage(len, rdpChunk, t);
+            buffered -= len;
+        }
+    }
+    if (buffered)
+        sendMessage(buffered, rdpChunk, t);
+    return t;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    bool quick = argc > 1 && std::strcmp(argv[1], "--quick") == 0;
+    uint64_t bytes = quick ? 4 << 20 : 256 << 20;
+    std::mt19937 rng(42);
+
+    struct Workload {
+        char const* name;
+        std::vector<Read> reads;
+    };
+    std::vector<Workload> workloads;
+    workloads.push_back({"bulk 8K reads", bulk(bytes)});
+    workloads.push_back({"mixed reads", mixed(bytes, rng)});
+    workloads.push_back({"interactive", interactive(bytes / 16, rng)});
+
+    struct Config {
+        char const* name;
+        size_t alignTo;
+    };
+    Config const configs[] = {
+        {"as read", 0},
+        {"aligned 1600", rdpChunk},
+        {"aligned 1598 (payload)", rdpChunk - kq::DvcChunking::dataHeaderSize},
+        {"aligned 4096 (wrong)", 4096},
+    };
+
+    std::printf("RDP chunk %zu B, %zu B framing per PDU\n\n", rdpChunk, perPduOverhead);
+    std::printf("%-14s %-24s %10s %10s %9s %9s\n", "workload", "write sizing", "writes/MB",
+        "PDUs/MB", "PDU fill", "goodput");
+    for (auto const& w : workloads) {
+        for (auto const& c : configs) {
+            Totals t = run(w.reads, c.alignTo);
+            double mb = static_cast<double>(t.payload) / (1 << 20);
+            double fill = static_cast<double>(t.payload)
+                / (static_cast<double>(t.pdus) * (rdpChunk - kq::DvcChunking::dataHeaderSize));
+            std::printf("%-14s %-24s %10.0f %10.0f %8.1f%% %8.2f%%\n", w.name, c.name,
+                static_cast<double>(t.writes) / mb, static_cast<double>(t.pdus) / mb,
+                100 * fill, 100.0 * static_cast<double>(t.payload) / static_cast<double>(t.wire));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,199 @@
+// The receive path of dvcToTcp over stand-ins: a SOCK_SEQPACKET socket pair
+// delivers one 1600-byte PDU (an 8-byte CHANNEL_PDU_HEADER and its payload)
+// per read, like the DVC file handle, and a stream socket pair stands in for
+// the TCP connection. Compares one write per PDU with the gather path:
+// non-blocking reads land back to back in an arena and go out as one writev
+// skipping the headers once a read would block or the batch reaches
+// maxGatherReads / maxGatherBytes. Reports syscalls per MB and throughput.
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "protocol.hpp"
+
+namespace {
+
+constexpr size_t pduHeader = 8;
+constexpr size_t pduSize = 1600;
+
+struct Result {
+    double syscallsPerMb = 0;
+    double writesPerMb = 0;
+    double mbPerSec = 0;
+    bool ok = false;
+};
+
+// The plugin side: writes `total` payload bytes as PDUs, in bursts of
+// `burst` with `gapUs` between bursts (0 = back to back).
+void produce(int fd, uint64_t total, size_t burst, int gapUs)
+{
+    std::vector<char> pdu(pduSize, 'p');
+    uint64_t sent = 0;
+    while (sent < total) {
+        for (size_t i = 0; i < burst && sent < total; ++i) {
+            size_t payload = static_cast<size_t>(std::min<uint64_t>(pduSize - pduHeader,
+                total - sent));
+            if (::send(fd, pdu.data(), pduHeader + payload, 0) < 0)
+                return;
+            sent += payload;
+        }
+        if (gapUs)
+            std::this_thread::sleep_for(std::chrono::microseconds(gapUs));
+    }
+    ::shutdown(fd, SHUT_WR);
+}
+
+// The TCP peer: reads everything and counts it.
+void consume(int fd, std::atomic<uint64_t>& received)
+{
+    std::vector<char> buf(256 * 1024);
+    for (;;) {
+        ssize_t n = ::read(fd, buf.data(), buf.size());
+        if (n <= 0)
+            return;
+        received += static_cast<uint64_t>(n);
+    }
+}
+
+// One blocking read and one write per PDU, as before batching.
+uint64_t relayPerPdu(int dvc, int tcp)
+{
+    std::vector<char> buf(kq::bufferSize);
+    uint64_t syscalls = 0;
+    for (;;) {
+        ssize_t n = ::recv(dvc, buf.data(), buf.size(), 0);
+        ++syscalls;
+        if (n <= 0)
+            return syscalls;
+        if (static_cast<size_t>(n) <= pduHeader)
+            continue;
+        if (::write(tcp, buf.data() + pduHeader, static_cast<size_t>(n) - pduHeader) < 0)
+            return syscalls;
+        ++syscalls;
+    }
+}
+
+// dvcToTcp's loop: a read that would block first sends the batch, then
+// waits; the arena is rewound only when a cap is reached.
+uint64_t relayGathered(int dvc, int tcp, uint64_t& writes)
+{
+    std::vector<char> arena(kq::maxGatherBytes + kq::bufferSize);
+    std::vector<iovec> batch;
+    size_t used = 0;
+    size_t reads = 0;
+    uint64_t syscalls = 0;
+
+    auto flush = [&] {
+        if (batch.empty())
+            return true;
+        // Batches stay far below IOV_MAX (maxGatherReads entries).
+        ssize_t n = ::writev(tcp, batch.data(), static_cast<int>(batch.size()));
+        ++syscalls;
+        ++writes;
+        batch.clear();
+        reads = 0;
+        return n >= 0;
+    };
+
+    for (;;) {
+        if (reads == kq::maxGatherReads || arena.size() - used < kq::bufferSize) {
+            if (!flush())
+                return syscalls;
+            used = 0;
+        }
+        char* buf = arena.data() + used;
+        ssize_t n = ::recv(dvc, buf, kq::bufferSize, MSG_DONTWAIT);
+        ++syscalls;
+        if (n < 0 && errno == EAGAIN) {
+            if (!flush())
+                return syscalls;
+            n = ::recv(dvc, buf, kq::bufferSize, 0);
+            ++syscalls;
+        }
+        if (n <= 0)
+            break;
+        if (static_cast<size_t>(n) <= pduHeader)
+            continue;
+        batch.push_back({buf + pduHeader, static_cast<size_t>(n) - pduHeader});
+        used += static_cast<size_t>(n);
+        ++reads;
+    }
+    flush();
+    return syscalls;
+}
+
+Result run(bool gather, uint64_t total, size_t burst, int gapUs)
+{
+    int dvc[2], tcp[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, dvc) != 0
+        || socketpair(AF_UNIX, SOCK_STREAM, 0, tcp) != 0)
+        return {};
+    // Room for a few bursts, like the RDP stack's receive queue.
+    int size = 1 << 20;
+    setsockopt(dvc[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(dvc[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    std::atomic<uint64_t> received{0};
+    auto start = std::chrono::steady_clock::now();
+    std::thread producer(produce, dvc[0], total, burst, gapUs);
+    std::thread peer(consume, tcp[1], std::ref(received));
+    uint64_t writes = 0;
+    uint64_t syscalls = gather ? relayGathered(dvc[1], tcp[0], writes) : relayPerPdu(dvc[1], tcp[0]);
+    if (!gather)
+        writes = syscalls / 2;
+    ::shutdown(tcp[0], SHUT_WR);
+    producer.join();
+    peer.join();
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (int fd : {dvc[0], dvc[1], tcp[0], tcp[1]})
+        close(fd);
+
+    double mb = static_cast<double>(total) / 1e6;
+    return {static_cast<double>(syscalls) / mb, static_cast<double>(writes) / mb, mb / sec,
+        received == total};
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    bool quick = argc > 1 && std::strcmp(argv[1], "--quick") == 0;
+    uint64_t total = quick ? 16 << 20 : 512 << 20;
+
+    std::printf("%zu B PDUs, caps %zu reads / %zu KiB\n\n", pduSize, kq::maxGatherReads,
+        kq::maxGatherBytes >> 10);
+    std::printf("%-26s %-9s %13s %11s %9s\n", "arrival", "relay", "syscalls/MB", "writes/MB",
+        "MB/s");
+    struct Arrival {
+        char const* name;
+        size_t burst;
+        int gapUs;
+    };
+    for (auto a : {Arrival{"back to back", 64, 0}, Arrival{"bursts of 16, 200 us apart", 16, 200},
+             Arrival{"single PDUs, 50 us apart", 1, 50}}) {
+        uint64_t bytes = a.gapUs ? total / 16 : total;
+        for (bool gather : {false, true}) {
+            Result r = run(gather, bytes, a.burst, a.gapUs);
+            if (!r.ok) {
+                std::printf("relay failed\n");
+                return 1;
+            }
+            std::printf("%-26s %-9s %13.0f %11.0f %9.0f\n", a.name, gather ? "gather" : "per PDU",
+                r.syscallsPerMb, r.writesPerMb, r.mbPerSec);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,409 @@
+// The server's two relay loops over stand-ins: a SOCK_SEQPACKET socket pair
+// is the DVC (one PDU per read, an 8-byte CHANNEL_PDU_HEADER in front of
+// what comes from the plugin) and a stream socket pair is the TCP
+// connection. `threads` is dvcToTcp/tcpToDvc without gathering: one blocking
+// thread per direction. `iocp` is IocpRelay's shape: one thread, at most one
+// read or write outstanding per direction, a write issued as soon as its
+// read completes, and one wait per completion (poll() stands in for the
+// completion port). Neither dedups, spills or stripes, as IocpRelay does
+// none of that. Reports throughput, the relay's CPU time, context switches
+// and syscalls, and echo latency.
+
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "protocol.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t pduHeader = 8;
+constexpr size_t pduSize = 1600;
+constexpr size_t echoSize = 64;
+
+enum class Shape { threads, iocp };
+
+// What the relay's threads used, summed over them.
+struct Usage {
+    double cpuMs = 0;
+    uint64_t switches = 0;
+    uint64_t syscalls = 0;
+};
+
+// The calling thread's totals; relay threads are new for every run.
+Usage threadUsage(uint64_t syscalls)
+{
+    rusage ru{};
+    getrusage(RUSAGE_THREAD, &ru);
+    auto ms = [](timeval tv) {
+        return static_cast<double>(tv.tv_sec) * 1e3 + static_cast<double>(tv.tv_usec) / 1e3;
+    };
+    return {ms(ru.ru_utime) + ms(ru.ru_stime),
+        static_cast<uint64_t>(ru.ru_nvcsw + ru.ru_nivcsw), syscalls};
+}
+
+bool writeAll(int fd, char const* data, size_t len, uint64_t& syscalls)
+{
+    while (len > 0) {
+        ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL);
+        ++syscalls;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool readAll(int fd, char* data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = ::read(fd, data, len);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// --- the relays --------------------------------------------------------------
+
+// End of input is passed on as a half-close so the far side sees it too.
+void threadedDvcToTcp(int dvc, int tcp, Usage& usage)
+{
+    std::vector<char> buf(kq::bufferSize);
+    uint64_t syscalls = 0;
+    for (;;) {
+        ssize_t n = ::recv(dvc, buf.data(), buf.size(), 0);
+        ++syscalls;
+        if (n <= 0)
+            break;
+        if (static_cast<size_t>(n) > pduHeader
+            && !writeAll(tcp, buf.data() + pduHeader, static_cast<size_t>(n) - pduHeader,
+                syscalls))
+            break;
+    }
+    ::shutdown(tcp, SHUT_WR);
+    usage = threadUsage(syscalls + 1);
+}
+
+void threadedTcpToDvc(int tcp, int dvc, Usage& usage)
+{
+    std::vector<char> buf(kq::bufferSize);
+    uint64_t syscalls = 0;
+    for (;;) {
+        ssize_t n = ::read(tcp, buf.data(), buf.size());
+        ++syscalls;
+        if (n <= 0)
+            break;
+        ++syscalls;
+        if (::send(dvc, buf.data(), static_cast<size_t>(n), MSG_NOSIGNAL) < 0)
+            break;
+    }
+    ::shutdown(dvc, SHUT_WR);
+    usage = threadUsage(syscalls + 1);
+}
+
+// One direction of the single-threaded relay: the buffer is either waiting
+// for a read or holding data still to be written.
+struct Leg {
+    int from;
+    int to;
+    size_t header;   // bytes skipped in front of every read
+    std::vector<char> buf = std::vector<char>(kq::bufferSize);
+    size_t off = 0;
+    size_t len = 0;
+    bool done = false;
+
+    bool writing() const { return off < len; }
+};
+
+// One completion: a read, and the write it starts right away, or the rest
+// of a write that could not finish at once.
+void step(Leg& leg, uint64_t& syscalls)
+{
+    if (!leg.writing()) {
+        ssize_t n = ::recv(leg.from, leg.buf.data(), leg.buf.size(), MSG_DONTWAIT);
+        ++syscalls;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0) {
+            ::shutdown(leg.to, SHUT_WR);
+            ++syscalls;
+            leg.done = true;
+            return;
+        }
+        leg.len = static_cast<size_t>(n);
+        leg.off = std::min(leg.header, leg.len);
+    }
+    if (leg.writing()) {
+        ssize_t n = ::send(leg.to, leg.buf.data() + leg.off, leg.len - leg.off,
+            MSG_DONTWAIT | MSG_NOSIGNAL);
+        ++syscalls;
+        if (n > 0)
+            leg.off += static_cast<size_t>(n);
+        else if (errno != EAGAIN)
+            leg.done = true;
+    }
+}
+
+void eventLoop(int dvc, int tcp, Usage& usage)
+{
+    Leg down{dvc, tcp, pduHeader};
+    Leg up{tcp, dvc, 0};
+    uint64_t syscalls = 0;
+    auto want = [](Leg const& leg, short& fromEvents, short& toEvents) {
+        if (leg.done)
+            return;
+        if (leg.writing())
+            toEvents |= POLLOUT;
+        else
+            fromEvents |= POLLIN;
+    };
+    while (!down.done || !up.done) {
+        short dvcEvents = 0, tcpEvents = 0;
+        want(down, dvcEvents, tcpEvents);
+        want(up, tcpEvents, dvcEvents);
+        // An fd nobody waits on is left out, or its hangup would spin us.
+        pollfd fds[] = {{dvcEvents ? dvc : -1, dvcEvents, 0},
+            {tcpEvents ? tcp : -1, tcpEvents, 0}};
+        ++syscalls;
+        if (::poll(fds, 2, -1) < 0)
+            break;
+        if (!down.done && (down.writing() ? fds[1] : fds[0]).revents)
+            step(down, syscalls);
+        if (!up.done && (up.writing() ? fds[0] : fds[1]).revents)
+            step(up, syscalls);
+    }
+    usage = threadUsage(syscalls);
+}
+
+// Runs the relay until both directions have ended.
+Usage runRelay(Shape shape, int dvc, int tcp)
+{
+    Usage a, b;
+    if (shape == Shape::threads) {
+        std::thread t1(threadedDvcToTcp, dvc, tcp, std::ref(a));
+        std::thread t2(threadedTcpToDvc, tcp, dvc, std::ref(b));
+        t1.join();
+        t2.join();
+    } else {
+        std::thread t(eventLoop, dvc, tcp, std::ref(a));
+        t.join();
+    }
+    return {a.cpuMs + b.cpuMs, a.switches + b.switches, a.syscalls + b.syscalls};
+}
+
+// --- the ends ----------------------------------------------------------------
+
+// The plugin: `total` payload bytes as PDUs.
+void pluginSend(int fd, uint64_t total)
+{
+    std::vector<char> pdu(pduSize, 'd');
+    for (uint64_t sent = 0; sent < total;) {
+        size_t payload = static_cast<size_t>(std::min<uint64_t>(pduSize - pduHeader,
+            total - sent));
+        if (::send(fd, pdu.data(), pduHeader + payload, MSG_NOSIGNAL) < 0)
+            break;
+        sent += payload;
+    }
+    ::shutdown(fd, SHUT_WR);
+}
+
+// The TCP peer: `total` bytes in 16 KiB writes.
+void appSend(int fd, uint64_t total)
+{
+    std::vector<char> buf(16 * 1024, 'u');
+    uint64_t syscalls = 0;
+    for (uint64_t sent = 0; sent < total;) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(buf.size(), total - sent));
+        if (!writeAll(fd, buf.data(), n, syscalls))
+            break;
+        sent += n;
+    }
+    ::shutdown(fd, SHUT_WR);
+}
+
+void receive(int fd, uint64_t& received)
+{
+    std::vector<char> buf(64 * 1024);
+    for (;;) {
+        ssize_t n = ::read(fd, buf.data(), buf.size());
+        if (n <= 0)
+            return;
+        received += static_cast<uint64_t>(n);
+    }
+}
+
+// The plugin answering every message with a PDU carrying it.
+void pluginEcho(int fd)
+{
+    std::vector<char> buf(pduHeader + kq::bufferSize);
+    uint64_t syscalls = 0;
+    for (;;) {
+        ssize_t n = ::recv(fd, buf.data() + pduHeader, kq::bufferSize, 0);
+        if (n <= 0
+            || !writeAll(fd, buf.data(), pduHeader + static_cast<size_t>(n), syscalls))
+            break;
+    }
+    ::shutdown(fd, SHUT_WR);
+}
+
+// The TCP peer: `count` round trips of echoSize bytes, one at a time.
+void appPing(int fd, int count, std::vector<double>& latencies)
+{
+    char out[echoSize] = {'e'};
+    char in[echoSize];
+    uint64_t syscalls = 0;
+    for (int i = 0; i < count; ++i) {
+        auto start = Clock::now();
+        if (!writeAll(fd, out, sizeof(out), syscalls) || !readAll(fd, in, sizeof(in)))
+            break;
+        latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start)
+            .count());
+    }
+    ::shutdown(fd, SHUT_WR);
+    while (::read(fd, in, sizeof(in)) > 0) {
+    }
+}
+
+// --- runs --------------------------------------------------------------------
+
+struct Sockets {
+    int dvc[2];   // [0] plugin, [1] relay
+    int tcp[2];   // [0] relay, [1] TCP peer
+
+    Sockets()
+    {
+        socketpair(AF_UNIX, SOCK_SEQPACKET, 0, dvc);
+        socketpair(AF_UNIX, SOCK_STREAM, 0, tcp);
+        // Room for a few bursts, like the RDP stack's receive queue.
+        int size = 1 << 20;
+        for (int fd : dvc) {
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        }
+    }
+
+    ~Sockets()
+    {
+        for (int fd : {dvc[0], dvc[1], tcp[0], tcp[1]})
+            close(fd);
+    }
+};
+
+struct Bulk {
+    double mbPerSec = 0;
+    double cpuMsPerGb = 0;
+    double switchesPerMb = 0;
+    double syscallsPerMb = 0;
+    bool ok = false;
+};
+
+Bulk runBulk(Shape shape, uint64_t down, uint64_t up)
+{
+    Sockets s;
+    uint64_t gotDown = 0, gotUp = 0;
+    auto start = Clock::now();
+    std::thread plugin(pluginSend, s.dvc[0], down);
+    std::thread pluginRx(receive, s.dvc[0], std::ref(gotUp));
+    std::thread app(appSend, s.tcp[1], up);
+    std::thread appRx(receive, s.tcp[1], std::ref(gotDown));
+    Usage usage = runRelay(shape, s.dvc[1], s.tcp[0]);
+    for (auto* t : {&plugin, &pluginRx, &app, &appRx})
+        t->join();
+    double sec = std::chrono::duration<double>(Clock::now() - start).count();
+
+    double mb = static_cast<double>(down + up) / 1e6;
+    return {mb / sec, usage.cpuMs * 1e3 / mb, static_cast<double>(usage.switches) / mb,
+        static_cast<double>(usage.syscalls) / mb, gotDown == down && gotUp == up};
+}
+
+struct Echo {
+    double p50Us = 0;
+    double p99Us = 0;
+    double cpuUs = 0;        // per round trip
+    double switches = 0;     // per round trip
+    bool ok = false;
+};
+
+Echo runEcho(Shape shape, int count)
+{
+    Sockets s;
+    std::vector<double> latencies;
+    latencies.reserve(static_cast<size_t>(count));
+    std::thread plugin(pluginEcho, s.dvc[0]);
+    std::thread app(appPing, s.tcp[1], count, std::ref(latencies));
+    Usage usage = runRelay(shape, s.dvc[1], s.tcp[0]);
+    plugin.join();
+    app.join();
+    if (latencies.size() != static_cast<size_t>(count))
+        return {};
+
+    std::sort(latencies.begin(), latencies.end());
+    return {latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100],
+        usage.cpuMs * 1e3 / count, static_cast<double>(usage.switches) / count, true};
+}
+
+char const* name(Shape shape)
+{
+    return shape == Shape::threads ? "threads" : "iocp";
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    bool quick = argc > 1 && std::strcmp(argv[1], "--quick") == 0;
+    uint64_t total = quick ? 16 << 20 : 512 << 20;
+    int echoes = quick ? 1000 : 20000;
+
+    std::printf("%u CPUs, %zu B PDUs, %zu B reads\n\n", std::thread::hardware_concurrency(),
+        pduSize, kq::bufferSize);
+    std::printf("%-22s %-8s %9s %13s %13s %13s\n", "bulk", "relay", "MB/s", "CPU ms/GB",
+        "switches/MB", "syscalls/MB");
+    struct Load {
+        char const* name;
+        uint64_t down;
+        uint64_t up;
+    };
+    for (auto l : {Load{"DVC -> TCP", total, 0}, Load{"TCP -> DVC", 0, total},
+             Load{"both ways", total / 2, total / 2}}) {
+        for (Shape shape : {Shape::threads, Shape::iocp}) {
+            Bulk r = runBulk(shape, l.down, l.up);
+            if (!r.ok) {
+                std::printf("%s relay lost data\n", name(shape));
+                return 1;
+            }
+            std::printf("%-22s %-8s %9.0f %13.0f %13.1f %13.0f\n", l.name, name(shape),
+                r.mbPerSec, r.cpuMsPerGb, r.switchesPerMb, r.syscallsPerMb);
+        }
+    }
+
+    std::printf("\n%-22s %-8s %9s %9s %13s %13s\n", "echo", "relay", "p50 us", "p99 us",
+        "CPU us/echo", "switches/echo");
+    for (Shape shape : {Shape::threads, Shape::iocp}) {
+        Echo r = runEcho(shape, echoes);
+        if (!r.ok) {
+            std::printf("%s relay lost an echo\n", name(shape));
+            return 1;
+        }
+        std::printf("%-22s %-8s %9.1f %9.1f %13.1f %13.2f\n", "64 B, one at a time",
+            name(shape), r.p50Us, r.p99Us, r.cpuUs, r.switches);
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+// Client -> plugin stream throughput over the shared-memory transport
+// against a Unix socket pair, the Linux stand-in for the named pipe: one
+// thread writes in pieces of a given size, another reads and checks. Also
+// reports voluntary context switches per MB, i.e. how often a side slept.
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "shm_ring.hpp"
+
+namespace {
+
+struct Result {
+    double mbPerSec = 0;
+    double switchesPerMb = 0;
+    bool ok = false;
+};
+
+long switches()
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw;
+}
+
+template <typename Write, typename Read>
+Result measure(uint64_t total, size_t piece, Write&& write, Read&& read)
+{
+    long before = switches();
+    auto start = std::chrono::steady_clock::now();
+    std::thread writer([&] {
+        std::vector<char> buf(piece, 'k');
+        for (uint64_t sent = 0; sent < total;)
+            sent += write(buf.data(), std::min<uint64_t>(piece, total - sent));
+    });
+    std::vector<char> buf(64 * 1024);
+    uint64_t received = 0;
+    while (received < total) {
+        size_t n = read(buf.data(), buf.size());
+        if (n == 0 && received < total)
+            break;
+        received += n;
+    }
+    writer.join();
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double mb = static_cast<double>(total) / 1e6;
+    return {mb / sec, static_cast<double>(switches() - before) / mb, received == total};
+}
+
+Result overSharedMemory(uint64_t total, size_t piece)
+{
+    kq::shm::Transport client, plugin;
+    std::string name = "/kq-shm-bench-" + std::to_string(getpid());
+    if (!client.create(name, kq::shm::defaultCapacity) || !plugin.open(name))
+        return {};
+    return measure(total, piece,
+        [&](char const* data, size_t len) {
+            for (size_t done = 0; done < len;) {
+                size_t n = client.tx().write(data + done, len - done);
+                if (n > 0)
+                    client.notifyWritten();
+                else if (client.tx().parkWriter())
+                    client.waitTx(1000);
+                done += n;
+            }
+            return len;
+        },
+        [&](char* data, size_t len) {
+            for (;;) {
+                if (size_t n = plugin.rx().read(data, len)) {
+                    plugin.notifyRead();
+                    return n;
+                }
+                if (plugin.rx().parkReader())
+                    plugin.waitRx(1000);
+            }
+        });
+}
+
+Result overSocket(uint64_t total, size_t piece)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return {};
+    Result r = measure(total, piece,
+        [&](char const* data, size_t len) {
+            for (size_t done = 0; done < len;) {
+                ssize_t n = ::write(fds[0], data + done, len - done);
+                if (n <= 0)
+                    return done;
+                done += static_cast<size_t>(n);
+            }
+            return len;
+        },
+        [&](char* data, size_t len) {
+            ssize_t n = ::read(fds[1], data, len);
+            return n > 0 ? static_cast<size_t>(n) : 0;
+        });
+    close(fds[0]);
+    close(fds[1]);
+    return r;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    bool quick = argc > 1 && std::strcmp(argv[1], "--quick") == 0;
+    uint64_t total = quick ? 32 << 20 : 1ull << 30;
+
+    std::printf("%llu MiB per run, %zu KiB rings\n\n",
+        static_cast<unsigned long long>(total >> 20), kq::shm::defaultCapacity >> 10);
+    std::printf("%-10s %-14s %10s %14s\n", "write", "transport", "MB/s", "switches/MB");
+    for (size_t piece : {256, 1500, 8192, 65536}) {
+        struct Run {
+            char const* name;
+            Result r;
+        };
+        for (auto const& [name, r] : {Run{"shared memory", overSharedMemory(total, piece)},
+                 Run{"unix socket", overSocket(total, piece)}}) {
+            if (!r.ok) {
+                std::printf("%s failed\n", name);
+                return 1;
+            }
+            std::printf("%-10zu %-14s %10.0f %14.2f\n", piece, name, r.mbPerSec,
+                r.switchesPerMb);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,165 @@
+// The server's SpillWriter around a SpillQueue: a reader thread pushes DVC
+// data in gather-sized pieces at a fixed source rate, a writer thread pops
+// and "writes to TCP" at a slower sink rate, under one mutex and condition
+// variable as in the server. Reports how long the reader was blocked, how
+// much went through the file and the peak spill, for memory-only queues and
+// with a spill file; then the raw push/pop throughput of the file tier.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "spill_queue.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t piece = 256 * 1024;   // kq::maxGatherBytes
+
+std::string spillPath()
+{
+    return (std::filesystem::temp_directory_path() / "kq-spill-bench.tmp").string();
+}
+
+struct Result {
+    double blockedSec = 0;   // reader time spent waiting for room
+    double totalSec = 0;
+    size_t peakSpilled = 0;
+    bool ok = false;
+};
+
+// `total` bytes arrive at `sourceRate` and leave at `sinkRate` (bytes/s).
+Result run(uint64_t total, double sourceRate, double sinkRate, size_t threshold,
+    size_t spillCapacity)
+{
+    kq::SpillQueue<> queue(threshold);
+    if (spillCapacity)
+        queue.enableSpill(spillPath(), spillCapacity);
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool finishing = false;
+    uint64_t written = 0;
+    uint64_t checksum = 0;
+
+    auto start = Clock::now();
+    std::thread writer([&] {
+        std::vector<char> buf;
+        auto next = Clock::now();
+        for (;;) {
+            {
+                std::unique_lock lock(mtx);
+                cv.wait(lock, [&] { return finishing || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                buf.clear();
+                queue.pop(buf);
+            }
+            cv.notify_all();
+            for (char c : buf)
+                checksum += static_cast<unsigned char>(c);
+            written += buf.size();
+            next += std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(static_cast<double>(buf.size()) / sinkRate));
+            std::this_thread::sleep_until(next);
+        }
+    });
+
+    std::vector<char> data(piece);
+    Clock::duration blocked{};
+    uint64_t expected = 0;
+    auto next = start;
+    for (uint64_t sent = 0; sent < total; sent += piece) {
+        std::memset(data.data(), static_cast<int>(sent / piece % 251), data.size());
+        expected += static_cast<uint64_t>(sent / piece % 251) * piece;
+        next += std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(piece / sourceRate));
+        std::this_thread::sleep_until(next);
+        auto before = Clock::now();
+        {
+            std::unique_lock lock(mtx);
+            cv.wait(lock, [&] { return queue.push(data.data(), data.size()); });
+        }
+        cv.notify_all();
+        blocked += Clock::now() - before;
+    }
+    {
+        std::lock_guard lock(mtx);
+        finishing = true;
+    }
+    cv.notify_all();
+    writer.join();
+
+    return {std::chrono::duration<double>(blocked).count(),
+        std::chrono::duration<double>(Clock::now() - start).count(), queue.peakSpilled(),
+        written == total && checksum == expected};
+}
+
+// Push until the file is full, then pop it all, single-threaded.
+void fileThroughput(size_t capacity, int rounds)
+{
+    kq::SpillQueue<> queue(0);
+    queue.enableSpill(spillPath(), capacity);
+    std::vector<char> data(piece, 'x');
+    std::vector<char> out;
+    uint64_t bytes = 0;
+    double pushSec = 0, popSec = 0;
+    for (int r = 0; r < rounds; ++r) {
+        auto t0 = Clock::now();
+        while (queue.push(data.data(), data.size()))
+            bytes += data.size();
+        auto t1 = Clock::now();
+        while (!queue.empty()) {
+            out.clear();
+            queue.pop(out);
+        }
+        auto t2 = Clock::now();
+        pushSec += std::chrono::duration<double>(t1 - t0).count();
+        popSec += std::chrono::duration<double>(t2 - t1).count();
+    }
+    double mb = static_cast<double>(bytes) / 1e6;
+    std::printf("\nfile tier, %zu MiB ring: push %.0f MB/s, pop %.0f MB/s\n", capacity >> 20,
+        mb / pushSec, mb / popSec);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    bool quick = argc > 1 && std::strcmp(argv[1], "--quick") == 0;
+    uint64_t total = quick ? 32 << 20 : 256 << 20;
+    double source = quick ? 400e6 : 200e6;
+    double sink = source / 4;
+
+    std::printf("%llu MiB burst at %.0f MB/s into a %.0f MB/s sink, %zu KiB pieces\n\n",
+        static_cast<unsigned long long>(total >> 20), source / 1e6, sink / 1e6, piece >> 10);
+    std::printf("%-30s %12s %10s %14s\n", "queue", "reader wait", "total", "peak spilled");
+    struct Config {
+        char const* name;
+        size_t threshold;
+        size_t spill;
+    };
+    for (auto const& c : {Config{"memory 4 MiB", 4 << 20, 0},
+             Config{"memory 4 MiB + 256 MiB file", 4 << 20, 256 << 20},
+             Config{"memory 4 MiB + 16 MiB file", 4 << 20, 16 << 20}}) {
+        Result r = run(total, source, sink, c.threshold, c.spill);
+        if (!r.ok) {
+            std::printf("%s: data lost or corrupted\n", c.name);
+            return 1;
+        }
+        std::printf("%-30s %10.2f s %8.2f s %10zu KiB\n", c.name, r.blockedSec, r.totalSec,
+            r.peakSpilled >> 10);
+    }
+
+    fileThroughput(quick ? 32 << 20 : 256 << 20, quick ? 2 : 8);
+    std::filesystem::remove(spillPath());
+    return 0;
+}
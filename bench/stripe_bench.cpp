@@ -0,0 +1,155 @@
+// Striping over N stand-in transports with injected latency: an event
+// simulation of the server's tcpToStripes sender (round-robin, one write in
+// flight per stripe) and a receiver feeding the real StripeFrameParser and
+// ReorderBuffer. Each stripe carries a fixed bandwidth and delivers in order
+// after a base latency plus random jitter; optionally all stripes also share
+// one link of limited bandwidth, as DVCs share one RDP connection. Reports
+// throughput against the stripe count, the reorder buffer's peak memory and
+// how long frames wait in it.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "stripe.hpp"
+
+namespace {
+
+struct Link {
+    double bytesPerSec;         // per stripe
+    double sharedBytesPerSec;   // all stripes together, 0 = no shared limit
+    double latencySec;
+    double jitterSec;           // uniform 0..jitter on top of the latency
+};
+
+struct Result {
+    double throughput;   // bytes per second, end to end
+    size_t peakReorder;  // bytes
+    double p50WaitMs;
+    double p99WaitMs;
+};
+
+struct Arrival {
+    double at;
+    size_t stripe;
+    uint32_t seq;
+};
+
+Result simulate(size_t stripes, Link link, uint64_t totalBytes, std::mt19937& rng)
+{
+    constexpr size_t frameSize = kq::bufferSize;
+    constexpr size_t pduPayload = 1598;
+    size_t frames = static_cast<size_t>(totalBytes / frameSize);
+
+    std::uniform_real_distribution<double> jitter(0, link.jitterSec);
+    std::vector<double> stripeFree(stripes, 0);
+    std::vector<double> lastArrival(stripes, 0);
+    double sharedFree = 0;
+    std::vector<Arrival> arrivals;
+    arrivals.reserve(frames);
+
+    // Sender: frame i goes to stripe i % N once that stripe finished its
+    // previous write; frames are written in sequence order.
+    double now = 0;
+    for (size_t i = 0; i < frames; ++i) {
+        size_t s = i % stripes;
+        auto bytes = static_cast<double>(frameSize + kq::stripeFrameHeaderSize);
+        now = std::max(now, stripeFree[s]);
+        stripeFree[s] = now + bytes / link.bytesPerSec;
+        double sent = stripeFree[s];
+        if (link.sharedBytesPerSec > 0) {
+            sharedFree = std::max(sharedFree, now) + bytes / link.sharedBytesPerSec;
+            sent = std::max(sent, sharedFree);
+            stripeFree[s] = sent;
+        }
+        double at = std::max(sent + link.latencySec + jitter(rng), lastArrival[s]);
+        lastArrival[s] = at;
+        arrivals.push_back({at, s, static_cast<uint32_t>(i)});
+    }
+
+    // Receiver: frames arrive in time order, each stripe's bytes go through
+    // its parser in PDU-sized pieces, and the reorder buffer restores order.
+    std::vector<double> arrivedAt(frames);
+    for (auto const& a : arrivals)
+        arrivedAt[a.seq] = a.at;
+    std::stable_sort(arrivals.begin(), arrivals.end(),
+        [](Arrival const& x, Arrival const& y) { return x.at < y.at; });
+
+    std::vector<kq::StripeFrameParser> parsers(stripes);
+    kq::ReorderBuffer reorder(SIZE_MAX);
+    std::vector<char> out;
+    std::vector<char> frame(kq::stripeFrameHeaderSize + frameSize, 'x');
+    uint64_t delivered = 0;
+    auto onFrame = [&](uint32_t seq, char const* data, size_t len) {
+        return reorder.push(seq, data, len, out);
+    };
+    for (auto const& a : arrivals) {
+        kq::StripeFrameHeader header{a.seq, static_cast<uint32_t>(frameSize)};
+        std::memcpy(frame.data(), &header, sizeof(header));
+        for (size_t pos = 0; pos < frame.size(); pos += pduPayload) {
+            size_t n = std::min(pduPayload, frame.size() - pos);
+            if (!parsers[a.stripe].feed(frame.data() + pos, n, onFrame))
+                return {};
+        }
+        delivered += out.size();
+        out.clear();
+    }
+    if (delivered != frames * frameSize)
+        return {};
+
+    // A frame leaves the reorder buffer once all before it have arrived.
+    std::vector<double> waits;
+    waits.reserve(frames);
+    double ready = 0;
+    for (size_t i = 0; i < frames; ++i) {
+        ready = std::max(ready, arrivedAt[i]);
+        waits.push_back((ready - arrivedAt[i]) * 1000);
+    }
+    std::sort(waits.begin(), waits.end());
+
+    return {static_cast<double>(delivered) / ready, reorder.peak(), waits[waits.size() / 2],
+        waits[waits.size() * 99 / 100]};
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    bool quick = argc > 1 && std::strcmp(argv[1], "--quick") == 0;
+    uint64_t total = quick ? 16 << 20 : 512 << 20;
+    std::mt19937 rng(7);
+
+    double const perStripe = 8e6;
+    std::printf("per stripe %.0f MB/s, %.0f KiB frames\n\n", perStripe / 1e6,
+        kq::bufferSize / 1024.0);
+    std::printf("%-34s %7s %10s %8s %14s %11s %11s\n", "latency + jitter", "stripes",
+        "MB/s", "speedup", "reorder peak", "wait p50", "wait p99");
+    struct Scenario {
+        double jitterMs;
+        double sharedMBps;
+    };
+    for (auto [jitterMs, sharedMBps] : {Scenario{0, 0}, Scenario{10, 0}, Scenario{40, 0},
+             Scenario{10, 30}}) {
+        Link link{perStripe, sharedMBps * 1e6, 0.020, jitterMs / 1000};
+        double base = 0;
+        for (size_t stripes : {1, 2, 3, 4, 6, 8}) {
+            Result r = simulate(stripes, link, total, rng);
+            if (r.throughput == 0) {
+                std::printf("simulation failed\n");
+                return 1;
+            }
+            if (stripes == 1)
+                base = r.throughput;
+            char label[48];
+            std::snprintf(label, sizeof(label), "20 ms + 0..%.0f ms%s", jitterMs,
+                sharedMBps ? ", 30 MB/s shared" : "");
+            std::printf("%-34s %7zu %10.1f %7.2fx %10.0f KiB %8.2f ms %8.2f ms\n", label,
+                stripes, r.throughput / 1e6, r.throughput / base,
+                static_cast<double>(r.peakReorder) / 1024, r.p50WaitMs, r.p99WaitMs);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+// Cost of leaving the trace ring enabled: ns per record() call with tracing
+// off, on, and on with payload prefixes, from 1..4 threads, and the share
+// that adds to a relay loop moving 16 KiB per read/write pair. The relay
+// loop only copies memory, so it is the worst case; a real one spends
+// microseconds per step in the kernel.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trace.hpp"
+
+using namespace kq::trace;
+using BenchClock = std::chrono::steady_clock;
+
+namespace {
+
+enum class Mode { off, on, prefix };
+
+char const* name(Mode mode)
+{
+    switch (mode) {
+    case Mode::off: return "off";
+    case Mode::on: return "on";
+    case Mode::prefix: return "on+32B prefix";
+    }
+    return "";
+}
+
+void configure(Mode mode, std::string const& path)
+{
+    // There is no disable(); "off" is measured before the first enable.
+    if (mode != Mode::off)
+        Recorder::instance().enable(path, mode == Mode::prefix ? maxPrefix : 0);
+}
+
+double threadCpuNs()
+{
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<double>(ts.tv_sec) * 1e9 + static_cast<double>(ts.tv_nsec);
+}
+
+// CPU ns per record() call, averaged over `threads` threads recording at
+// once; thread CPU time keeps time-slicing out of it on small machines.
+double recordCost(int threads, uint64_t calls)
+{
+    std::vector<std::thread> workers;
+    std::vector<double> ns(static_cast<size_t>(threads));
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            char payload[64] = {};
+            double start = threadCpuNs();
+            for (uint64_t i = 0; i < calls; ++i)
+                record(Event::read, Direction::dvcToTcp, i, 0, payload, sizeof(payload));
+            ns[static_cast<size_t>(t)] = (threadCpuNs() - start) / static_cast<double>(calls);
+        });
+    }
+    for (auto& w : workers)
+        w.join();
+    double sum = 0;
+    for (double v : ns)
+        sum += v;
+    return sum / threads;
+}
+
+// ns per 16 KiB relay step: copy in, copy out, and the three records the
+// relay makes for it (read, write, wait).
+double relayStep(uint64_t steps)
+{
+    std::vector<char> in(16384, 'x'), mid(16384), out(16384);
+    auto start = BenchClock::now();
+    for (uint64_t i = 0; i < steps; ++i) {
+        in[i % in.size()] = static_cast<char>(i);
+        std::memcpy(mid.data(), in.data(), in.size());
+        record(Event::read, Direction::dvcToTcp, mid.size(), 0, mid.data(), mid.size());
+        std::memcpy(out.data(), mid.data(), mid.size());
+        record(Event::write, Direction::dvcToTcp, out.size());
+        record(Event::wait, Direction::none, 0, 0);
+    }
+    auto elapsed = BenchClock::now() - start;
+    volatile char sink = out[steps % out.size()];
+    (void)sink;
+    return std::chrono::duration<double, std::nano>(elapsed).count()
+        / static_cast<double>(steps);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    bool quick = argc > 1 && std::strcmp(argv[1], "--quick") == 0;
+    uint64_t calls = quick ? 200000 : 20000000;
+    uint64_t steps = quick ? 20000 : 1000000;
+    auto path = (std::filesystem::temp_directory_path() / "kq-trace-bench.bin").string();
+
+    std::printf("%-14s %12s %12s %12s %22s\n", "trace", "ns/rec 1thr", "ns/rec 2thr",
+        "ns/rec 4thr", "ns/16K relay step");
+    double baseline = 0;
+    for (Mode mode : {Mode::off, Mode::on, Mode::prefix}) {
+        configure(mode, path);
+        double c1 = recordCost(1, calls);
+        double c2 = recordCost(2, calls);
+        double c4 = recordCost(4, calls);
+        double relay = relayStep(steps);
+        if (mode == Mode::off)
+            baseline = relay;
+        std::printf("%-14s %12.1f %12.1f %12.1f %12.0f (%+5.1f%%)\n", name(mode), c1, c2, c4,
+            relay, 100.0 * (relay - baseline) / baseline);
+    }
+
+    auto start = BenchClock::now();
+    bool ok = Recorder::instance().dump();
+    auto dumpMs = std::chrono::duration<double, std::milli>(BenchClock::now() - start).count();
+    std::printf("dump of %zu bytes: %.1f ms\n",
+        ok ? static_cast<size_t>(std::filesystem::file_size(path)) : size_t{0}, dumpMs);
+    std::filesystem::remove(path);
+    return ok ? 0 : 1;
+}
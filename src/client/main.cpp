@@ -1,3 +1,10 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
 #include <string>
 #include <string_view>
 #include <thread>
@@ -8,14 +15,29 @@
 
 #include <windows.h>
 
+#include "dedup.hpp"
+#include "options.hpp"
 #include "protocol.hpp"
+#include "session_router.hpp"
+#include "shm_ring.hpp"
+#include "trace.hpp"
 
 namespace {
 
-bool waitForIo(HANDLE file, OVERLAPPED& ov, DWORD& bytes, HANDLE cancelEvent)
+namespace trace = kq::trace;
+
+// A pipe instance that cannot be created or connected is retried this often,
+// this far apart, before the client gives up.
+constexpr unsigned maxPipeFailures = 10;
+constexpr std::chrono::seconds pipeRetryDelay{1};
+
+bool waitForIo(HANDLE file, OVERLAPPED& ov, DWORD& bytes, HANDLE cancelEvent,
+    trace::Direction direction)
 {
     HANDLE handles[] = {ov.hEvent, cancelEvent};
+    int64_t start = trace::nowNs();
     DWORD wait = WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+    trace::record(trace::Event::wait, direction, 0, trace::nowNs() - start);
     if (wait == WAIT_OBJECT_0) {
         return GetOverlappedResult(file, &ov, &bytes, FALSE);
     }
@@ -24,104 +46,279 @@ bool waitForIo(HANDLE file, OVERLAPPED& ov, DWORD& bytes, HANDLE cancelEvent)
     return false;
 }
 
-HANDLE createPipe()
+// The process's first instance is created with FILE_FLAG_FIRST_PIPE_INSTANCE,
+// so a second client, or anything else holding the name, fails here instead
+// of sharing the plugins.
+HANDLE createPipe(bool first)
 {
     HANDLE pipe = CreateNamedPipeA(
         kq::pipeName,
-        PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+        PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
         PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
-        1,
+        PIPE_UNLIMITED_INSTANCES,
         kq::bufferSize,
         kq::bufferSize,
         0,
         nullptr);
 
     if (pipe == INVALID_HANDLE_VALUE) {
-        spdlog::error("Failed to create named pipe (error {})", GetLastError());
+        DWORD err = GetLastError();
+        if (first && err == ERROR_ACCESS_DENIED)
+            spdlog::error("{} is already in use; is another kq-tunnel-client running?",
+                kq::pipeName);
+        else
+            spdlog::error("Failed to create named pipe (error {})", err);
     }
     return pipe;
 }
 
-void pipeToTcp(HANDLE pipe, asio::ip::tcp::socket& socket, HANDLE cancelEvent)
+// The stream to the plugin: the pipe, or the shared-memory rings agreed in
+// the handshake. In shared-memory mode nothing more is sent on the pipe; a
+// one-byte read stays pending on it and sets closedEvent when the plugin
+// goes away.
+struct PluginLink {
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    kq::SessionKey session{};
+    std::unique_ptr<kq::shm::Transport> shm;
+    HANDLE closedEvent = nullptr;
+    std::vector<char> early;   // read from the pipe before TCP was connected
+};
+
+// Waits for a shared-memory ring event; false if the session ends first.
+bool waitForRing(PluginLink const& link, HANDLE ready, HANDLE cancelEvent,
+    trace::Direction direction)
 {
-    std::vector<char> buf(kq::bufferSize);
+    HANDLE handles[] = {ready, cancelEvent, link.closedEvent};
+    int64_t start = trace::nowNs();
+    DWORD wait = WaitForMultipleObjects(3, handles, FALSE, INFINITE);
+    trace::record(trace::Event::wait, direction, 0, trace::nowNs() - start);
+    return wait == WAIT_OBJECT_0;
+}
+
+// Reads the next piece of the plugin's stream; false once it has ended.
+// beforeWait() runs whenever nothing is readable yet and the read is about
+// to block; returning false abandons the read.
+template <typename BeforeWait>
+bool readPlugin(PluginLink const& link, OVERLAPPED& ov, char* buf, size_t size,
+    DWORD& bytesRead, HANDLE cancelEvent, BeforeWait&& beforeWait)
+{
+    if (link.shm) {
+        auto& rx = link.shm->rx();
+        for (;;) {
+            bytesRead = static_cast<DWORD>(rx.read(buf, size));
+            if (bytesRead > 0) {
+                link.shm->notifyRead();
+                return true;
+            }
+            if (!beforeWait())
+                return false;
+            // Whatever the plugin wrote before going away is drained first.
+            if (rx.parkReader() && !waitForRing(link, link.shm->rxReady(), cancelEvent,
+                    trace::Direction::pipeToTcp) && rx.readable() == 0) {
+                spdlog::info("Shared memory read ended");
+                return false;
+            }
+        }
+    }
+
+    ResetEvent(ov.hEvent);
+    BOOL ok = ReadFile(link.pipe, buf, static_cast<DWORD>(size), &bytesRead, &ov);
+
+    if (!ok) {
+        DWORD err = GetLastError();
+        if (err == ERROR_IO_PENDING) {
+            if (!beforeWait()) {
+                CancelIoEx(link.pipe, &ov);
+                GetOverlappedResult(link.pipe, &ov, &bytesRead, TRUE);
+                return false;
+            }
+            if (!waitForIo(link.pipe, ov, bytesRead, cancelEvent,
+                    trace::Direction::pipeToTcp)) {
+                spdlog::info("Pipe read ended ({})", GetLastError());
+                return false;
+            }
+        } else {
+            spdlog::info("Pipe read ended ({})", err);
+            trace::record(trace::Event::error, trace::Direction::pipeToTcp, 0, err);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool writePlugin(PluginLink const& link, OVERLAPPED& ov, char const* data, size_t len,
+    HANDLE cancelEvent)
+{
+    if (link.shm) {
+        auto& tx = link.shm->tx();
+        while (len > 0) {
+            size_t n = tx.write(data, len);
+            if (n > 0)
+                link.shm->notifyWritten();
+            data += n;
+            len -= n;
+            if (n == 0 && tx.parkWriter() && !waitForRing(link, link.shm->txReady(),
+                    cancelEvent, trace::Direction::tcpToPipe)) {
+                spdlog::info("Shared memory write ended");
+                return false;
+            }
+        }
+        return true;
+    }
+
+    DWORD written = 0;
+    ResetEvent(ov.hEvent);
+    BOOL ok = WriteFile(link.pipe, data, static_cast<DWORD>(len),
+            &written, &ov);
+
+    if (!ok) {
+        DWORD err = GetLastError();
+        if (err == ERROR_IO_PENDING) {
+            if (!waitForIo(link.pipe, ov, written, cancelEvent,
+                    trace::Direction::tcpToPipe)) {
+                spdlog::info("Pipe write failed ({})", GetLastError());
+                return false;
+            }
+        } else {
+            spdlog::info("Pipe write failed ({})", err);
+            trace::record(trace::Event::error, trace::Direction::tcpToPipe, 0, err);
+            return false;
+        }
+    }
+    return true;
+}
+
+// The pipe is a byte stream, so reads that complete without blocking are
+// simply appended to `arena` and go out as one TCP write once a read has to
+// wait or the batch reaches its caps. That write happens while the read is
+// already pointed past the batch, so the arena is only rewound at the caps.
+void pipeToTcp(PluginLink const& link, asio::ip::tcp::socket& socket, HANDLE cancelEvent,
+    kq::dedup::Codec* dedup)
+{
+    std::vector<char> arena(kq::maxGatherBytes + kq::bufferSize);
+    size_t used = 0;
+    size_t flushed = 0;   // arena bytes already written to TCP
+    size_t reads = 0;
+    std::vector<char> decoded;
     OVERLAPPED ov{};
     ov.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
 
-    for (;;) {
-        DWORD bytesRead = 0;
-        ResetEvent(ov.hEvent);
-        BOOL ok = ReadFile(pipe, buf.data(), static_cast<DWORD>(buf.size()),
-                &bytesRead, &ov);
-
-        if (!ok) {
-            DWORD err = GetLastError();
-            if (err == ERROR_IO_PENDING) {
-                if (!waitForIo(pipe, ov, bytesRead, cancelEvent)) {
-                    spdlog::info("Pipe read ended ({})", GetLastError());
-                    break;
-                }
-            } else {
-                spdlog::info("Pipe read ended ({})", err);
+    auto flush = [&] {
+        char const* data = dedup ? decoded.data() : arena.data() + flushed;
+        size_t len = dedup ? decoded.size() : used - flushed;
+        asio::error_code ec;
+        if (len > 0)
+            asio::write(socket, asio::buffer(data, len), ec);
+        decoded.clear();
+        flushed = used;
+        reads = 0;
+        if (ec) {
+            spdlog::info("TCP write failed: {}", ec.message());
+            return false;
+        }
+        if (len > 0)
+            trace::record(trace::Event::write, trace::Direction::pipeToTcp, len);
+        return true;
+    };
+
+    // What the plugin sent before the TCP connection arrived goes out with
+    // the first batch.
+    bool ok = true;
+    if (dedup && !link.early.empty()) {
+        ok = dedup->decode(link.early.data(), link.early.size(), decoded);
+        if (!ok)
+            spdlog::error("Dedup stream error: {}", dedup->error());
+    } else if (!dedup) {
+        std::copy(link.early.begin(), link.early.end(), arena.begin());
+        used = link.early.size();
+    }
+
+    while (ok) {
+        bool full = reads == kq::maxGatherReads || arena.size() - used < kq::bufferSize
+            || decoded.size() >= kq::maxGatherBytes;
+        if (full) {
+            if (!flush())
                 break;
-            }
+            used = flushed = 0;
         }
 
+        char* buf = arena.data() + used;
+        DWORD bytesRead = 0;
+        if (!readPlugin(link, ov, buf, kq::bufferSize, bytesRead, cancelEvent, flush))
+            break;
+
         if (bytesRead == 0)
             continue;
+        trace::record(trace::Event::read, trace::Direction::pipeToTcp,
+            bytesRead, 0, buf, bytesRead);
+        ++reads;
 
-        asio::error_code ec;
-        asio::write(socket, asio::buffer(buf.data(), bytesRead), ec);
-        if (ec) {
-            spdlog::info("TCP write failed: {}", ec.message());
+        if (!dedup) {
+            used += bytesRead;
+            continue;
+        }
+        if (!dedup->decode(buf, bytesRead, decoded)) {
+            spdlog::error("Dedup stream error: {}", dedup->error());
             break;
         }
     }
+    flush();
     CloseHandle(ov.hEvent);
     SetEvent(cancelEvent);
     asio::error_code ec;
     socket.close(ec);
 }
 
-void tcpToPipe(asio::ip::tcp::socket& socket, HANDLE pipe, HANDLE cancelEvent)
+void tcpToPipe(asio::ip::tcp::socket& socket, PluginLink const& link, HANDLE cancelEvent,
+    kq::dedup::Codec* dedup)
 {
     std::vector<char> buf(kq::bufferSize);
+    std::vector<char> encoded;
     OVERLAPPED ov{};
     ov.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
 
-    for (;;) {
+    auto writePipe = [&](char const* data, size_t len) {
+        if (!writePlugin(link, ov, data, len, cancelEvent))
+            return false;
+        trace::record(trace::Event::write, trace::Direction::tcpToPipe, len);
+        return true;
+    };
+
+    // The dedup hello goes out before anything is read, so the peer can
+    // sync its encoder even if this direction stays silent.
+    bool running = true;
+    if (dedup) {
+        dedup->hello(encoded);
+        running = writePipe(encoded.data(), encoded.size());
+    }
+
+    while (running) {
         asio::error_code ec;
         auto n = socket.read_some(asio::buffer(buf), ec);
         if (ec) {
             spdlog::info("TCP read ended: {}", ec.message());
             break;
         }
+        trace::record(trace::Event::read, trace::Direction::tcpToPipe,
+            n, 0, buf.data(), n);
 
-        DWORD written = 0;
-        ResetEvent(ov.hEvent);
-        BOOL ok = WriteFile(pipe, buf.data(), static_cast<DWORD>(n),
-                &written, &ov);
-
-        if (!ok) {
-            DWORD err = GetLastError();
-            if (err == ERROR_IO_PENDING) {
-                if (!waitForIo(pipe, ov, written, cancelEvent)) {
-                    spdlog::info("Pipe write failed ({})", GetLastError());
-                    break;
-                }
-            } else {
-                spdlog::info("Pipe write failed ({})", err);
-                break;
-            }
+        if (!dedup) {
+            running = writePipe(buf.data(), n);
+            continue;
         }
+
+        encoded.clear();
+        dedup->encode(buf.data(), n, socket.available(ec) == 0, encoded);
+        if (!encoded.empty())
+            running = writePipe(encoded.data(), encoded.size());
     }
     CloseHandle(ov.hEvent);
     SetEvent(cancelEvent);
 }
 
-HANDLE waitForPlugin()
+HANDLE waitForPlugin(bool first)
 {
-    HANDLE pipe = createPipe();
+    HANDLE pipe = createPipe(first);
     if (pipe == INVALID_HANDLE_VALUE)
         return INVALID_HANDLE_VALUE;
 
@@ -145,98 +342,421 @@ HANDLE waitForPlugin()
     return pipe;
 }
 
-void bridgeSession(HANDLE pipe, asio::ip::tcp::socket& socket)
+// Reads or writes exactly `len` bytes of the handshake.
+bool transferAll(HANDLE pipe, bool write, void* data, DWORD len)
 {
+    auto* p = static_cast<char*>(data);
+    OVERLAPPED ov{};
+    ov.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+    DWORD done = 0;
+    while (done < len) {
+        ResetEvent(ov.hEvent);
+        BOOL ok = write ? WriteFile(pipe, p + done, len - done, nullptr, &ov)
+                        : ReadFile(pipe, p + done, len - done, nullptr, &ov);
+        if (!ok && GetLastError() != ERROR_IO_PENDING)
+            break;
+        DWORD n = 0;
+        if (WaitForSingleObject(ov.hEvent, kq::pipeHandshakeTimeoutMs) != WAIT_OBJECT_0) {
+            CancelIoEx(pipe, &ov);
+            GetOverlappedResult(pipe, &ov, &n, TRUE);
+            break;
+        }
+        if (!GetOverlappedResult(pipe, &ov, &n, FALSE) || n == 0)
+            break;
+        done += n;
+    }
+    CloseHandle(ov.hEvent);
+    return done == len;
+}
+
+// Answers the plugin's PipeHello, moving the stream to shared memory when
+// both sides allow it.
+bool greetPlugin(HANDLE pipe, size_t shmCapacity, PluginLink& link)
+{
+    link.pipe = pipe;
+
+    kq::PipeHello hello{};
+    if (!transferAll(pipe, false, &hello, sizeof(hello))
+        || std::memcmp(hello.magic, kq::pipeMagic, sizeof(hello.magic)) != 0) {
+        spdlog::error("Plugin did not send a handshake; is it from another version?");
+        return false;
+    }
+    if (hello.version != kq::pipeProtocolVersion) {
+        spdlog::error("Plugin speaks pipe protocol {}, expected {}",
+            hello.version, kq::pipeProtocolVersion);
+        return false;
+    }
+    link.session = {hello.processId, hello.session};
+
+    kq::PipeWelcome welcome{};
+    std::memcpy(welcome.magic, kq::pipeMagic, sizeof(welcome.magic));
+    welcome.version = kq::pipeProtocolVersion;
+    welcome.transport = kq::PipeTransport::pipe;
+
+    if (shmCapacity && (hello.flags & kq::pipeFlagSharedMemory)) {
+        static std::atomic<unsigned> sessionCounter{0};
+        auto name = fmt::format(R"(Local\kq-tunnel-{}-{})", GetCurrentProcessId(),
+            sessionCounter++);
+        auto shm = std::make_unique<kq::shm::Transport>();
+        if (name.size() < sizeof(welcome.mapping) && shm->create(name, shmCapacity)) {
+            std::memcpy(welcome.mapping, name.data(), name.size());
+            welcome.transport = kq::PipeTransport::sharedMemory;
+            link.shm = std::move(shm);
+        } else {
+            spdlog::warn("Cannot create shared memory '{}', staying on the pipe", name);
+        }
+    }
+
+    if (!transferAll(pipe, true, &welcome, sizeof(welcome))) {
+        spdlog::error("Handshake with plugin failed ({})", GetLastError());
+        return false;
+    }
+    spdlog::info("Plugin {}:{} connected, transport: {}", hello.processId, hello.session,
+        link.shm ? "shared memory" : "pipe");
+    return true;
+}
+
+struct DedupConfig {
+    std::string dir;      // empty = off
+    uint64_t cacheBytes = kq::dedup::defaultCacheBytes;
+};
+
+void bridgeSession(PluginLink& link, asio::ip::tcp::socket& socket,
+    DedupConfig const& dedupConfig)
+{
+    HANDLE pipe = link.pipe;
+    std::unique_ptr<kq::dedup::Codec> dedup;
+    if (!dedupConfig.dir.empty()) {
+        dedup = std::make_unique<kq::dedup::Codec>();
+        if (!dedup->open(dedupConfig.dir, dedupConfig.cacheBytes)) {
+            spdlog::error("Cannot open dedup cache in '{}' (in use by another process?)",
+                dedupConfig.dir);
+            CloseHandle(pipe);
+            return;
+        }
+    }
+
     HANDLE cancelEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
 
-    std::thread t1(pipeToTcp, pipe, std::ref(socket), cancelEvent);
-    std::thread t2(tcpToPipe, std::ref(socket), pipe, cancelEvent);
+    OVERLAPPED watchOv{};
+    char watchByte = 0;
+    bool watching = false;
+    if (link.shm) {
+        watchOv.hEvent = link.closedEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        watching = ReadFile(pipe, &watchByte, 1, nullptr, &watchOv)
+            || GetLastError() == ERROR_IO_PENDING;
+        if (!watching)
+            SetEvent(link.closedEvent);
+    }
+
+    std::thread t1(pipeToTcp, std::cref(link), std::ref(socket), cancelEvent, dedup.get());
+    std::thread t2(tcpToPipe, std::ref(socket), std::cref(link), cancelEvent, dedup.get());
 
     t1.join();
     t2.join();
 
+    if (watching) {
+        DWORD dummy;
+        CancelIoEx(pipe, &watchOv);
+        GetOverlappedResult(pipe, &watchOv, &dummy, TRUE);
+    }
+    if (link.closedEvent)
+        CloseHandle(link.closedEvent);
+    link.shm.reset();
+
+    if (dedup) {
+        auto const& stats = dedup->stats();
+        spdlog::info("Dedup: {} bytes sent as {} ({} chunk references, {} bytes), "
+            "encoder {:.0f} MB/s", stats.bytesIn, stats.bytesOut, stats.refs, stats.refBytes,
+            stats.encodeNs ? stats.bytesIn * 1e3 / static_cast<double>(stats.encodeNs) : 0.0);
+    }
+
     CloseHandle(cancelEvent);
     CloseHandle(pipe);
-    spdlog::info("Session ended, ready for next connection");
+    trace::Recorder::instance().dump();
+    spdlog::info("Session ended");
+}
+
+// Accepts the session's TCP connection, giving up if the plugin goes away
+// first (its RDP session was closed before anything connected). The accept
+// and a read on the pipe are waited on together: with shared memory nothing
+// more arrives on the pipe, so the read only completes when the plugin
+// closes it; over the pipe, what the plugin sends meanwhile is kept in
+// link.early for pipeToTcp. Once that holds maxGatherBytes the pipe is left
+// to back up and only the accept is waited for.
+bool acceptWhilePluginAlive(asio::io_context& io, asio::ip::tcp::acceptor& acceptor,
+    asio::ip::tcp::socket& socket, PluginLink& link)
+{
+    OVERLAPPED ov{};
+    ov.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+    asio::windows::object_handle readDone(io, ov.hEvent);   // closes the event
+    std::vector<char> piece(kq::bufferSize);
+    bool reading = false;
+    bool pluginGone = false;
+    bool acceptDone = false;
+    asio::error_code acceptEc;
+
+    // Takes what a finished read returned; false once the plugin is gone.
+    auto finishRead = [&](BOOL ok, DWORD n) {
+        reading = false;
+        if (!ok)
+            return false;
+        trace::record(trace::Event::read, trace::Direction::pipeToTcp, n, 0, piece.data(), n);
+        link.early.insert(link.early.end(), piece.data(), piece.data() + n);
+        return true;
+    };
+
+    std::function<void()> startRead = [&] {
+        if (link.early.size() >= kq::maxGatherBytes)
+            return;
+        ResetEvent(ov.hEvent);
+        if (!ReadFile(link.pipe, piece.data(), static_cast<DWORD>(piece.size()), nullptr, &ov)
+            && GetLastError() != ERROR_IO_PENDING) {
+            pluginGone = true;
+            return;
+        }
+        reading = true;
+        readDone.async_wait([&](asio::error_code ec) {
+            // After the accept the read is finished below instead.
+            if (ec || acceptDone || pluginGone)
+                return;
+            DWORD n = 0;
+            if (!finishRead(GetOverlappedResult(link.pipe, &ov, &n, FALSE), n))
+                pluginGone = true;
+            else
+                startRead();
+        });
+    };
+
+    acceptor.async_accept(socket, [&](asio::error_code ec) {
+        acceptEc = ec;
+        acceptDone = true;
+    });
+    startRead();
+    while (!acceptDone && !pluginGone)
+        io.run_one();
+
+    // Leave nothing pending on the pipe or the listener.
+    if (reading) {
+        readDone.cancel();
+        CancelIoEx(link.pipe, &ov);
+        DWORD n = 0;
+        if (!finishRead(GetOverlappedResult(link.pipe, &ov, &n, TRUE), n)
+            && GetLastError() != ERROR_OPERATION_ABORTED)
+            pluginGone = true;
+    }
+    if (!acceptDone)
+        acceptor.cancel();
+    io.run();
+    io.restart();
+
+    if (pluginGone) {
+        spdlog::info("Plugin went away before a TCP connection arrived");
+        asio::error_code ec;
+        socket.close(ec);
+        return false;
+    }
+    if (acceptEc) {
+        spdlog::error("Accept failed: {}", acceptEc.message());
+        return false;
+    }
+    return true;
+}
+
+enum class Mode { listen, connect };
+
+struct ClientConfig {
+    Mode mode = Mode::listen;
+    uint16_t listenPort = kq::defaultLocalPort;   // session N listens on listenPort + N
+    std::string host = kq::defaultTargetHost;
+    std::string port = std::to_string(kq::defaultLocalPort);
+    DedupConfig dedup;
+    size_t shmCapacity = 0;
+};
+
+// Serves one plugin connection on its own thread: handshake, the session's
+// listener or outgoing connection, then the relay.
+void runSession(HANDLE pipe, ClientConfig const& config, kq::SessionRouter& router)
+{
+    PluginLink link;
+    if (!greetPlugin(pipe, config.shmCapacity, link)) {
+        CloseHandle(pipe);
+        return;
+    }
+    int slot = router.acquire(link.session);
+    if (slot < 0) {
+        spdlog::error("Plugin {}:{} rejected, all sessions are busy",
+            link.session.processId, link.session.session);
+        CloseHandle(pipe);
+        return;
+    }
+
+    // Each session keeps its own dedup cache; slot 0 keeps using the
+    // directory itself.
+    DedupConfig dedup = config.dedup;
+    if (slot > 0 && !dedup.dir.empty())
+        dedup.dir += "/session" + std::to_string(slot);
+
+    asio::io_context io;
+    asio::ip::tcp::socket socket(io);
+    bool connected = false;
+    if (config.mode == Mode::listen) {
+        auto port = static_cast<uint16_t>(config.listenPort + slot);
+        try {
+            asio::ip::tcp::acceptor acceptor(io,
+                asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"), port));
+            spdlog::info("Session {}: waiting for TCP connection on port {}...", slot, port);
+            connected = acceptWhilePluginAlive(io, acceptor, socket, link);
+        } catch (std::exception const& e) {
+            spdlog::error("Session {}: cannot listen on port {}: {}", slot, port, e.what());
+        }
+        if (connected)
+            spdlog::info("Session {}: TCP connection accepted", slot);
+    } else {
+        try {
+            asio::ip::tcp::resolver resolver(io);
+            asio::connect(socket, resolver.resolve(config.host, config.port));
+            connected = true;
+            spdlog::info("Session {}: connected to {}:{}", slot, config.host, config.port);
+        } catch (std::exception const& e) {
+            spdlog::error("Session {}: TCP connect to {}:{} failed: {}", slot, config.host,
+                config.port, e.what());
+        }
+    }
+
+    if (connected)
+        bridgeSession(link, socket, dedup);
+    else
+        CloseHandle(pipe);
+    router.release(slot);
 }
 
 } // namespace
 
 int main(int argc, char* argv[])
 {
-    enum class Mode { listen, connect };
-    Mode mode = Mode::listen;
-    int argOffset = 1;
+    ClientConfig config;
+
+    kq::Options opts(argc, argv);
+    auto const& args = opts.positional();
+    size_t argOffset = 0;
 
-    if (argc >= 2) {
-        std::string_view cmd = argv[1];
+    if (!args.empty()) {
+        std::string_view cmd = args[0];
         if (cmd == "listen") {
-            mode = Mode::listen;
-            argOffset = 2;
+            config.mode = Mode::listen;
+            argOffset = 1;
         } else if (cmd == "connect") {
-            mode = Mode::connect;
-            argOffset = 2;
+            config.mode = Mode::connect;
+            argOffset = 1;
         }
     }
 
     spdlog::info("kq-tunnel-client starting");
     spdlog::info("  pipe: {}", kq::pipeName);
 
-    asio::io_context io;
+    if (opts.has("trace")) {
+        std::string tracePath = opts.get("trace", "");
+        if (tracePath.empty())
+            tracePath = "kq-tunnel-client.trace";
+        trace::Recorder::instance().enable(tracePath,
+            opts.get<size_t>("trace-payload", 0));
+        trace::installDumpHandlers();
+        spdlog::info("  trace: {} (Ctrl+Break dumps)", tracePath);
+    }
 
-    if (mode == Mode::listen) {
-        uint16_t port = kq::defaultLocalPort;
-        if (argOffset < argc)
-            port = static_cast<uint16_t>(std::stoi(argv[argOffset]));
+    // --dedup=DIR must be given on both ends: it changes what goes over the
+    // channel in both directions.
+    DedupConfig& dedupConfig = config.dedup;
+    if (opts.has("dedup")) {
+        dedupConfig.dir = opts.get("dedup", "");
+        if (dedupConfig.dir.empty())
+            dedupConfig.dir = "kq-tunnel-cache";
+        auto cacheMb = opts.get<uint64_t>("dedup-cache", kq::dedup::defaultCacheBytes >> 20);
+        dedupConfig.cacheBytes = cacheMb << 20;
+        spdlog::info("  dedup: {} ({} MiB per direction)", dedupConfig.dir, cacheMb);
+    }
 
-        spdlog::info("  mode: listen");
-        spdlog::info("  listen port: {}", port);
+    // --shm[=KB] moves the stream to shared-memory rings when the plugin
+    // allows it; the pipe is then only used for the handshake.
+    size_t& shmCapacity = config.shmCapacity;
+    if (opts.has("shm")) {
+        shmCapacity = opts.get<size_t>("shm", kq::shm::defaultCapacity >> 10) << 10;
+        if (shmCapacity == 0 || (shmCapacity & (shmCapacity - 1)) != 0) {
+            spdlog::error("--shm size must be a power of two in KiB");
+            return 1;
+        }
+        spdlog::info("  shared memory: {} KiB per direction", shmCapacity >> 10);
+    }
 
-        asio::ip::tcp::acceptor acceptor(io,
-            asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"), port));
+    // Every plugin connection gets its own thread, and in listen mode its
+    // own port: session N of --sessions listens on port + N.
+    size_t sessions = std::max<size_t>(opts.get<size_t>("sessions", 16), 1);
+    kq::SessionRouter router(sessions);
+
+    if (config.mode == Mode::listen) {
+        // Session N listens on port + N; the last one must still be a port.
+        int port = argOffset < args.size() ? std::stoi(args[argOffset]) : config.listenPort;
+        if (port <= 0 || port + sessions - 1 > 65535) {
+            spdlog::error("Listen port {} with {} sessions is out of range (last port must be "
+                "at most 65535)", port, sessions);
+            return 1;
+        }
+        config.listenPort = static_cast<uint16_t>(port);
 
-        while (true) {
-            HANDLE pipe = waitForPlugin();
-            if (pipe == INVALID_HANDLE_VALUE)
-                return 1;
+        spdlog::info("  mode: listen");
+        spdlog::info("  listen ports: {}-{}", config.listenPort,
+            config.listenPort + sessions - 1);
+    } else {
+        if (argOffset < args.size())
+            config.host = args[argOffset];
+        if (argOffset + 1 < args.size())
+            config.port = args[argOffset + 1];
 
-            spdlog::info("Waiting for TCP connection on port {}...", port);
-            asio::ip::tcp::socket socket(io);
-            acceptor.accept(socket);
-            spdlog::info("TCP connection accepted");
+        spdlog::info("  mode: connect");
+        spdlog::info("  target: {}:{}", config.host, config.port);
+    }
 
-            bridgeSession(pipe, socket);
+    // Session threads use config and router, so every one is joined before
+    // main returns; finished ones are joined as new sessions start.
+    struct SessionThread {
+        std::atomic<bool> done{false};
+        std::thread thread;
+    };
+    std::list<SessionThread> sessionThreads;
+
+    // Without the first pipe instance there is nothing to serve. A later
+    // instance failing is retried, so running sessions carry on.
+    unsigned failures = 0;
+    for (bool first = true;;) {
+        HANDLE pipe = waitForPlugin(first);
+        if (pipe == INVALID_HANDLE_VALUE) {
+            if (first || ++failures == maxPipeFailures)
+                break;
+            std::this_thread::sleep_for(pipeRetryDelay);
+            continue;
         }
-    } else {
-        std::string host = kq::defaultTargetHost;
-        std::string port = std::to_string(kq::defaultLocalPort);
-        if (argOffset < argc)
-            host = argv[argOffset];
-        if (argOffset + 1 < argc)
-            port = argv[argOffset + 1];
+        first = false;
+        failures = 0;
 
-        spdlog::info("  mode: connect");
-        spdlog::info("  target: {}:{}", host, port);
-
-        asio::ip::tcp::resolver resolver(io);
-
-        while (true) {
-            HANDLE pipe = waitForPlugin();
-            if (pipe == INVALID_HANDLE_VALUE)
-                return 1;
-
-            asio::ip::tcp::socket socket(io);
-            try {
-                auto endpoints = resolver.resolve(host, port);
-                asio::connect(socket, endpoints);
-            } catch (std::exception const& e) {
-                spdlog::error("TCP connect to {}:{} failed: {}", host, port, e.what());
-                CloseHandle(pipe);
+        for (auto it = sessionThreads.begin(); it != sessionThreads.end();) {
+            if (!it->done.load()) {
+                ++it;
                 continue;
             }
-            spdlog::info("Connected to {}:{}", host, port);
-
-            bridgeSession(pipe, socket);
+            it->thread.join();
+            it = sessionThreads.erase(it);
         }
+        auto& session = sessionThreads.emplace_back();
+        session.thread = std::thread([&config, &router, &session, pipe] {
+            runSession(pipe, config, router);
+            session.done.store(true);
+        });
     }
+
+    if (!sessionThreads.empty())
+        spdlog::info("Waiting for {} sessions to end", sessionThreads.size());
+    for (auto& session : sessionThreads)
+        session.thread.join();
+    return 1;
 }
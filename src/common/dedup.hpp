@@ -0,0 +1,614 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "mapped_file.hpp"
+
+// Optional deduplication of the relayed byte stream, for artifacts that are
+// pushed through the tunnel again and again.
+//
+// The outgoing stream is cut into content-defined chunks (FastCDC: a gear
+// rolling hash with normalized chunking), so an insertion only changes the
+// chunks around it. Chunks are appended to a ring store memory-mapped from
+// disk; every chunk already in the store is sent as a 32-byte reference
+// instead of its data. The receiving end keeps a mirror of that store by
+// appending every literal chunk it receives in the same order, so a stream
+// position identifies the same bytes on both ends and the sender can verify
+// a candidate match against its own copy before referencing it.
+//
+// Both ends run a Codec: its encoder writes to the peer, its decoder reads
+// from it. Each decoder opens its stream with a hello describing the mirror
+// it holds; the peer's encoder answers with a sync that rolls both stores
+// back to the positions they still agree on (or resets them) before it sends
+// the first cached chunk. Until then chunks go out uncached.
+namespace kq::dedup {
+
+inline constexpr size_t minChunk = 2 * 1024;
+inline constexpr size_t avgChunk = 8 * 1024;
+inline constexpr size_t maxChunk = 64 * 1024;
+
+inline constexpr uint64_t defaultCacheBytes = 256 * 1024 * 1024;
+
+// Gear table: 256 pseudo-random words from a fixed splitmix64 sequence, so
+// both ends cut identically.
+inline constexpr std::array<uint64_t, 256> gear = [] {
+    std::array<uint64_t, 256> table{};
+    uint64_t state = 0x6b71747566666572; // "kqtuffer"
+    for (auto& entry : table) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+        entry = z ^ (z >> 31);
+    }
+    return table;
+}();
+
+// Content hash used to index the store and to check references; matches are
+// additionally compared byte for byte by the encoder.
+inline uint64_t hash64(char const* data, size_t len)
+{
+    constexpr uint64_t k1 = 0x87C37B91114253D5;
+    constexpr uint64_t k2 = 0x4CF5AD432745937F;
+    uint64_t h = 0x9E3779B97F4A7C15 ^ (len * k1);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, data + i, sizeof(w));
+        h ^= w * k1;
+        h = ((h << 31) | (h >> 33)) * k2;
+    }
+    for (; i < len; ++i)
+        h = (h ^ static_cast<uint8_t>(data[i])) * 0x100000001B3;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCD;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53;
+    h ^= h >> 33;
+    return h;
+}
+
+// Streaming FastCDC chunker. Cut points depend only on content, never on how
+// the stream was split into reads.
+class Chunker
+{
+public:
+    // Masks from the FastCDC paper for an 8 KiB average: more bits below
+    // the average size, fewer above, which narrows the size distribution.
+    static constexpr uint64_t maskSmall = 0x0003590703530000;
+    static constexpr uint64_t maskLarge = 0x0000D90003530000;
+
+    // Calls onChunk(data, len, sent) for every chunk completed by `data`,
+    // where the first `sent` bytes were already passed to onFlush. With
+    // `flush` the unsent tail of the current chunk goes to onFlush(data,
+    // len), so a lone interactive write is never held back waiting for a
+    // cut point, while the cut points themselves stay where they would be.
+    template <typename OnChunk, typename OnFlush>
+    void feed(char const* data, size_t len, bool flush, OnChunk&& onChunk, OnFlush&& onFlush)
+    {
+        size_t pos = 0;
+        while (pos < len) {
+            size_t cut = findCut(data + pos, len - pos, partial_.size());
+            if (cut == 0) {
+                partial_.insert(partial_.end(), data + pos, data + len);
+                break;
+            }
+            if (partial_.empty()) {
+                onChunk(data + pos, cut, size_t{0});
+            } else {
+                partial_.insert(partial_.end(), data + pos, data + pos + cut);
+                onChunk(partial_.data(), partial_.size(), sent_);
+                partial_.clear();
+                sent_ = 0;
+            }
+            pos += cut;
+            fp_ = 0;
+        }
+        if (flush && partial_.size() > sent_) {
+            onFlush(partial_.data() + sent_, partial_.size() - sent_);
+            sent_ = partial_.size();
+        }
+    }
+
+private:
+    // Number of bytes of `p` that complete the current chunk (of which
+    // `have` bytes were seen before), or 0 if there is no cut in `p`.
+    size_t findCut(char const* p, size_t n, size_t have)
+    {
+        size_t i = have < minChunk ? std::min(n, minChunk - have) : 0;
+        size_t normal = have < avgChunk ? std::min(n, avgChunk - have) : 0;
+        size_t limit = std::min(n, maxChunk - have);
+        uint64_t fp = fp_;
+        for (; i < normal; ++i) {
+            fp = (fp << 1) + gear[static_cast<uint8_t>(p[i])];
+            if (!(fp & maskSmall))
+                return i + 1;
+        }
+        for (; i < limit; ++i) {
+            fp = (fp << 1) + gear[static_cast<uint8_t>(p[i])];
+            if (!(fp & maskLarge))
+                return i + 1;
+        }
+        fp_ = fp;
+        return have + n >= maxChunk ? limit : 0;
+    }
+
+    std::vector<char> partial_;
+    size_t sent_ = 0;
+    uint64_t fp_ = 0;
+};
+
+// On-disk layout of a store: StoreHeader, the index (encoder side only),
+// then the ring of `capacity` bytes holding stream positions
+// [head - capacity, head).
+struct StoreHeader {
+    char magic[8];        // "KQDEDUP\0"
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t id;          // the encoder's cache identity (mirrored by the decoder)
+    uint64_t capacity;
+    uint64_t indexSlots;
+    uint64_t head;        // stream position after the last stored byte
+    uint64_t base;        // positions below this are not valid
+};
+static_assert(sizeof(StoreHeader) == 56);
+
+struct IndexEntry {
+    uint64_t hash;
+    uint64_t pos;
+    uint32_t len;
+    uint32_t reserved;
+};
+static_assert(sizeof(IndexEntry) == 24);
+
+inline constexpr char storeMagic[8] = "KQDEDUP";
+inline constexpr uint32_t storeVersion = 1;
+
+class Store
+{
+public:
+    bool open(std::string const& path, uint64_t capacity, uint64_t indexSlots)
+    {
+        size_t ringOffset = (sizeof(StoreHeader) + indexSlots * sizeof(IndexEntry) + 4095)
+            & ~size_t{4095};
+        if (!file_.open(path, ringOffset + capacity))
+            return false;
+
+        header_ = reinterpret_cast<StoreHeader*>(file_.data());
+        index_ = reinterpret_cast<IndexEntry*>(file_.data() + sizeof(StoreHeader));
+        ring_ = file_.data() + ringOffset;
+
+        if (file_.resized() || std::memcmp(header_->magic, storeMagic, sizeof(storeMagic)) != 0
+            || header_->version != storeVersion || header_->capacity != capacity
+            || header_->indexSlots != indexSlots || header_->base > header_->head) {
+            std::memset(file_.data(), 0, ringOffset);
+            std::memcpy(header_->magic, storeMagic, sizeof(storeMagic));
+            header_->version = storeVersion;
+            header_->capacity = capacity;
+            header_->indexSlots = indexSlots;
+        }
+        return true;
+    }
+
+    StoreHeader& header() const { return *header_; }
+
+    // Start of the positions still held in the ring.
+    uint64_t begin() const
+    {
+        uint64_t head = header_->head;
+        uint64_t capacity = header_->capacity;
+        return std::max(header_->base, head > capacity ? head - capacity : 0);
+    }
+
+    bool holds(uint64_t pos, size_t len) const
+    {
+        return pos >= begin() && pos + len <= header_->head;
+    }
+
+    // The index is set-associative: a hash maps to a bucket of indexWays
+    // entries. Entries are hints only; a match is confirmed against the
+    // ring, since a rollback can leave entries pointing at rewritten data.
+    static constexpr size_t indexWays = 4;
+
+    // Position of a stored copy of `data` at or after `from`, if any.
+    std::optional<uint64_t> find(uint64_t hash, char const* data, size_t len,
+        uint64_t from) const
+    {
+        IndexEntry const* bucket = bucketFor(hash);
+        for (size_t i = 0; i < indexWays; ++i) {
+            auto const& e = bucket[i];
+            if (e.hash == hash && e.len == len && e.pos >= from && holds(e.pos, len)
+                && equals(e.pos, data, len))
+                return e.pos;
+        }
+        return std::nullopt;
+    }
+
+    // Records a chunk stored at `pos`, replacing a stale entry for the same
+    // content or else the oldest entry of the bucket.
+    void insert(uint64_t hash, uint64_t pos, size_t len)
+    {
+        IndexEntry* bucket = bucketFor(hash);
+        IndexEntry* victim = bucket;
+        for (size_t i = 0; i < indexWays; ++i) {
+            if (bucket[i].hash == hash && bucket[i].len == len) {
+                victim = &bucket[i];
+                break;
+            }
+            if (bucket[i].pos < victim->pos)
+                victim = &bucket[i];
+        }
+        *victim = IndexEntry{hash, pos, static_cast<uint32_t>(len), 0};
+    }
+
+    void append(char const* data, size_t len)
+    {
+        uint64_t capacity = header_->capacity;
+        if (len > capacity) {
+            data += len - capacity;
+            header_->head += len - capacity;
+            len = capacity;
+        }
+        size_t at = header_->head % capacity;
+        size_t first = std::min<size_t>(len, capacity - at);
+        std::memcpy(ring_ + at, data, first);
+        std::memcpy(ring_, data + first, len - first);
+        header_->head += len;
+    }
+
+    void read(uint64_t pos, size_t len, char* out) const
+    {
+        uint64_t capacity = header_->capacity;
+        size_t at = pos % capacity;
+        size_t first = std::min<size_t>(len, capacity - at);
+        std::memcpy(out, ring_ + at, first);
+        std::memcpy(out + first, ring_, len - first);
+    }
+
+    bool equals(uint64_t pos, char const* data, size_t len) const
+    {
+        uint64_t capacity = header_->capacity;
+        size_t at = pos % capacity;
+        size_t first = std::min<size_t>(len, capacity - at);
+        return std::memcmp(ring_ + at, data, first) == 0
+            && std::memcmp(ring_, data + first, len - first) == 0;
+    }
+
+private:
+    IndexEntry* bucketFor(uint64_t hash) const
+    {
+        return index_ + hash % (header_->indexSlots / indexWays) * indexWays;
+    }
+
+    MappedFile file_;
+    StoreHeader* header_ = nullptr;
+    IndexEntry* index_ = nullptr;
+    char* ring_ = nullptr;
+};
+
+// Wire format: every record is a RecordHeader followed by `length` bytes,
+// either chunk data or one of the bodies below. Data of a chunk that was
+// flushed before its end arrives as partial records; the record completing
+// the chunk then carries only the rest (raw, literal) or references the
+// whole chunk and the decoder skips the part it already delivered (ref).
+enum class RecordType : uint8_t {
+    hello = 1,  // Hello: the decoder's mirror state, first record of a stream
+    sync,       // Sync: store state both ends continue from
+    raw,        // data, not stored
+    literal,    // data, appended to the store
+    ref,        // Ref: data already in the store
+    partial,    // data of a chunk that is not complete yet
+};
+
+struct RecordHeader {
+    RecordType type;
+    uint8_t reserved[3];
+    uint32_t length;
+};
+static_assert(sizeof(RecordHeader) == 8);
+
+struct Hello {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t id;
+    uint64_t head;
+    uint64_t base;
+    uint64_t capacity;
+};
+static_assert(sizeof(Hello) == 40);
+
+struct Sync {
+    uint64_t id;
+    uint64_t head;
+    uint64_t base;
+};
+static_assert(sizeof(Sync) == 24);
+
+struct Ref {
+    uint64_t pos;
+    uint64_t hash;
+    uint32_t len;
+    uint32_t reserved;
+};
+static_assert(sizeof(Ref) == 24);
+
+inline constexpr uint32_t helloMagic = 0x4444514B; // "KQDD"
+inline constexpr uint32_t protocolVersion = 1;
+
+struct Stats {
+    uint64_t bytesIn = 0;    // stream bytes given to the encoder
+    uint64_t bytesOut = 0;   // encoded bytes produced
+    uint64_t refs = 0;
+    uint64_t refBytes = 0;
+    uint64_t encodeNs = 0;   // time spent chunking and encoding
+};
+
+class Codec
+{
+public:
+    // Opens (or creates) the two stores in `dir`: tx.kqc for what this end
+    // sends, rx.kqc mirroring what the peer sends. Fails if another process
+    // has them open.
+    bool open(std::string const& dir, uint64_t capacity)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        capacity = std::max<uint64_t>(capacity, 16 * maxChunk);
+        auto path = std::filesystem::path(dir);
+        uint64_t slots = std::max<uint64_t>(capacity / avgChunk * 2, 1024)
+            / Store::indexWays * Store::indexWays;
+        if (!tx_.open((path / "tx.kqc").string(), capacity, slots)
+            || !rx_.open((path / "rx.kqc").string(), capacity, 0))
+            return false;
+
+        if (tx_.header().id == 0) {
+            std::random_device rd;
+            uint64_t id = 0;
+            while (id == 0)
+                id = (uint64_t{rd()} << 32) | rd();
+            tx_.header().id = id;
+        }
+        return true;
+    }
+
+    // First record of the outgoing stream; must be sent before any
+    // encode() output.
+    void hello(std::vector<char>& out)
+    {
+        auto const& h = rx_.header();
+        Hello body{helloMagic, protocolVersion, h.id, h.head, h.base, h.capacity};
+        put(out, RecordType::hello, &body, sizeof(body));
+    }
+
+    // Encodes `len` stream bytes, appending the records to `out`. `flush`
+    // means nothing else is waiting, so a partial chunk goes out now.
+    void encode(char const* data, size_t len, bool flush, std::vector<char>& out)
+    {
+        int64_t start = now();
+        size_t before = out.size();
+        if (!synced_)
+            trySync(out);
+        chunker_.feed(data, len, flush,
+            [&](char const* chunk, size_t n, size_t sent) { encodeChunk(chunk, n, sent, out); },
+            [&](char const* tail, size_t n) { put(out, RecordType::partial, tail, n); });
+        stats_.bytesIn += len;
+        stats_.bytesOut += out.size() - before;
+        stats_.encodeNs += static_cast<uint64_t>(now() - start);
+    }
+
+    // Decodes records from the peer, appending the stream bytes to `out`.
+    // Returns false on a malformed stream or a reference the store cannot
+    // satisfy; error() says why.
+    bool decode(char const* data, size_t len, std::vector<char>& out)
+    {
+        pending_.insert(pending_.end(), data, data + len);
+        size_t pos = 0;
+        bool ok = true;
+        while (pending_.size() - pos >= sizeof(RecordHeader)) {
+            RecordHeader header;
+            std::memcpy(&header, pending_.data() + pos, sizeof(header));
+            if (header.length > maxChunk) {
+                ok = fail("record too large");
+                break;
+            }
+            if (pending_.size() - pos - sizeof(header) < header.length)
+                break;
+            if (!decodeRecord(header, pending_.data() + pos + sizeof(header), out)) {
+                ok = false;
+                break;
+            }
+            pos += sizeof(header) + header.length;
+        }
+        pending_.erase(pending_.begin(), pending_.begin() + static_cast<ptrdiff_t>(pos));
+        return ok;
+    }
+
+    std::string_view error() const { return error_; }
+    Stats const& stats() const { return stats_; }
+
+private:
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static void put(std::vector<char>& out, RecordType type, void const* body, size_t len)
+    {
+        RecordHeader header{type, {}, static_cast<uint32_t>(len)};
+        auto const* h = reinterpret_cast<char const*>(&header);
+        auto const* b = static_cast<char const*>(body);
+        out.insert(out.end(), h, h + sizeof(header));
+        out.insert(out.end(), b, b + len);
+    }
+
+    // Handles the peer decoder's hello, if it has arrived: both stores keep
+    // only the positions each still holds unchanged, or start over if the
+    // peer mirrors a different cache.
+    void trySync(std::vector<char>& out)
+    {
+        std::optional<Hello> peer;
+        {
+            std::lock_guard lock(mtx_);
+            peer.swap(peerHello_);
+        }
+        if (!peer)
+            return;
+
+        auto& h = tx_.header();
+        uint64_t head = h.head;
+        uint64_t base = head;
+        if (peer->id == h.id && peer->capacity != 0) {
+            auto held = [](uint64_t headPos, uint64_t capacity) {
+                return headPos > capacity ? headPos - capacity : 0;
+            };
+            head = std::min(h.head, peer->head);
+            base = std::max({h.base, peer->base,
+                held(h.head, h.capacity), held(peer->head, peer->capacity)});
+            base = std::min(base, head);
+        }
+        h.head = head;
+        h.base = base;
+        window_ = std::min(h.capacity, peer->capacity);
+
+        Sync body{h.id, head, base};
+        put(out, RecordType::sync, &body, sizeof(body));
+        synced_ = true;
+    }
+
+    void encodeChunk(char const* chunk, size_t n, size_t sent, std::vector<char>& out)
+    {
+        if (!synced_ || n < minChunk)
+            return put(out, RecordType::raw, chunk + sent, n - sent);
+
+        uint64_t hash = hash64(chunk, n);
+        uint64_t head = tx_.header().head;
+        uint64_t peerBegin = head > window_ ? head - window_ : 0;
+        if (auto pos = tx_.find(hash, chunk, n, peerBegin)) {
+            Ref body{*pos, hash, static_cast<uint32_t>(n), 0};
+            put(out, RecordType::ref, &body, sizeof(body));
+            ++stats_.refs;
+            stats_.refBytes += n;
+            return;
+        }
+
+        tx_.insert(hash, head, n);
+        tx_.append(chunk, n);
+        put(out, RecordType::literal, chunk + sent, n - sent);
+    }
+
+    bool decodeRecord(RecordHeader const& header, char const* body, std::vector<char>& out)
+    {
+        if (!helloSeen_ && header.type != RecordType::hello)
+            return fail("peer stream does not start with a dedup hello");
+
+        switch (header.type) {
+        case RecordType::hello: {
+            Hello hello;
+            if (header.length != sizeof(hello))
+                return fail("bad hello");
+            std::memcpy(&hello, body, sizeof(hello));
+            if (hello.magic != helloMagic || hello.version != protocolVersion)
+                return fail("peer speaks a different dedup protocol");
+            helloSeen_ = true;
+            std::lock_guard lock(mtx_);
+            peerHello_ = hello;
+            return true;
+        }
+        case RecordType::sync: {
+            Sync sync;
+            if (header.length != sizeof(sync))
+                return fail("bad sync");
+            std::memcpy(&sync, body, sizeof(sync));
+            auto& h = rx_.header();
+            h.id = sync.id;
+            h.head = sync.head;
+            h.base = sync.base;
+            return true;
+        }
+        case RecordType::partial:
+            if (partial_.size() + header.length > maxChunk)
+                return fail("partial chunk too large");
+            partial_.insert(partial_.end(), body, body + header.length);
+            out.insert(out.end(), body, body + header.length);
+            return true;
+        case RecordType::raw:
+            partial_.clear();
+            out.insert(out.end(), body, body + header.length);
+            return true;
+        case RecordType::literal:
+            if (partial_.empty()) {
+                rx_.append(body, header.length);
+            } else {
+                partial_.insert(partial_.end(), body, body + header.length);
+                rx_.append(partial_.data(), partial_.size());
+                partial_.clear();
+            }
+            out.insert(out.end(), body, body + header.length);
+            return true;
+        case RecordType::ref: {
+            Ref ref;
+            if (header.length != sizeof(ref))
+                return fail("bad reference");
+            std::memcpy(&ref, body, sizeof(ref));
+            if (ref.len > maxChunk || ref.len < partial_.size())
+                return fail("bad reference");
+            if (!rx_.holds(ref.pos, ref.len))
+                return invalidate("reference outside the cache");
+            chunk_.resize(ref.len);
+            rx_.read(ref.pos, ref.len, chunk_.data());
+            if (hash64(chunk_.data(), ref.len) != ref.hash
+                || std::memcmp(chunk_.data(), partial_.data(), partial_.size()) != 0)
+                return invalidate("cached chunk does not match");
+            out.insert(out.end(), chunk_.begin() + static_cast<ptrdiff_t>(partial_.size()),
+                chunk_.end());
+            partial_.clear();
+            return true;
+        }
+        }
+        return fail("unknown record");
+    }
+
+    bool fail(char const* why)
+    {
+        error_ = why;
+        return false;
+    }
+
+    // The mirror has diverged; drop its contents so the next hello makes
+    // the peer start over.
+    bool invalidate(char const* why)
+    {
+        rx_.header().base = rx_.header().head;
+        return fail(why);
+    }
+
+    Store tx_;
+    Store rx_;
+    Chunker chunker_;
+    bool synced_ = false;
+    uint64_t window_ = 0;
+    Stats stats_;
+
+    std::vector<char> pending_;
+    std::vector<char> partial_;
+    std::vector<char> chunk_;
+    bool helloSeen_ = false;
+    std::string error_;
+
+    std::mutex mtx_;
+    std::optional<Hello> peerHello_;
+};
+
+} // namespace kq::dedup
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+// Wakeups between a producer and a consumer thread that is usually busy.
+// The producer rings after publishing work, which costs a fence and a load
+// unless the consumer has armed the bell; only then does it pay for a wakeup
+// (SetEvent on Windows, a futex wake elsewhere). The consumer arms, re-checks
+// for work, and only sleeps if there still is none -- the same handshake as
+// the parked flags in shm_ring.hpp.
+namespace kq {
+
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    _mm_pause();
+#endif
+}
+
+class Doorbell
+{
+public:
+#ifdef _WIN32
+    Doorbell() : event_(CreateEventA(nullptr, FALSE, FALSE, nullptr)) {}
+    ~Doorbell() { CloseHandle(event_); }
+
+    // Auto-reset; wait on it together with other handles after arm(). It
+    // may be left signalled by a ring that raced with disarm(), so a wakeup
+    // can find no work.
+    HANDLE event() const { return event_; }
+#else
+    Doorbell() = default;
+
+    // Sleeps until rung or `timeoutMs` passes (-1 = no timeout); call after
+    // arm() and a re-check that found nothing.
+    void wait(int timeoutMs)
+    {
+        timespec ts{timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&armed_), FUTEX_WAIT_PRIVATE, 1,
+            timeoutMs < 0 ? nullptr : &ts, nullptr, 0);
+    }
+#endif
+
+    Doorbell(Doorbell const&) = delete;
+    Doorbell& operator=(Doorbell const&) = delete;
+
+    // Consumer, before its final check for work.
+    void arm()
+    {
+        armed_.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    // Consumer, once awake again or when the final check found work.
+    void disarm() { armed_.store(0, std::memory_order_relaxed); }
+
+    // Producer, after publishing work; true if the consumer had to be woken.
+    bool ring()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (armed_.load(std::memory_order_relaxed) == 0
+            || armed_.exchange(0, std::memory_order_relaxed) == 0)
+            return false;
+        wakeups_.fetch_add(1, std::memory_order_relaxed);
+#ifdef _WIN32
+        SetEvent(event_);
+#else
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&armed_), FUTEX_WAKE_PRIVATE, INT_MAX,
+            nullptr, nullptr, 0);
+#endif
+        return true;
+    }
+
+    uint64_t wakeups() const { return wakeups_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint32_t> armed_{0};
+    std::atomic<uint64_t> wakeups_{0};
+#ifdef _WIN32
+    HANDLE event_;
+#endif
+};
+
+// How long a consumer polls for work before arming its doorbell, learned
+// from the gaps between arrivals. While work typically arrives within
+// `limit`, polling for about two typical gaps catches the next item without
+// a park and wakeup; when it does not, the consumer parks at once. A spin
+// that finds nothing is not repeated before the next arrival, so once a
+// burst is over the consumer does not keep spinning on the gap it learned
+// during the burst. On a single CPU the producer cannot run while the
+// consumer spins, so it never does.
+class AdaptiveSpin
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit AdaptiveSpin(Clock::duration limit = std::chrono::microseconds(50),
+        unsigned cpus = std::thread::hardware_concurrency())
+        : limitNs_(cpus > 1 ? std::chrono::duration_cast<std::chrono::nanoseconds>(limit).count()
+                            : 0)
+    {
+    }
+
+    // Producer, for every arrival (under its own lock if there are several).
+    void onArrival(Clock::time_point now)
+    {
+        int64_t t = now.time_since_epoch().count();
+        int64_t last = last_.exchange(t, std::memory_order_relaxed);
+        if (last == 0)
+            return;
+        int64_t gap = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::duration(t - last)).count();
+        // Exponential average with weight 1/8, clamped so one long pause
+        // does not take many arrivals to forget.
+        int64_t avg = gapNs_.load(std::memory_order_relaxed);
+        gap = std::min(gap, 4 * limitNs_);
+        gapNs_.store(avg + (gap - avg) / 8, std::memory_order_relaxed);
+        arrivals_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::chrono::nanoseconds budget() const
+    {
+        int64_t gap = gapNs_.load(std::memory_order_relaxed);
+        return std::chrono::nanoseconds(gap < limitNs_ ? std::min(2 * gap, limitNs_) : 0);
+    }
+
+    // Consumer: polls ready() for up to budget(); true once it returns true.
+    // Returns false at once if nothing arrived since the last spin that
+    // came up empty.
+    template <typename Ready>
+    bool spin(Ready&& ready)
+    {
+        auto spinFor = budget();
+        uint64_t arrivals = arrivals_.load(std::memory_order_relaxed);
+        if (spinFor.count() == 0 || arrivals == idleAt_)
+            return false;
+        auto deadline = Clock::now() + spinFor;
+        do {
+            for (int i = 0; i < 16; ++i) {
+                if (ready())
+                    return true;
+                cpuRelax();
+            }
+        } while (Clock::now() < deadline);
+        if (ready())
+            return true;
+        idleAt_ = arrivals;
+        return false;
+    }
+
+private:
+    int64_t limitNs_;
+    std::atomic<int64_t> last_{0};
+    std::atomic<int64_t> gapNs_{INT32_MAX};
+    std::atomic<uint64_t> arrivals_{0};
+    uint64_t idleAt_ = UINT64_MAX;   // consumer-owned: arrivals_ at the last empty spin
+};
+
+} // namespace kq
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+
+// RDP carries a DVC message in PDUs of at most CHANNEL_CHUNK_LENGTH bytes
+// (MS-RDPEDYC 2.2.3). A message that fits one PDU goes out as a Data PDU
+// with a 2-byte header (command + 1-byte channel id); a longer one starts
+// with a DataFirst PDU that additionally carries the total length in 1, 2 or
+// 4 bytes, followed by Data PDUs. Writing whatever size a read happened to
+// return usually leaves the last PDU nearly empty, so writers pick lengths
+// that fill every PDU and carry the remainder into the next write.
+//
+// The chunk size may be updated from another thread (see DvcChunkProbe), so
+// it is kept in a relaxed atomic.
+namespace kq {
+
+inline constexpr size_t defaultDvcChunkSize = 1600;
+
+class DvcChunking
+{
+public:
+    static constexpr size_t dataHeaderSize = 2;
+
+    explicit DvcChunking(size_t chunkSize = defaultDvcChunkSize)
+    {
+        setChunkSize(chunkSize);
+    }
+
+    // 0 disables alignment: writes go out exactly as read.
+    void setChunkSize(size_t chunkSize)
+    {
+        chunkSize_.store(chunkSize > dataHeaderSize + 4 ? chunkSize : 0,
+            std::memory_order_relaxed);
+    }
+
+    size_t chunkSize() const { return chunkSize_.load(std::memory_order_relaxed); }
+    bool enabled() const { return chunkSize() != 0; }
+
+    // Number of PDUs a message of `len` bytes is fragmented into.
+    size_t pdusFor(size_t len) const
+    {
+        size_t chunk = chunkSize();
+        if (chunk == 0 || len == 0)
+            return 1;
+        size_t single = chunk - dataHeaderSize;
+        if (len <= single)
+            return 1;
+        size_t first = single - lengthBytes(len);
+        return 1 + (len - first + single - 1) / single;
+    }
+
+    // Largest length <= `available` whose PDUs are all full, or 0 if even a
+    // single full PDU does not fit.
+    size_t alignedLength(size_t available) const
+    {
+        size_t chunk = chunkSize();
+        if (chunk == 0)
+            return available;
+        size_t single = chunk - dataHeaderSize;
+        size_t best = available >= single ? single : 0;
+        for (size_t lenBytes : {4, 2, 1}) {
+            size_t first = single - lenBytes;
+            if (available < first + single)
+                continue;
+            size_t len = first + (available - first) / single * single;
+            if (lengthBytes(len) == lenBytes)
+                return std::max(best, len);
+        }
+        return best;
+    }
+
+    // How many of the `available` buffered bytes to write now. With nothing
+    // else pending everything goes out at once, so interactive traffic is
+    // never held back; otherwise only whole PDUs are written. 0 means "read
+    // more first".
+    size_t writeSize(size_t available, bool morePending) const
+    {
+        if (!morePending)
+            return available;
+        return alignedLength(available);
+    }
+
+private:
+    static size_t lengthBytes(size_t len)
+    {
+        if (len <= 0xFF)
+            return 1;
+        if (len <= 0xFFFF)
+            return 2;
+        return 4;
+    }
+
+    std::atomic<size_t> chunkSize_{0};
+};
+
+// Learns the chunk size the RDP stack actually uses from the PDUs the server
+// reads: every PDU except the last of a message is full, so the largest
+// non-final payload plus the Data PDU header is the chunk size, in the same
+// unit DvcChunking takes.
+class DvcChunkProbe
+{
+public:
+    static constexpr uint32_t flagLast = 0x02; // CHANNEL_FLAG_LAST
+
+    // Returns true when the estimate changed.
+    bool observe(size_t payloadLen, uint32_t flags)
+    {
+        size_t chunkSize = payloadLen + DvcChunking::dataHeaderSize;
+        if ((flags & flagLast) || chunkSize <= chunkSize_)
+            return false;
+        chunkSize_ = chunkSize;
+        return true;
+    }
+
+    size_t chunkSize() const { return chunkSize_; }
+
+private:
+    size_t chunkSize_ = 0;
+};
+
+} // namespace kq
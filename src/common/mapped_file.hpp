@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A file mapped read/write in full, for on-disk state that is updated in
+// place. The file is held exclusively (share mode 0 on Windows, flock
+// elsewhere), so a second process using the same path fails to open it
+// instead of silently sharing it.
+namespace kq {
+
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    ~MappedFile() { close(); }
+
+    // Opens or creates `path` with exactly `size` bytes. resized() tells
+    // whether the file was created or had a different size, in which case
+    // its contents are not meaningful.
+    bool open(std::string const& path, size_t size)
+    {
+        close();
+        size_ = size;
+#ifdef _WIN32
+        file_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+            OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER current{};
+        GetFileSizeEx(file_, &current);
+        resized_ = static_cast<uint64_t>(current.QuadPart) != size;
+        if (resized_) {
+            LARGE_INTEGER end{};
+            end.QuadPart = static_cast<LONGLONG>(size);
+            if (!SetFilePointerEx(file_, end, nullptr, FILE_BEGIN) || !SetEndOfFile(file_)) {
+                close();
+                return false;
+            }
+        }
+
+        mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READWRITE,
+            static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+            static_cast<DWORD>(size & 0xFFFFFFFF), nullptr);
+        if (!mapping_) {
+            close();
+            return false;
+        }
+        data_ = static_cast<char*>(MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, size));
+#else
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd_ < 0)
+            return false;
+        struct stat st{};
+        if (flock(fd_, LOCK_EX | LOCK_NB) != 0 || fstat(fd_, &st) != 0) {
+            close();
+            return false;
+        }
+        resized_ = static_cast<uint64_t>(st.st_size) != size;
+        if (resized_ && ftruncate(fd_, static_cast<off_t>(size)) != 0) {
+            close();
+            return false;
+        }
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        data_ = p == MAP_FAILED ? nullptr : static_cast<char*>(p);
+#endif
+        if (!data_) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (data_)
+            UnmapViewOfFile(data_);
+        if (mapping_)
+            CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE)
+            CloseHandle(file_);
+        mapping_ = nullptr;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if (data_)
+            munmap(data_, size_);
+        if (fd_ >= 0)
+            ::close(fd_);
+        fd_ = -1;
+#endif
+        data_ = nullptr;
+    }
+
+    bool isOpen() const { return data_ != nullptr; }
+    bool resized() const { return resized_; }
+    char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+    char* data_ = nullptr;
+    size_t size_ = 0;
+    bool resized_ = false;
+};
+
+} // namespace kq
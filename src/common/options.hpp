@@ -0,0 +1,77 @@
+#pragma once
+
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace kq {
+
+// Splits `--name=value` and bare `--name` switches out of argv. Everything
+// else is kept, in order, as a positional argument (argv[0] excluded), so the
+// existing `[mode] [host] [port]` syntax keeps working alongside the switches.
+class Options
+{
+public:
+    Options(int argc, char* argv[])
+    {
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            if (!arg.starts_with("--")) {
+                positional_.emplace_back(arg);
+                continue;
+            }
+            arg.remove_prefix(2);
+            auto eq = arg.find('=');
+            if (eq == std::string_view::npos)
+                named_.emplace_back(std::string(arg), std::string());
+            else
+                named_.emplace_back(std::string(arg.substr(0, eq)),
+                    std::string(arg.substr(eq + 1)));
+        }
+    }
+
+    std::vector<std::string> const& positional() const { return positional_; }
+
+    bool has(std::string_view name) const { return find(name) != nullptr; }
+
+    std::string get(std::string_view name, std::string_view fallback) const
+    {
+        auto const* value = find(name);
+        return value ? *value : std::string(fallback);
+    }
+
+    // Numeric switches; a missing or malformed value yields the fallback.
+    template <typename T>
+        requires std::is_arithmetic_v<T>
+    T get(std::string_view name, T fallback) const
+    {
+        auto const* value = find(name);
+        if (!value || value->empty())
+            return fallback;
+        T result{};
+        auto [end, ec] = std::from_chars(
+            value->data(), value->data() + value->size(), result);
+        if (ec != std::errc{} || end != value->data() + value->size())
+            return fallback;
+        return result;
+    }
+
+private:
+    std::string const* find(std::string_view name) const
+    {
+        // Last occurrence wins, like most command-line tools.
+        for (auto it = named_.rbegin(); it != named_.rend(); ++it) {
+            if (it->first == name)
+                return &it->second;
+        }
+        return nullptr;
+    }
+
+    std::vector<std::string> positional_;
+    std::vector<std::pair<std::string, std::string>> named_;
+};
+
+} // namespace kq
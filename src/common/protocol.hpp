@@ -11,4 +11,40 @@ inline constexpr char const* defaultTargetHost = "localhost";
 inline constexpr uint16_t defaultTargetPort = 22;
 inline constexpr size_t bufferSize = 8192;
 
+// Paths that forward reads to TCP gather whatever is already readable into
+// one write, up to this many reads or bytes.
+inline constexpr size_t maxGatherReads = 64;
+inline constexpr size_t maxGatherBytes = 256 * 1024;
+
+// The plugin opens every pipe connection with a PipeHello naming the RDP
+// session the tunnel belongs to (the pipe has one instance per connection,
+// so several sessions can tunnel at once); the client answers with a
+// PipeWelcome naming the transport for the stream. With
+// sharedMemory the stream moves to the rings in `mapping` (see shm_ring.hpp)
+// and the pipe stays open only to signal that either side went away.
+inline constexpr char pipeMagic[8] = "KQPIPE";
+inline constexpr uint32_t pipeProtocolVersion = 2;
+
+inline constexpr uint32_t pipeFlagSharedMemory = 1; // plugin can use shared memory
+inline constexpr unsigned long pipeHandshakeTimeoutMs = 10000;
+
+struct PipeHello {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t processId;   // process hosting the RDP client
+    uint32_t session;     // plugin instance (RDP connection) in that process
+};
+static_assert(sizeof(PipeHello) == 24);
+
+enum class PipeTransport : uint32_t { pipe, sharedMemory };
+
+struct PipeWelcome {
+    char magic[8];
+    uint32_t version;
+    PipeTransport transport;
+    char mapping[64];
+};
+static_assert(sizeof(PipeWelcome) == 80);
+
 } // namespace kq
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Routing of concurrent RDP sessions inside one kq-tunnel-client. Every
+// plugin connection names the RDP session it belongs to; the router hands
+// out a numbered slot per session (which the client turns into a listener
+// port) and gives a session back the same slot each time it reconnects, for
+// as long as that slot has not been reused by another session.
+namespace kq {
+
+struct SessionKey {
+    uint32_t processId;   // process hosting the RDP client
+    uint32_t session;     // plugin instance within that process
+
+    auto operator<=>(SessionKey const&) const = default;
+};
+
+class SessionRouter
+{
+public:
+    explicit SessionRouter(size_t slots) : slots_(slots) {}
+
+    // Returns the slot for `key`: its previous one if free, else one never
+    // used, else the one released longest ago. -1 if all slots are busy.
+    int acquire(SessionKey key)
+    {
+        std::lock_guard lock(mtx_);
+        int best = -1;
+        for (size_t i = 0; i < slots_.size(); ++i) {
+            auto const& slot = slots_[i];
+            if (slot.busy)
+                continue;
+            if (slot.used && slot.owner == key) {
+                best = static_cast<int>(i);
+                break;
+            }
+            if (best < 0 || rank(slot) < rank(slots_[static_cast<size_t>(best)]))
+                best = static_cast<int>(i);
+        }
+        if (best >= 0) {
+            auto& slot = slots_[static_cast<size_t>(best)];
+            slot.owner = key;
+            slot.used = true;
+            slot.busy = true;
+        }
+        return best;
+    }
+
+    void release(int index)
+    {
+        std::lock_guard lock(mtx_);
+        auto& slot = slots_.at(static_cast<size_t>(index));
+        slot.busy = false;
+        slot.releasedAt = ++clock_;
+    }
+
+private:
+    struct Slot {
+        SessionKey owner{};
+        bool used = false;
+        bool busy = false;
+        uint64_t releasedAt = 0;
+    };
+
+    // Never-used slots first, then by release order.
+    static uint64_t rank(Slot const& slot) { return slot.used ? slot.releasedAt + 1 : 0; }
+
+    std::mutex mtx_;
+    std::vector<Slot> slots_;
+    uint64_t clock_ = 0;
+};
+
+} // namespace kq
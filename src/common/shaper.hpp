@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+// Bandwidth shaping for writes into the DVC, so bulk transfers leave room for
+// the RDP session's own graphics and input traffic. Every call takes the
+// current time explicitly, which keeps the arithmetic deterministic and lets
+// callers drive it from a simulated clock.
+namespace kq {
+
+struct ShaperConfig {
+    uint64_t rate = 0;               // bytes per second, 0 = unlimited
+    uint64_t burst = 64 * 1024;      // bucket depth in bytes
+    uint32_t adaptiveTargetMs = 0;   // write latency target, 0 = fixed rate
+};
+
+inline constexpr uint64_t adaptiveCeiling = 64 * 1024 * 1024;
+inline constexpr uint64_t adaptiveFloor = 32 * 1024;
+
+template <typename Clock = std::chrono::steady_clock>
+class TokenBucket
+{
+public:
+    using time_point = typename Clock::time_point;
+    using duration = typename Clock::duration;
+
+    TokenBucket(uint64_t rate, uint64_t burst, time_point now)
+        : rate_(rate), burst_(std::max<uint64_t>(burst, 1)),
+          tokens_(static_cast<double>(burst_)), last_(now)
+    {
+    }
+
+    uint64_t rate() const { return rate_; }
+
+    void setRate(uint64_t rate, time_point now)
+    {
+        refill(now);
+        rate_ = rate;
+    }
+
+    // Takes `bytes` tokens and returns how long the caller has to wait before
+    // sending them. The bucket may go into debt, so a write larger than the
+    // burst is delayed rather than refused and later writes pay it back.
+    duration reserve(uint64_t bytes, time_point now)
+    {
+        if (rate_ == 0)
+            return duration::zero();
+        refill(now);
+        tokens_ -= static_cast<double>(bytes);
+        if (tokens_ >= 0)
+            return duration::zero();
+        return std::chrono::duration_cast<duration>(
+            std::chrono::duration<double>(-tokens_ / static_cast<double>(rate_)));
+    }
+
+private:
+    void refill(time_point now)
+    {
+        if (now <= last_)
+            return;
+        double elapsed = std::chrono::duration<double>(now - last_).count();
+        tokens_ = std::min(tokens_ + elapsed * static_cast<double>(rate_),
+            static_cast<double>(burst_));
+        last_ = now;
+    }
+
+    uint64_t rate_;
+    uint64_t burst_;
+    double tokens_;
+    time_point last_;
+};
+
+// Token bucket whose rate follows DVC write completion latency: once per
+// adjustment interval the rate backs off multiplicatively if any write took
+// longer than the target (the channel is queueing behind display traffic) and
+// otherwise creeps back up additively towards the configured ceiling.
+template <typename Clock = std::chrono::steady_clock>
+class Shaper
+{
+public:
+    using time_point = typename Clock::time_point;
+    using duration = typename Clock::duration;
+
+    static constexpr auto interval = std::chrono::milliseconds(100);
+    static constexpr double backoff = 0.7;
+
+    Shaper(ShaperConfig const& config, time_point now)
+        : ceiling_(config.rate ? config.rate
+                               : (config.adaptiveTargetMs ? adaptiveCeiling : 0)),
+          target_(std::chrono::milliseconds(config.adaptiveTargetMs)),
+          bucket_(ceiling_, config.burst, now), windowStart_(now)
+    {
+    }
+
+    bool active() const { return ceiling_ != 0; }
+    bool adaptive() const { return target_ != duration::zero(); }
+    uint64_t rate() const { return bucket_.rate(); }
+
+    duration reserve(uint64_t bytes, time_point now) { return bucket_.reserve(bytes, now); }
+
+    void onWriteComplete(duration latency, time_point now)
+    {
+        if (!adaptive())
+            return;
+        worst_ = std::max(worst_, latency);
+        if (now - windowStart_ < interval)
+            return;
+
+        uint64_t rate = bucket_.rate();
+        if (worst_ > target_)
+            rate = static_cast<uint64_t>(static_cast<double>(rate) * backoff);
+        else
+            rate += std::max<uint64_t>(ceiling_ / 20, adaptiveFloor);
+        bucket_.setRate(std::clamp(rate, std::min(adaptiveFloor, ceiling_), ceiling_), now);
+
+        worst_ = duration::zero();
+        windowStart_ = now;
+    }
+
+private:
+    uint64_t ceiling_;
+    duration target_;
+    TokenBucket<Clock> bucket_;
+    time_point windowStart_;
+    duration worst_{};
+};
+
+} // namespace kq
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A named, page-file backed shared memory block for processes on the same
+// machine: a file mapping on Windows, shm_open elsewhere. The creator owns
+// the name; on POSIX it is unlinked when the creator closes, on Windows it
+// goes away with the last handle.
+namespace kq {
+
+class SharedMemory
+{
+public:
+    SharedMemory() = default;
+    SharedMemory(SharedMemory const&) = delete;
+    SharedMemory& operator=(SharedMemory const&) = delete;
+
+    ~SharedMemory() { close(); }
+
+    // Fails if the name already exists.
+    bool create(std::string const& name, size_t size)
+    {
+        close();
+        size_ = size;
+#ifdef _WIN32
+        mapping_ = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+            static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+            static_cast<DWORD>(size & 0xFFFFFFFF), name.c_str());
+        if (mapping_ && GetLastError() == ERROR_ALREADY_EXISTS) {
+            close();
+            return false;
+        }
+#else
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            return false;
+        name_ = name;
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            ::close(fd);
+            close();
+            return false;
+        }
+        mapFd(fd);
+#endif
+        return map();
+    }
+
+    bool open(std::string const& name, size_t size)
+    {
+        close();
+        size_ = size;
+#ifdef _WIN32
+        mapping_ = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+#else
+        int fd = shm_open(name.c_str(), O_RDWR, 0600);
+        if (fd < 0)
+            return false;
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < size) {
+            ::close(fd);
+            return false;
+        }
+        mapFd(fd);
+#endif
+        return map();
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (data_)
+            UnmapViewOfFile(data_);
+        if (mapping_)
+            CloseHandle(mapping_);
+        mapping_ = nullptr;
+#else
+        if (data_)
+            munmap(data_, size_);
+        if (!name_.empty())
+            shm_unlink(name_.c_str());
+        name_.clear();
+#endif
+        data_ = nullptr;
+    }
+
+    char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+#ifdef _WIN32
+    bool map()
+    {
+        if (mapping_)
+            data_ = static_cast<char*>(MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, size_));
+        if (!data_)
+            close();
+        return data_ != nullptr;
+    }
+
+    HANDLE mapping_ = nullptr;
+#else
+    void mapFd(int fd)
+    {
+        void* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        data_ = p == MAP_FAILED ? nullptr : static_cast<char*>(p);
+    }
+
+    bool map()
+    {
+        if (!data_)
+            close();
+        return data_ != nullptr;
+    }
+
+    std::string name_;
+#endif
+    char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+} // namespace kq
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+
+#include "shared_memory.hpp"
+
+#ifndef _WIN32
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// Shared-memory transport between the plugin and kq-tunnel-client, which
+// always run on the same machine: one single-producer/single-consumer byte
+// ring per direction in a named mapping, so the stream does not take a
+// kernel transition and copy per pipe read and write.
+//
+// A side only sleeps after "parking" itself in the ring -- setting a flag
+// and re-checking the ring -- and the other side only signals when it finds
+// that flag set, so wakeups happen when a ring goes from empty to non-empty
+// (or from full to non-full) while its peer is waiting, not once per write.
+// The flags are the futex words on Linux; on Windows each has a named
+// auto-reset event, so it can be waited on together with other handles.
+namespace kq::shm {
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+struct RingControl {
+    alignas(64) std::atomic<uint64_t> head;        // bytes ever written, producer-owned
+    alignas(64) std::atomic<uint64_t> tail;        // bytes ever read, consumer-owned
+    alignas(64) std::atomic<uint32_t> readerParked;
+    std::atomic<uint32_t> writerParked;
+};
+
+// A view of one ring; `capacity` must be a power of two.
+class SpscRing
+{
+public:
+    SpscRing() = default;
+    SpscRing(RingControl* control, char* data, size_t capacity)
+        : c_(control), data_(data), capacity_(capacity)
+    {
+    }
+
+    size_t readable() const
+    {
+        return static_cast<size_t>(c_->head.load(std::memory_order_acquire)
+            - c_->tail.load(std::memory_order_relaxed));
+    }
+
+    size_t writable() const
+    {
+        return capacity_ - static_cast<size_t>(c_->head.load(std::memory_order_relaxed)
+            - c_->tail.load(std::memory_order_acquire));
+    }
+
+    // Producer: copies in as much of `len` as fits, returns the count.
+    size_t write(char const* src, size_t len)
+    {
+        uint64_t head = c_->head.load(std::memory_order_relaxed);
+        len = std::min(len, writable());
+        size_t at = static_cast<size_t>(head) & (capacity_ - 1);
+        size_t first = std::min(len, capacity_ - at);
+        std::memcpy(data_ + at, src, first);
+        std::memcpy(data_, src + first, len - first);
+        c_->head.store(head + len, std::memory_order_release);
+        return len;
+    }
+
+    // Consumer: copies out up to `len` bytes, returns the count.
+    size_t read(char* dst, size_t len)
+    {
+        uint64_t tail = c_->tail.load(std::memory_order_relaxed);
+        len = std::min(len, readable());
+        size_t at = static_cast<size_t>(tail) & (capacity_ - 1);
+        size_t first = std::min(len, capacity_ - at);
+        std::memcpy(dst, data_ + at, first);
+        std::memcpy(dst + first, data_, len - first);
+        c_->tail.store(tail + len, std::memory_order_release);
+        return len;
+    }
+
+    // Consumer, before sleeping: false if data arrived meanwhile, in which
+    // case it must not sleep.
+    bool parkReader() { return park(c_->readerParked, [this] { return readable() == 0; }); }
+
+    // Producer, before sleeping on a full ring.
+    bool parkWriter() { return park(c_->writerParked, [this] { return writable() == 0; }); }
+
+    // Producer, after write(): true if the consumer was parked and has to
+    // be woken.
+    bool unparkReader() { return unpark(c_->readerParked); }
+
+    // Consumer, after read(): true if the producer was waiting for space.
+    bool unparkWriter() { return unpark(c_->writerParked); }
+
+    std::atomic<uint32_t>& readerFlag() const { return c_->readerParked; }
+    std::atomic<uint32_t>& writerFlag() const { return c_->writerParked; }
+
+private:
+    // The flag store and the ring re-check (and, on the other side, the
+    // index store and the flag load) are separated by full fences, so one
+    // side always sees the other's update.
+    template <typename StillBlocked>
+    static bool park(std::atomic<uint32_t>& flag, StillBlocked stillBlocked)
+    {
+        flag.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (stillBlocked())
+            return true;
+        flag.store(0, std::memory_order_relaxed);
+        return false;
+    }
+
+    static bool unpark(std::atomic<uint32_t>& flag)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return flag.load(std::memory_order_relaxed) != 0
+            && flag.exchange(0, std::memory_order_relaxed) != 0;
+    }
+
+    RingControl* c_ = nullptr;
+    char* data_ = nullptr;
+    size_t capacity_ = 0;
+};
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;   // bytes per ring
+    RingControl rings[2];
+};
+
+inline constexpr uint32_t headerMagic = 0x4D53514B; // "KQSM"
+inline constexpr uint32_t headerVersion = 1;
+inline constexpr size_t defaultCapacity = 1024 * 1024;
+
+// Ring 0 carries client -> plugin, ring 1 plugin -> client.
+enum class Side { client, plugin };
+
+class Transport
+{
+public:
+    Transport() = default;
+    Transport(Transport const&) = delete;
+    Transport& operator=(Transport const&) = delete;
+
+    ~Transport() { close(); }
+
+    // Client side: creates the mapping (and events) under `name`.
+    bool create(std::string const& name, size_t capacity)
+    {
+        if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+            return false;
+        if (!memory_.create(name, layoutSize(capacity)))
+            return false;
+        auto* header = new (memory_.data()) Header{};
+        header->capacity = capacity;
+        header->version = headerVersion;
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = headerMagic;
+        return attach(name, Side::client, true);
+    }
+
+    // Plugin side: opens what the client created.
+    bool open(std::string const& name)
+    {
+        if (!memory_.open(name, sizeof(Header)))
+            return false;
+        auto const* header = reinterpret_cast<Header const*>(memory_.data());
+        if (header->magic != headerMagic || header->version != headerVersion)
+            return false;
+        size_t capacity = header->capacity;
+        if (!memory_.open(name, layoutSize(capacity)))
+            return false;
+        return attach(name, Side::plugin, false);
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        for (auto& e : events_) {
+            if (e)
+                CloseHandle(e);
+            e = nullptr;
+        }
+#endif
+        memory_.close();
+    }
+
+    SpscRing& tx() { return tx_; }
+    SpscRing& rx() { return rx_; }
+
+    // After writing to tx(): wakes the peer if it sleeps on an empty ring.
+    void notifyWritten()
+    {
+        if (tx_.unparkReader())
+            wake(tx_.readerFlag(), txData());
+    }
+
+    // After reading from rx(): wakes the peer if it sleeps on a full ring.
+    void notifyRead()
+    {
+        if (rx_.unparkWriter())
+            wake(rx_.writerFlag(), rxSpace());
+    }
+
+#ifdef _WIN32
+    // Signalled when rx() may have data after parkReader(), and when tx()
+    // may have space after parkWriter(). Auto-reset; only this side waits
+    // on them, so it may also set them itself to re-run its loop.
+    HANDLE rxReady() const { return rxData(); }
+    HANDLE txReady() const { return txSpace(); }
+#else
+    // Sleeps until woken or `timeoutMs` passes; call after a successful
+    // parkReader() / parkWriter().
+    void waitRx(int timeoutMs) { futexWait(rx_.readerFlag(), timeoutMs); }
+    void waitTx(int timeoutMs) { futexWait(tx_.writerFlag(), timeoutMs); }
+#endif
+
+private:
+    static size_t layoutSize(size_t capacity) { return sizeof(Header) + 2 * capacity; }
+
+    bool attach(std::string const& name, Side side, bool create)
+    {
+        auto* header = reinterpret_cast<Header*>(memory_.data());
+        size_t capacity = header->capacity;
+        char* data = memory_.data() + sizeof(Header);
+        SpscRing toPlugin(&header->rings[0], data, capacity);
+        SpscRing toClient(&header->rings[1], data + capacity, capacity);
+        tx_ = side == Side::client ? toPlugin : toClient;
+        rx_ = side == Side::client ? toClient : toPlugin;
+        txIndex_ = side == Side::client ? 0 : 1;
+
+#ifdef _WIN32
+        // d<i>: data in ring i, s<i>: space in ring i.
+        char const* suffixes[] = {"-d0", "-s0", "-d1", "-s1"};
+        for (size_t i = 0; i < 4; ++i) {
+            std::string eventName = name + suffixes[i];
+            events_[i] = create ? CreateEventA(nullptr, FALSE, FALSE, eventName.c_str())
+                                : OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE,
+                                      eventName.c_str());
+            if (!events_[i]) {
+                close();
+                return false;
+            }
+        }
+#else
+        (void)name;
+        (void)create;
+#endif
+        return true;
+    }
+
+#ifdef _WIN32
+    HANDLE txData() const { return events_[txIndex_ * 2]; }
+    HANDLE txSpace() const { return events_[txIndex_ * 2 + 1]; }
+    HANDLE rxData() const { return events_[(1 - txIndex_) * 2]; }
+    HANDLE rxSpace() const { return events_[(1 - txIndex_) * 2 + 1]; }
+
+    static void wake(std::atomic<uint32_t>&, HANDLE event) { SetEvent(event); }
+#else
+    int txData() const { return 0; }
+    int rxSpace() const { return 0; }
+
+    // The parked flag itself is the futex word: sleep while it is still 1.
+    static void futexWait(std::atomic<uint32_t>& flag, int timeoutMs)
+    {
+        timespec ts{timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&flag), FUTEX_WAIT, 1,
+            timeoutMs < 0 ? nullptr : &ts, nullptr, 0);
+    }
+
+    static void wake(std::atomic<uint32_t>& flag, int)
+    {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&flag), FUTEX_WAKE, INT_MAX,
+            nullptr, nullptr, 0);
+    }
+#endif
+
+    SharedMemory memory_;
+    SpscRing tx_;
+    SpscRing rx_;
+    size_t txIndex_ = 0;
+#ifdef _WIN32
+    HANDLE events_[4] = {};
+#endif
+};
+
+} // namespace kq::shm
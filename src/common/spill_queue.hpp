@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "mapped_file.hpp"
+
+// A byte FIFO for data waiting on a slow consumer. Up to `memoryLimit` bytes
+// are kept in a heap buffer; with a spill file enabled, anything beyond that
+// goes into a memory-mapped, file-backed ring instead of growing the heap,
+// and comes back out in order as the consumer catches up. Once data has
+// spilled, new data follows it into the file until the file has drained, so
+// the heap part always holds the oldest bytes. The file is only created
+// when data first has to spill.
+//
+// Not thread-safe; callers guard it with the lock they already hold around
+// their queue.
+namespace kq {
+
+inline constexpr uint64_t defaultSpillThreshold = 4 * 1024 * 1024;
+inline constexpr uint64_t defaultSpillCapacity = 256 * 1024 * 1024;
+
+// Spilled data comes out at most this much per pop(), so draining the file
+// does not grow the heap either.
+inline constexpr size_t spillReadSize = 1024 * 1024;
+
+template <typename Buffer = std::vector<char>>
+class SpillQueue
+{
+public:
+    explicit SpillQueue(size_t memoryLimit) : memoryLimit_(memoryLimit) {}
+
+    SpillQueue(SpillQueue const&) = delete;
+    SpillQueue& operator=(SpillQueue const&) = delete;
+
+    ~SpillQueue() { disableSpill(); }
+
+    // Adds a spill ring of `capacity` bytes in the file at `path`, which is
+    // created the first time data spills and removed again when the queue
+    // goes away.
+    void enableSpill(std::string const& path, size_t capacity)
+    {
+        disableSpill();
+        path_ = path;
+        capacity_ = capacity;
+    }
+
+    bool spillEnabled() const { return !path_.empty(); }
+    // The spill file could not be created; the queue stays in memory.
+    bool spillFailed() const { return spillFailed_; }
+    size_t inMemory() const { return memory_.size(); }
+    size_t spilled() const { return static_cast<size_t>(spillHead_ - spillTail_); }
+    size_t size() const { return inMemory() + spilled(); }
+    bool empty() const { return size() == 0; }
+    size_t peakSpilled() const { return peakSpilled_; }
+
+    // Appends all of `data` or nothing; false when there is no room for it.
+    // An empty queue takes any piece, in memory if need be, so one larger
+    // than both tiers still gets through once the consumer has caught up.
+    bool push(void const* data, size_t len)
+    {
+        auto const* p = static_cast<typename Buffer::value_type const*>(data);
+        if (empty() || (spilled() == 0 && inMemory() + len <= memoryLimit_)) {
+            memory_.insert(memory_.end(), p, p + len);
+            return true;
+        }
+        if (!openSpill() || file_.size() - spilled() < len)
+            return false;
+
+        size_t at = static_cast<size_t>(spillHead_ % file_.size());
+        size_t first = std::min(len, file_.size() - at);
+        std::memcpy(file_.data() + at, p, first);
+        std::memcpy(file_.data(), p + first, len - first);
+        spillHead_ += len;
+        peakSpilled_ = std::max(peakSpilled_, spilled());
+        return true;
+    }
+
+    // Moves the oldest bytes to the end of `out`: everything held in memory
+    // (handed over without copying when `out` is empty), or else up to
+    // spillReadSize bytes from the file. Returns the number of bytes moved.
+    size_t pop(Buffer& out)
+    {
+        if (size_t n = inMemory()) {
+            if (out.empty())
+                out.swap(memory_);
+            else
+                out.insert(out.end(), memory_.begin(), memory_.end());
+            memory_.clear();
+            return n;
+        }
+
+        size_t n = std::min(spilled(), spillReadSize);
+        if (n == 0)
+            return 0;
+        size_t at = static_cast<size_t>(spillTail_ % file_.size());
+        size_t first = std::min(n, file_.size() - at);
+        size_t offset = out.size();
+        out.resize(offset + n);
+        std::memcpy(out.data() + offset, file_.data() + at, first);
+        std::memcpy(out.data() + offset + first, file_.data(), n - first);
+        spillTail_ += n;
+        return n;
+    }
+
+private:
+    bool openSpill()
+    {
+        if (file_.isOpen())
+            return true;
+        if (path_.empty() || spillFailed_)
+            return false;
+        spillFailed_ = !file_.open(path_, capacity_);
+        return !spillFailed_;
+    }
+
+    void disableSpill()
+    {
+        if (file_.isOpen() || spillFailed_) {
+            file_.close();
+            std::error_code ec;
+            std::filesystem::remove(path_, ec);
+        }
+        path_.clear();
+        spillFailed_ = false;
+        spillHead_ = spillTail_ = 0;
+    }
+
+    size_t memoryLimit_;
+    Buffer memory_;
+
+    MappedFile file_;
+    std::string path_;
+    size_t capacity_ = 0;
+    bool spillFailed_ = false;
+    uint64_t spillHead_ = 0;   // bytes ever spilled
+    uint64_t spillTail_ = 0;   // bytes ever drained from the file
+    size_t peakSpilled_ = 0;
+};
+
+} // namespace kq
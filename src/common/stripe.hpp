@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "protocol.hpp"
+
+// Striping one TCP stream across several dynamic channels. Stripe i is opened
+// as "KQTUNNEL<i>" (the unsuffixed name stays the plain single-channel
+// tunnel), and every message on a stripe is one frame: a StripeFrameHeader
+// followed by `length` payload bytes. Sequence numbers are global to the
+// direction, so the receiver can restore order whichever stripe a frame took.
+namespace kq {
+
+inline constexpr size_t maxStripes = 8;
+
+inline std::string stripeChannelName(size_t index)
+{
+    return std::string(channelName) + std::to_string(index);
+}
+
+struct StripeFrameHeader {
+    uint32_t seq;
+    uint32_t length;
+};
+static_assert(sizeof(StripeFrameHeader) == 8);
+
+inline constexpr size_t stripeFrameHeaderSize = sizeof(StripeFrameHeader);
+
+// Upper bound on a frame's payload; anything larger means the stream is out
+// of sync.
+inline constexpr size_t maxStripeFrame = 1024 * 1024;
+
+// Reassembles frames from a stripe read as a byte stream (the server reads
+// its DVC in PDU-sized pieces that do not follow frame boundaries).
+class StripeFrameParser
+{
+public:
+    // Calls onFrame(seq, data, len) for every complete frame. Returns false
+    // if a header is malformed or onFrame returns false.
+    template <typename OnFrame>
+    bool feed(char const* data, size_t len, OnFrame&& onFrame)
+    {
+        pending_.insert(pending_.end(), data, data + len);
+
+        size_t pos = 0;
+        bool ok = true;
+        while (pending_.size() - pos >= stripeFrameHeaderSize) {
+            StripeFrameHeader header;
+            std::memcpy(&header, pending_.data() + pos, sizeof(header));
+            if (header.length > maxStripeFrame) {
+                ok = false;
+                break;
+            }
+            if (pending_.size() - pos - stripeFrameHeaderSize < header.length)
+                break;
+            if (!onFrame(header.seq, pending_.data() + pos + stripeFrameHeaderSize,
+                    static_cast<size_t>(header.length))) {
+                ok = false;
+                break;
+            }
+            pos += stripeFrameHeaderSize + header.length;
+        }
+        pending_.erase(pending_.begin(), pending_.begin() + static_cast<ptrdiff_t>(pos));
+        return ok;
+    }
+
+private:
+    std::vector<char> pending_;
+};
+
+// Puts frames arriving on different stripes back into sequence order. Frames
+// that arrive in order are appended straight to the caller's output; only
+// the ones that overtook a predecessor are held, up to `maxBytes`.
+class ReorderBuffer
+{
+public:
+    explicit ReorderBuffer(size_t maxBytes) : maxBytes_(maxBytes) {}
+
+    // Returns false for a duplicate or stale frame, or when holding it would
+    // exceed the limit.
+    template <typename Out>
+    bool push(uint32_t seq, char const* data, size_t len, Out& out)
+    {
+        // Widen the 32-bit wire sequence relative to the next expected one.
+        auto delta = static_cast<int32_t>(seq - static_cast<uint32_t>(next_));
+        if (delta < 0)
+            return false;
+        uint64_t full = next_ + static_cast<uint64_t>(delta);
+
+        if (full != next_) {
+            if (bytes_ + len > maxBytes_)
+                return false;
+            auto [it, inserted] = held_.try_emplace(full, data, data + len);
+            if (!inserted)
+                return false;
+            bytes_ += len;
+            peak_ = std::max(peak_, bytes_);
+            return true;
+        }
+
+        out.insert(out.end(), data, data + len);
+        ++next_;
+        for (auto it = held_.begin(); it != held_.end() && it->first == next_;
+                it = held_.erase(it)) {
+            out.insert(out.end(), it->second.begin(), it->second.end());
+            bytes_ -= it->second.size();
+            ++next_;
+        }
+        return true;
+    }
+
+    size_t buffered() const { return bytes_; }
+    size_t peak() const { return peak_; }
+    size_t heldFrames() const { return held_.size(); }
+
+private:
+    size_t maxBytes_;
+    uint64_t next_ = 0;
+    std::map<uint64_t, std::vector<char>> held_;
+    size_t bytes_ = 0;
+    size_t peak_ = 0;
+};
+
+} // namespace kq
@@ -0,0 +1,349 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Opt-in binary event capture for post-mortem diagnosis of stalls.
+//
+// Each thread records into its own fixed-size ring, so the hot path is a
+// relaxed load of the enabled flag plus a 64-byte store framed by two slot
+// sequence stores -- no locks, no allocation. Rings are only registered
+// (once per thread) under a mutex and are recycled when their thread exits,
+// keeping the last records of finished sessions around for the dump. Dumps
+// copy the rings while writers may still be running: every slot is a
+// seqlock over atomic words, and records that changed during the copy are
+// discarded.
+namespace kq::trace {
+
+enum class Event : uint8_t {
+    read = 1,  // size = bytes read
+    write,     // size = bytes written
+    wait,      // value = time blocked in waitForIo, ns
+    queue,     // value = queue depth in bytes after the operation
+    error,     // value = error code
+};
+
+enum class Direction : uint8_t {
+    none,
+    dvcToTcp,
+    tcpToDvc,
+    pipeToTcp,
+    tcpToPipe,
+    dvcToPipe,
+    pipeToDvc,
+};
+
+inline constexpr size_t maxPrefix = 32;
+inline constexpr size_t ringCapacity = 16384; // ~1.1 MiB per thread
+
+struct Record {
+    int64_t timestampNs; // steady clock
+    uint32_t thread;     // ring id
+    Event event;
+    Direction direction;
+    uint16_t prefixLen;
+    uint64_t size;
+    uint64_t value;
+    uint8_t prefix[maxPrefix];
+};
+static_assert(sizeof(Record) == 64);
+
+// On-disk layout: FileHeader, then per ring a RingHeader followed by
+// `count` records in recording order. Little-endian, native packing.
+struct FileHeader {
+    char magic[8];       // "KQTRACE\0"
+    uint32_t version;
+    uint32_t recordSize;
+    int64_t steadyNs;    // steady clock at dump time...
+    int64_t systemNs;    // ...and the matching system clock, for wall time
+    uint32_t ringCount;
+    uint32_t reserved;
+};
+static_assert(sizeof(FileHeader) == 40);
+
+struct RingHeader {
+    uint32_t id;
+    uint32_t count;
+};
+
+inline constexpr char fileMagic[8] = "KQTRACE";
+inline constexpr uint32_t fileVersion = 1;
+
+inline int64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class Recorder
+{
+public:
+    static Recorder& instance()
+    {
+        static Recorder recorder;
+        return recorder;
+    }
+
+    // `prefixBytes` of every read/write payload are kept (capped at
+    // maxPrefix); 0 records sizes only.
+    void enable(std::string path, size_t prefixBytes)
+    {
+        {
+            std::lock_guard lock(mtx_);
+            path_ = std::move(path);
+        }
+        prefixBytes_.store(std::min(prefixBytes, maxPrefix), std::memory_order_relaxed);
+        enabled_.store(true, std::memory_order_release);
+    }
+
+    bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+    void record(Event event, Direction direction, uint64_t size, uint64_t value,
+        void const* payload = nullptr, size_t payloadLen = 0)
+    {
+        Ring& r = ring();
+        uint64_t head = r.head.load(std::memory_order_relaxed);
+        Record rec{};
+        rec.timestampNs = nowNs();
+        rec.thread = r.id;
+        rec.event = event;
+        rec.direction = direction;
+        rec.size = size;
+        rec.value = value;
+        size_t prefix = payload
+            ? std::min(payloadLen, prefixBytes_.load(std::memory_order_relaxed))
+            : 0;
+        rec.prefixLen = static_cast<uint16_t>(prefix);
+        if (prefix)
+            std::memcpy(rec.prefix, payload, prefix);
+        r.slots[head % ringCapacity].store(head, rec);
+        r.head.store(head + 1, std::memory_order_release);
+    }
+
+    // Writes every ring to the configured path. Safe to call from a console
+    // control handler or terminate handler; returns false if tracing is off
+    // or the file cannot be written.
+    bool dump()
+    {
+        std::string path;
+        {
+            std::lock_guard lock(mtx_);
+            path = path_;
+        }
+        return enabled() && dump(path);
+    }
+
+    bool dump(std::string const& path)
+    {
+        std::vector<std::pair<RingHeader, std::vector<Record>>> snapshot;
+        {
+            std::lock_guard lock(mtx_);
+            for (auto const& r : rings_)
+                snapshot.emplace_back(RingHeader{r->id, 0}, copy(*r));
+        }
+
+        std::FILE* f = std::fopen(path.c_str(), "wb");
+        if (!f)
+            return false;
+
+        FileHeader header{};
+        std::memcpy(header.magic, fileMagic, sizeof(header.magic));
+        header.version = fileVersion;
+        header.recordSize = sizeof(Record);
+        header.steadyNs = nowNs();
+        header.systemNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        header.ringCount = static_cast<uint32_t>(snapshot.size());
+
+        bool ok = std::fwrite(&header, sizeof(header), 1, f) == 1;
+        for (auto& [rh, records] : snapshot) {
+            rh.count = static_cast<uint32_t>(records.size());
+            ok = ok && std::fwrite(&rh, sizeof(rh), 1, f) == 1;
+            if (!records.empty())
+                ok = ok && std::fwrite(records.data(), sizeof(Record), records.size(), f)
+                    == records.size();
+        }
+        return std::fclose(f) == 0 && ok;
+    }
+
+private:
+    // One record behind a sequence number: odd while record n is being
+    // written (2n + 1), even once it is complete (2n + 2). The record itself
+    // is kept in atomic words so a reader racing the writer is not a data
+    // race, only a copy that fails validation.
+    struct Slot {
+        static constexpr size_t wordCount = sizeof(Record) / sizeof(uint64_t);
+
+        std::atomic<uint64_t> seq{0};
+        std::array<std::atomic<uint64_t>, wordCount> words{};
+
+        void store(uint64_t n, Record const& rec)
+        {
+            uint64_t raw[wordCount];
+            std::memcpy(raw, &rec, sizeof(raw));
+            seq.store(2 * n + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            for (size_t i = 0; i < wordCount; ++i)
+                words[i].store(raw[i], std::memory_order_relaxed);
+            seq.store(2 * n + 2, std::memory_order_release);
+        }
+
+        // False if the slot does not hold a complete record n.
+        bool load(uint64_t n, Record& rec) const
+        {
+            uint64_t before = seq.load(std::memory_order_acquire);
+            uint64_t raw[wordCount];
+            for (size_t i = 0; i < wordCount; ++i)
+                raw[i] = words[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (before != 2 * n + 2 || seq.load(std::memory_order_relaxed) != before)
+                return false;
+            std::memcpy(&rec, raw, sizeof(raw));
+            return true;
+        }
+    };
+
+    struct Ring {
+        explicit Ring(uint32_t ringId) : id(ringId) {}
+
+        uint32_t const id;
+        std::atomic<uint64_t> head{0};
+        bool inUse = true;
+        std::array<Slot, ringCapacity> slots{};
+    };
+
+    // Returns the ring to the pool when its thread exits.
+    struct Lease {
+        Recorder* owner = nullptr;
+        Ring* ring = nullptr;
+
+        ~Lease()
+        {
+            if (owner) {
+                std::lock_guard lock(owner->mtx_);
+                ring->inUse = false;
+            }
+        }
+    };
+
+    Ring& ring()
+    {
+        thread_local Lease lease;
+        if (!lease.ring) {
+            lease.ring = acquire();
+            lease.owner = this;
+        }
+        return *lease.ring;
+    }
+
+    Ring* acquire()
+    {
+        std::lock_guard lock(mtx_);
+        // Prefer the least recently used free ring so fresh history survives.
+        Ring* best = nullptr;
+        for (auto const& r : rings_) {
+            if (!r->inUse && (!best || lastTimestamp(*r) < lastTimestamp(*best)))
+                best = r.get();
+        }
+        if (best) {
+            best->inUse = true;
+            return best;
+        }
+        rings_.push_back(std::make_unique<Ring>(static_cast<uint32_t>(rings_.size())));
+        return rings_.back().get();
+    }
+
+    // Only called for rings whose thread has exited.
+    static int64_t lastTimestamp(Ring const& r)
+    {
+        uint64_t head = r.head.load(std::memory_order_acquire);
+        Record rec{};
+        return head && r.slots[(head - 1) % ringCapacity].load(head - 1, rec)
+            ? rec.timestampNs : 0;
+    }
+
+    // Records the writer overwrote or was writing during the copy are
+    // skipped; the rest come out in recording order.
+    static std::vector<Record> copy(Ring const& r)
+    {
+        uint64_t end = r.head.load(std::memory_order_acquire);
+        uint64_t begin = end > ringCapacity ? end - ringCapacity : 0;
+        std::vector<Record> records;
+        records.reserve(end - begin);
+        Record rec;
+        for (uint64_t i = begin; i < end; ++i) {
+            if (r.slots[i % ringCapacity].load(i, rec))
+                records.push_back(rec);
+        }
+        return records;
+    }
+
+    std::atomic<bool> enabled_{false};
+    std::atomic<size_t> prefixBytes_{0};
+    std::mutex mtx_;
+    std::string path_;
+    std::vector<std::unique_ptr<Ring>> rings_;
+};
+
+inline void record(Event event, Direction direction, uint64_t size, uint64_t value = 0,
+    void const* payload = nullptr, size_t payloadLen = 0)
+{
+    auto& recorder = Recorder::instance();
+    if (recorder.enabled())
+        recorder.record(event, direction, size, value, payload, payloadLen);
+}
+
+#ifdef _WIN32
+inline LONG WINAPI dumpOnUnhandledException(EXCEPTION_POINTERS*)
+{
+    Recorder::instance().dump();
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+inline BOOL WINAPI dumpOnConsoleCtrl(DWORD type)
+{
+    if (type == CTRL_BREAK_EVENT) {
+        Recorder::instance().dump();
+        return TRUE;
+    }
+    if (type == CTRL_C_EVENT || type == CTRL_CLOSE_EVENT)
+        Recorder::instance().dump();
+    return FALSE;
+}
+#endif
+
+// Dumps on std::terminate, on unhandled SEH exceptions and on Ctrl+C /
+// Ctrl+Break. Ctrl+Break only dumps and keeps the process running, so it
+// doubles as the "dump now" trigger for a stalled tunnel.
+inline void installDumpHandlers()
+{
+    static std::terminate_handler previous = std::set_terminate([] {
+        Recorder::instance().dump();
+        if (previous)
+            previous();
+        std::abort();
+    });
+
+#ifdef _WIN32
+    SetUnhandledExceptionFilter(dumpOnUnhandledException);
+    SetConsoleCtrlHandler(dumpOnConsoleCtrl, TRUE);
+#endif
+}
+
+} // namespace kq::trace
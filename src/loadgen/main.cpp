@@ -0,0 +1,881 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <asio.hpp>
+#include <spdlog/spdlog.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#include <tlhelp32.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "options.hpp"
+#include "protocol.hpp"
+#include "shaper.hpp"
+
+// End-to-end load and soak test for a tunnel. `target` runs behind the tunnel
+// exit and echoes or sinks what arrives; `drive` connects to the tunnel
+// entrance and pushes a mix of interactive echo streams and bulk transfers
+// through the single TCP connection the tunnel carries, verifying every byte
+// and reporting throughput, echo latency and the memory and thread count of a
+// watched process. `relay` stands in for the plugin, DVC and server where the
+// real ones cannot run, with injectable latency, bandwidth cap and channel
+// loss. It is a TCP delay line only: none of the tunnel's own relay code
+// (pipe and DVC I/O, PDU batching, striping, dedup, spill) runs in it, so it
+// tests the load generator and the network conditions, not the tunnel.
+//
+// Every frame carries a stream id and a per-stream sequence number, and its
+// payload is a pseudo-random pattern derived from both, so corruption, loss,
+// duplication and reordering are all detected by the receiver.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using namespace std::chrono_literals;
+
+enum class FrameType : uint8_t { hello = 1, echo, reply, bulk, error };
+
+struct FrameHeader {
+    FrameType type;
+    uint8_t reserved;
+    uint16_t stream;
+    uint32_t length;
+    uint64_t seq;
+    int64_t sentNs;
+};
+static_assert(sizeof(FrameHeader) == 24);
+
+inline constexpr char helloMagic[8] = "KQLOAD";
+inline constexpr uint32_t helloVersion = 1;
+inline constexpr uint16_t bulkStream = 0x8000;
+inline constexpr uint32_t maxFrame = 1024 * 1024;
+
+// Sent by `drive` when a session starts; sets up the target's side of the mix.
+struct Hello {
+    char magic[8];
+    uint32_t version;
+    uint32_t bulkChunk;
+    uint64_t bulkDownRate;   // bytes per second, 0 = unlimited
+    uint32_t bulkDown;       // 0 = no downstream bulk
+    uint32_t reserved;
+};
+static_assert(sizeof(Hello) == 32);
+
+int64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now().time_since_epoch()).count();
+}
+
+void fillPattern(uint16_t stream, uint64_t seq, char* data, size_t len)
+{
+    uint64_t x = (static_cast<uint64_t>(stream) << 48) ^ (seq * 0x9E3779B97F4A7C15ull) ^ 1;
+    for (size_t i = 0; i < len; i += 8) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        std::memcpy(data + i, &x, std::min<size_t>(8, len - i));
+    }
+}
+
+bool checkPattern(uint16_t stream, uint64_t seq, char const* data, size_t len,
+    std::vector<char>& scratch)
+{
+    scratch.resize(len);
+    fillPattern(stream, seq, scratch.data(), len);
+    return std::memcmp(scratch.data(), data, len) == 0;
+}
+
+// Tracks the next expected sequence number per stream.
+class SequenceCheck
+{
+public:
+    bool next(uint16_t stream, uint64_t seq)
+    {
+        auto& expected = expected_[stream];
+        if (seq != expected)
+            return false;
+        ++expected;
+        return true;
+    }
+
+private:
+    std::map<uint16_t, uint64_t> expected_;
+};
+
+// Blocking framed I/O on one socket; writes may come from several threads.
+class FrameSocket
+{
+public:
+    explicit FrameSocket(asio::ip::tcp::socket& socket) : socket_(socket) {}
+
+    bool write(FrameType type, uint16_t stream, uint64_t seq, int64_t sentNs,
+        char const* payload, size_t len)
+    {
+        FrameHeader header{type, 0, stream, static_cast<uint32_t>(len), seq, sentNs};
+        std::array<asio::const_buffer, 2> buffers{
+            asio::buffer(&header, sizeof(header)), asio::buffer(payload, len)};
+        std::lock_guard lock(writeMtx_);
+        asio::error_code ec;
+        asio::write(socket_, buffers, ec);
+        return !ec;
+    }
+
+    bool read(FrameHeader& header, std::vector<char>& payload)
+    {
+        asio::error_code ec;
+        asio::read(socket_, asio::buffer(&header, sizeof(header)), ec);
+        if (ec || header.length > maxFrame)
+            return false;
+        payload.resize(header.length);
+        asio::read(socket_, asio::buffer(payload), ec);
+        return !ec;
+    }
+
+    // Unblocks reads and writes in other threads.
+    void shutdown()
+    {
+        asio::error_code ec;
+        socket_.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+    }
+
+private:
+    asio::ip::tcp::socket& socket_;
+    std::mutex writeMtx_;
+};
+
+// Sleeps until `until` unless `stop` is set first.
+class Stopper
+{
+public:
+    bool sleepUntil(Clock::time_point until)
+    {
+        std::unique_lock lock(mtx_);
+        return !cv_.wait_until(lock, until, [this] { return stopped_; });
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard lock(mtx_);
+            stopped_ = true;
+        }
+        cv_.notify_all();
+    }
+
+    bool stopped()
+    {
+        std::lock_guard lock(mtx_);
+        return stopped_;
+    }
+
+private:
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stopped_ = false;
+};
+
+// Sends bulk frames on `stream` as fast as `rate` allows until stopped.
+void sendBulk(FrameSocket& frames, Stopper& stopper, uint16_t stream, uint32_t chunk,
+    uint64_t rate, std::atomic<uint64_t>& sent)
+{
+    std::vector<char> payload(chunk);
+    kq::TokenBucket<> bucket(rate, chunk * 4ull, Clock::now());
+    for (uint64_t seq = 0; !stopper.stopped(); ++seq) {
+        auto delay = bucket.reserve(chunk, Clock::now());
+        if (delay > Clock::duration::zero() && !stopper.sleepUntil(Clock::now() + delay))
+            break;
+        fillPattern(stream, seq, payload.data(), chunk);
+        if (!frames.write(FrameType::bulk, stream, seq, nowNs(), payload.data(), chunk))
+            break;
+        sent += chunk;
+    }
+}
+
+// --- Process statistics --------------------------------------------------
+
+struct ProcessStats {
+    uint64_t rssBytes = 0;
+    uint32_t threads = 0;
+};
+
+#ifdef _WIN32
+uint32_t currentPid() { return GetCurrentProcessId(); }
+
+bool readProcessStats(uint32_t pid, ProcessStats& stats)
+{
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+    if (!process)
+        return false;
+    PROCESS_MEMORY_COUNTERS counters{};
+    bool ok = K32GetProcessMemoryInfo(process, &counters, sizeof(counters));
+    CloseHandle(process);
+    if (!ok)
+        return false;
+    stats.rssBytes = counters.WorkingSetSize;
+
+    HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    if (snapshot == INVALID_HANDLE_VALUE)
+        return false;
+    THREADENTRY32 entry{};
+    entry.dwSize = sizeof(entry);
+    stats.threads = 0;
+    for (BOOL more = Thread32First(snapshot, &entry); more; more = Thread32Next(snapshot, &entry)) {
+        if (entry.th32OwnerProcessID == pid)
+            ++stats.threads;
+    }
+    CloseHandle(snapshot);
+    return true;
+}
+#else
+uint32_t currentPid() { return static_cast<uint32_t>(getpid()); }
+
+bool readProcessStats(uint32_t pid, ProcessStats& stats)
+{
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    if (!status)
+        return false;
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmRSS:", 0) == 0)
+            stats.rssBytes = std::stoull(line.substr(6)) * 1024;
+        else if (line.rfind("Threads:", 0) == 0)
+            stats.threads = static_cast<uint32_t>(std::stoul(line.substr(8)));
+    }
+    return true;
+}
+#endif
+
+// --- target ----------------------------------------------------------------
+
+// Serves one session: echoes interactive frames, verifies upstream bulk and
+// sends downstream bulk if the hello asks for it.
+void serveSession(asio::ip::tcp::socket& socket)
+{
+    FrameSocket frames(socket);
+    FrameHeader header{};
+    std::vector<char> payload;
+    if (!frames.read(header, payload) || header.type != FrameType::hello
+        || payload.size() != sizeof(Hello)) {
+        spdlog::error("Session did not start with a loadgen hello");
+        return;
+    }
+    Hello hello{};
+    std::memcpy(&hello, payload.data(), sizeof(hello));
+    if (std::memcmp(hello.magic, helloMagic, sizeof(hello.magic)) != 0
+        || hello.version != helloVersion || hello.bulkChunk == 0 || hello.bulkChunk > maxFrame) {
+        spdlog::error("Unsupported loadgen hello");
+        return;
+    }
+
+    Stopper stopper;
+    std::atomic<uint64_t> bulkSent{0};
+    std::thread bulk;
+    if (hello.bulkDown) {
+        bulk = std::thread(sendBulk, std::ref(frames), std::ref(stopper), bulkStream,
+            hello.bulkChunk, hello.bulkDownRate, std::ref(bulkSent));
+    }
+
+    auto fail = [&](std::string const& message) {
+        spdlog::error("{}", message);
+        frames.write(FrameType::error, 0, 0, nowNs(), message.data(), message.size());
+    };
+
+    SequenceCheck sequence;
+    std::vector<char> scratch;
+    uint64_t bulkReceived = 0;
+    while (frames.read(header, payload)) {
+        if (header.type != FrameType::echo && header.type != FrameType::bulk) {
+            fail(fmt::format("Unexpected frame type {}", static_cast<int>(header.type)));
+            break;
+        }
+        if (!sequence.next(header.stream, header.seq)) {
+            fail(fmt::format("Stream {} frame {} out of sequence", header.stream, header.seq));
+            break;
+        }
+        if (!checkPattern(header.stream, header.seq, payload.data(), payload.size(), scratch)) {
+            fail(fmt::format("Stream {} frame {} corrupted", header.stream, header.seq));
+            break;
+        }
+        if (header.type == FrameType::bulk) {
+            bulkReceived += payload.size();
+            continue;
+        }
+        if (!frames.write(FrameType::reply, header.stream, header.seq, header.sentNs,
+                payload.data(), payload.size()))
+            break;
+    }
+
+    stopper.stop();
+    frames.shutdown();
+    if (bulk.joinable())
+        bulk.join();
+    spdlog::info("Session ended: {} bulk bytes received, {} sent", bulkReceived,
+        bulkSent.load());
+}
+
+int runTarget(asio::io_context& io, uint16_t port)
+{
+    asio::ip::tcp::acceptor acceptor(io,
+        asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"), port));
+    spdlog::info("Target listening on port {}", port);
+    for (;;) {
+        asio::ip::tcp::socket socket(io);
+        acceptor.accept(socket);
+        spdlog::info("Session started");
+        serveSession(socket);
+    }
+}
+
+// --- drive -----------------------------------------------------------------
+
+struct DriveConfig {
+    uint32_t echoStreams = 4;
+    uint32_t echoSize = 64;
+    std::chrono::milliseconds echoInterval{100};
+    bool bulkUp = false;
+    bool bulkDown = false;
+    uint64_t bulkUpRate = 0;
+    uint64_t bulkDownRate = 0;
+    uint32_t bulkChunk = 16 * 1024;
+    std::chrono::seconds duration{60};
+    std::chrono::seconds report{10};
+    std::chrono::seconds stall{30};
+    uint32_t watchPid = 0;
+    uint64_t maxRss = 0;       // bytes, 0 = no limit
+    uint64_t maxGrowth = 0;    // bytes over the first report, 0 = no limit
+    bool allowDrops = false;
+};
+
+// Shared between the session threads and the reporter.
+struct DriveStats {
+    std::atomic<uint64_t> bytesUp{0};
+    std::atomic<uint64_t> bytesDown{0};
+    std::atomic<uint64_t> sessions{0};
+    std::atomic<int64_t> oldestUnansweredNs{0};   // 0 = none
+
+    std::mutex mtx;
+    std::vector<int64_t> latencies;    // since the last report
+    std::vector<int64_t> allLatencies;
+    std::string failure;
+
+    void fail(std::string message)
+    {
+        std::lock_guard lock(mtx);
+        if (failure.empty())
+            failure = std::move(message);
+    }
+
+    bool failed()
+    {
+        std::lock_guard lock(mtx);
+        return !failure.empty();
+    }
+};
+
+// Runs one session until it ends, `deadline` passes or a check fails.
+// Returns true if the session ended because of the deadline.
+bool driveSession(asio::ip::tcp::socket& socket, DriveConfig const& config, DriveStats& stats,
+    Clock::time_point deadline)
+{
+    FrameSocket frames(socket);
+    Stopper stopper;
+
+    Hello hello{};
+    std::memcpy(hello.magic, helloMagic, sizeof(hello.magic));
+    hello.version = helloVersion;
+    hello.bulkChunk = config.bulkChunk;
+    hello.bulkDown = config.bulkDown;
+    hello.bulkDownRate = config.bulkDownRate;
+    if (!frames.write(FrameType::hello, 0, 0, nowNs(),
+            reinterpret_cast<char const*>(&hello), sizeof(hello)))
+        return false;
+
+    // Send times of echoes still waiting for their reply, per stream.
+    std::mutex pendingMtx;
+    std::vector<std::deque<int64_t>> pending(config.echoStreams);
+
+    std::thread echo([&] {
+        std::vector<char> payload(config.echoSize);
+        std::vector<uint64_t> seqs(config.echoStreams, 0);
+        auto next = Clock::now();
+        while (stopper.sleepUntil(next)) {
+            for (uint32_t s = 0; s < config.echoStreams; ++s) {
+                fillPattern(static_cast<uint16_t>(s), seqs[s], payload.data(), payload.size());
+                int64_t sent = nowNs();
+                {
+                    std::lock_guard lock(pendingMtx);
+                    pending[s].push_back(sent);
+                }
+                if (!frames.write(FrameType::echo, static_cast<uint16_t>(s), seqs[s]++, sent,
+                        payload.data(), payload.size()))
+                    return;
+            }
+            next += config.echoInterval;
+        }
+    });
+
+    std::thread bulk;
+    if (config.bulkUp) {
+        bulk = std::thread(sendBulk, std::ref(frames), std::ref(stopper), bulkStream,
+            config.bulkChunk, config.bulkUpRate, std::ref(stats.bytesUp));
+    }
+
+    // Ends the session at the deadline, on a failed check, or when an echo
+    // has gone unanswered for too long.
+    bool deadlineReached = false;
+    std::thread watchdog([&] {
+        while (stopper.sleepUntil(std::min(deadline, Clock::now() + 100ms))) {
+            if (Clock::now() >= deadline) {
+                deadlineReached = true;
+                break;
+            }
+            if (stats.failed())
+                break;
+            int64_t oldest = 0;
+            {
+                std::lock_guard lock(pendingMtx);
+                for (auto const& p : pending) {
+                    if (!p.empty() && (oldest == 0 || p.front() < oldest))
+                        oldest = p.front();
+                }
+            }
+            stats.oldestUnansweredNs = oldest;
+            if (oldest && nowNs() - oldest > std::chrono::nanoseconds(config.stall).count()) {
+                stats.fail(fmt::format("No echo reply for {} s", config.stall.count()));
+                break;
+            }
+        }
+        frames.shutdown();
+    });
+
+    SequenceCheck sequence;
+    FrameHeader header{};
+    std::vector<char> payload;
+    std::vector<char> scratch;
+    while (frames.read(header, payload)) {
+        if (header.type == FrameType::error) {
+            stats.fail("Target reported: " + std::string(payload.begin(), payload.end()));
+            break;
+        }
+        if (header.type != FrameType::reply && header.type != FrameType::bulk) {
+            stats.fail(fmt::format("Unexpected frame type {}", static_cast<int>(header.type)));
+            break;
+        }
+        if (!sequence.next(header.stream, header.seq)) {
+            stats.fail(fmt::format("Stream {} frame {} out of sequence", header.stream,
+                header.seq));
+            break;
+        }
+        if (!checkPattern(header.stream, header.seq, payload.data(), payload.size(), scratch)) {
+            stats.fail(fmt::format("Stream {} frame {} corrupted", header.stream, header.seq));
+            break;
+        }
+        if (header.type == FrameType::bulk) {
+            stats.bytesDown += payload.size();
+            continue;
+        }
+
+        int64_t latency = nowNs() - header.sentNs;
+        {
+            std::lock_guard lock(pendingMtx);
+            if (header.stream < pending.size() && !pending[header.stream].empty())
+                pending[header.stream].pop_front();
+        }
+        std::lock_guard lock(stats.mtx);
+        stats.latencies.push_back(latency);
+    }
+
+    stopper.stop();
+    frames.shutdown();
+    echo.join();
+    if (bulk.joinable())
+        bulk.join();
+    watchdog.join();
+    stats.oldestUnansweredNs = 0;
+    return deadlineReached;
+}
+
+double percentileMs(std::vector<int64_t>& samples, double p)
+{
+    if (samples.empty())
+        return 0;
+    auto index = static_cast<size_t>(p * static_cast<double>(samples.size() - 1));
+    std::nth_element(samples.begin(), samples.begin() + static_cast<ptrdiff_t>(index),
+        samples.end());
+    return static_cast<double>(samples[index]) / 1e6;
+}
+
+// Logs one report line; false if the watched process broke a memory limit.
+bool report(DriveConfig const& config, DriveStats& stats, double seconds,
+    uint64_t& lastUp, uint64_t& lastDown, uint64_t& baselineRss)
+{
+    std::vector<int64_t> latencies;
+    {
+        std::lock_guard lock(stats.mtx);
+        latencies.swap(stats.latencies);
+        stats.allLatencies.insert(stats.allLatencies.end(), latencies.begin(), latencies.end());
+    }
+    uint64_t up = stats.bytesUp;
+    uint64_t down = stats.bytesDown;
+
+    ProcessStats process;
+    bool haveProcess = readProcessStats(config.watchPid, process);
+    spdlog::info("up {:.2f} MB/s, down {:.2f} MB/s, echo p50 {:.1f} ms p99 {:.1f} ms "
+        "max {:.1f} ms ({} replies), rss {} MiB, {} threads, {} sessions",
+        static_cast<double>(up - lastUp) / seconds / 1e6,
+        static_cast<double>(down - lastDown) / seconds / 1e6,
+        percentileMs(latencies, 0.5), percentileMs(latencies, 0.99),
+        percentileMs(latencies, 1.0), latencies.size(),
+        process.rssBytes >> 20, process.threads, stats.sessions.load());
+    lastUp = up;
+    lastDown = down;
+
+    if (!haveProcess) {
+        stats.fail(fmt::format("Cannot read statistics of process {}", config.watchPid));
+        return false;
+    }
+    if (config.maxRss && process.rssBytes > config.maxRss) {
+        stats.fail(fmt::format("Process {} uses {} MiB, limit {} MiB", config.watchPid,
+            process.rssBytes >> 20, config.maxRss >> 20));
+        return false;
+    }
+    if (baselineRss == 0) {
+        baselineRss = process.rssBytes;
+    } else if (config.maxGrowth && process.rssBytes > baselineRss + config.maxGrowth) {
+        stats.fail(fmt::format("Process {} grew from {} MiB to {} MiB", config.watchPid,
+            baselineRss >> 20, process.rssBytes >> 20));
+        return false;
+    }
+    return true;
+}
+
+int runDrive(asio::io_context& io, std::string const& host, std::string const& port,
+    DriveConfig const& config)
+{
+    DriveStats stats;
+    auto start = Clock::now();
+    auto deadline = config.duration.count() ? start + config.duration : Clock::time_point::max();
+
+    std::thread sessions([&] {
+        asio::ip::tcp::resolver resolver(io);
+        while (Clock::now() < deadline && !stats.failed()) {
+            asio::ip::tcp::socket socket(io);
+            try {
+                asio::connect(socket, resolver.resolve(host, port));
+            } catch (std::exception const& e) {
+                stats.fail(fmt::format("Connect to {}:{} failed: {}", host, port, e.what()));
+                break;
+            }
+            socket.set_option(asio::ip::tcp::no_delay(true));
+            ++stats.sessions;
+            if (driveSession(socket, config, stats, deadline) || stats.failed())
+                break;
+            if (!config.allowDrops) {
+                stats.fail("Session ended unexpectedly (channel lost?)");
+                break;
+            }
+            spdlog::warn("Session ended, reconnecting");
+            std::this_thread::sleep_for(1s);
+        }
+    });
+
+    uint64_t lastUp = 0;
+    uint64_t lastDown = 0;
+    uint64_t baselineRss = 0;
+    auto lastReport = start;
+    while (Clock::now() < deadline && !stats.failed()) {
+        auto next = std::min(deadline, lastReport + config.report);
+        while (Clock::now() < next && !stats.failed())
+            std::this_thread::sleep_for(100ms);
+        auto now = Clock::now();
+        double seconds = std::chrono::duration<double>(now - lastReport).count();
+        lastReport = now;
+        if (!report(config, stats, seconds, lastUp, lastDown, baselineRss))
+            break;
+    }
+    sessions.join();
+
+    double total = std::chrono::duration<double>(Clock::now() - start).count();
+    spdlog::info("Total: up {:.2f} MB/s, down {:.2f} MB/s, echo p50 {:.1f} ms "
+        "p99 {:.1f} ms max {:.1f} ms over {} replies, {} sessions",
+        static_cast<double>(stats.bytesUp) / total / 1e6,
+        static_cast<double>(stats.bytesDown) / total / 1e6,
+        percentileMs(stats.allLatencies, 0.5), percentileMs(stats.allLatencies, 0.99),
+        percentileMs(stats.allLatencies, 1.0), stats.allLatencies.size(),
+        stats.sessions.load());
+
+    if (stats.failed()) {
+        spdlog::error("FAILED: {}", stats.failure);
+        return 1;
+    }
+    spdlog::info("PASSED");
+    return 0;
+}
+
+// --- relay -----------------------------------------------------------------
+
+struct RelayConfig {
+    std::chrono::milliseconds latency{0};
+    uint64_t rate = 0;                 // bytes per second per direction, 0 = unlimited
+    std::chrono::seconds dropAfter{0}; // mean time to channel loss, 0 = never
+};
+
+// One direction of the stand-in channel: chunks become writable `latency`
+// after they were read, paced by a token bucket. At most kq::maxGatherBytes
+// are in flight, so a slow reader backs up into the sender's TCP window as
+// with the real tunnel. End of input is passed on as a half-close once all
+// queued chunks are out; stop() drops what is queued.
+class DelayLine
+{
+public:
+    DelayLine(asio::ip::tcp::socket& from, asio::ip::tcp::socket& to, RelayConfig const& config)
+        : from_(from), to_(to), config_(config)
+    {
+    }
+
+    // False if the line was stopped rather than running out of input.
+    bool run()
+    {
+        std::thread writer([this] { drain(); });
+        std::vector<char> buf(kq::bufferSize);
+        asio::error_code ec;
+        for (;;) {
+            auto n = from_.read_some(asio::buffer(buf), ec);
+            if (ec)
+                break;
+            std::unique_lock lock(mtx_);
+            cv_.wait(lock, [&] { return stopped_ || bytes_ < kq::maxGatherBytes; });
+            if (stopped_)
+                break;
+            queue_.push_back({Clock::now() + config_.latency,
+                std::vector<char>(buf.begin(), buf.begin() + static_cast<ptrdiff_t>(n))});
+            bytes_ += n;
+            cv_.notify_all();
+        }
+        if (ec == asio::error::eof)
+            finish();
+        else
+            stop();
+        writer.join();
+        std::lock_guard lock(mtx_);
+        return !stopped_;
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard lock(mtx_);
+            stopped_ = true;
+        }
+        cv_.notify_all();
+        asio::error_code ec;
+        from_.shutdown(asio::ip::tcp::socket::shutdown_receive, ec);
+        to_.shutdown(asio::ip::tcp::socket::shutdown_send, ec);
+    }
+
+private:
+    struct Chunk {
+        Clock::time_point due;
+        std::vector<char> data;
+    };
+
+    void finish()
+    {
+        {
+            std::lock_guard lock(mtx_);
+            finished_ = true;
+        }
+        cv_.notify_all();
+    }
+
+    void drain()
+    {
+        kq::TokenBucket<> bucket(config_.rate, 64 * 1024, Clock::now());
+        for (;;) {
+            Chunk chunk;
+            {
+                std::unique_lock lock(mtx_);
+                cv_.wait(lock, [&] { return stopped_ || finished_ || !queue_.empty(); });
+                if (stopped_)
+                    return;
+                if (queue_.empty()) {
+                    asio::error_code ec;
+                    to_.shutdown(asio::ip::tcp::socket::shutdown_send, ec);
+                    return;
+                }
+                chunk = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            // Pacing starts when the chunk may leave: once its latency has
+            // passed, or now if it is already overdue.
+            auto start = std::max(chunk.due, Clock::now());
+            std::this_thread::sleep_until(start + bucket.reserve(chunk.data.size(), start));
+            asio::error_code ec;
+            asio::write(to_, asio::buffer(chunk.data), ec);
+            {
+                std::lock_guard lock(mtx_);
+                bytes_ -= chunk.data.size();
+            }
+            cv_.notify_all();
+            if (ec) {
+                stop();
+                return;
+            }
+        }
+    }
+
+    asio::ip::tcp::socket& from_;
+    asio::ip::tcp::socket& to_;
+    RelayConfig const& config_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<Chunk> queue_;
+    size_t bytes_ = 0;
+    bool finished_ = false;   // input ended; drain the queue, then half-close
+    bool stopped_ = false;
+};
+
+int runRelay(asio::io_context& io, uint16_t listenPort, std::string const& host,
+    std::string const& port, RelayConfig const& config)
+{
+    asio::ip::tcp::acceptor acceptor(io,
+        asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"), listenPort));
+    asio::ip::tcp::resolver resolver(io);
+    std::mt19937_64 random(std::random_device{}());
+    spdlog::info("Relay listening on port {}, forwarding to {}:{}", listenPort, host, port);
+
+    for (;;) {
+        asio::ip::tcp::socket entrance(io);
+        acceptor.accept(entrance);
+        asio::ip::tcp::socket exit(io);
+        try {
+            asio::connect(exit, resolver.resolve(host, port));
+        } catch (std::exception const& e) {
+            spdlog::error("Connect to {}:{} failed: {}", host, port, e.what());
+            continue;
+        }
+        entrance.set_option(asio::ip::tcp::no_delay(true));
+        exit.set_option(asio::ip::tcp::no_delay(true));
+        spdlog::info("Relay session started");
+
+        DelayLine up(entrance, exit, config);
+        DelayLine down(exit, entrance, config);
+        // A half-close leaves the other direction running; an error ends both.
+        std::thread t1([&] {
+            if (!up.run())
+                down.stop();
+        });
+        std::thread t2([&] {
+            if (!down.run())
+                up.stop();
+        });
+
+        // Channel loss: the whole session goes away at once, somewhere
+        // between half and one and a half times the configured interval.
+        Stopper ended;
+        std::thread dropper;
+        if (config.dropAfter.count()) {
+            std::uniform_real_distribution<double> jitter(0.5, 1.5);
+            auto after = std::chrono::duration_cast<Clock::duration>(
+                config.dropAfter * jitter(random));
+            dropper = std::thread([&, after] {
+                if (ended.sleepUntil(Clock::now() + after)) {
+                    spdlog::warn("Dropping the channel");
+                    up.stop();
+                    down.stop();
+                }
+            });
+        }
+
+        t1.join();
+        t2.join();
+        ended.stop();
+        if (dropper.joinable())
+            dropper.join();
+        spdlog::info("Relay session ended");
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    kq::Options opts(argc, argv);
+    auto const& args = opts.positional();
+    std::string_view cmd = args.empty() ? "" : args[0];
+    auto arg = [&](size_t i, std::string fallback) {
+        return i < args.size() ? args[i] : fallback;
+    };
+
+    asio::io_context io;
+    try {
+        if (cmd == "target")
+            return runTarget(io, static_cast<uint16_t>(std::stoi(arg(1, "22"))));
+
+        if (cmd == "drive") {
+            DriveConfig config;
+            // Stream numbers from bulkStream on belong to the bulk streams.
+            config.echoStreams = std::min<uint32_t>(
+                opts.get<uint32_t>("echo-streams", config.echoStreams), bulkStream - 1);
+            config.echoSize = opts.get<uint32_t>("echo-size", config.echoSize);
+            config.echoInterval = std::chrono::milliseconds(
+                opts.get<uint32_t>("echo-interval", 100));
+            config.bulkUp = opts.has("bulk-up");
+            config.bulkUpRate = opts.get<uint64_t>("bulk-up", 0);
+            config.bulkDown = opts.has("bulk-down");
+            config.bulkDownRate = opts.get<uint64_t>("bulk-down", 0);
+            config.bulkChunk = std::clamp<uint32_t>(
+                opts.get<uint32_t>("bulk-chunk", config.bulkChunk), 1, maxFrame);
+            config.duration = std::chrono::seconds(opts.get<uint32_t>("duration", 60));
+            config.report = std::chrono::seconds(
+                std::max<uint32_t>(opts.get<uint32_t>("report", 10), 1));
+            config.stall = std::chrono::seconds(opts.get<uint32_t>("stall", 30));
+            config.watchPid = opts.get<uint32_t>("watch", currentPid());
+            config.maxRss = opts.get<uint64_t>("max-rss", 0) << 20;
+            config.maxGrowth = opts.get<uint64_t>("max-growth", 0) << 20;
+            config.allowDrops = opts.has("allow-drops");
+            config.echoSize = std::min(config.echoSize, maxFrame);
+            return runDrive(io, arg(1, kq::defaultTargetHost),
+                arg(2, std::to_string(kq::defaultLocalPort)), config);
+        }
+
+        if (cmd == "relay" && args.size() >= 4) {
+            RelayConfig config;
+            config.latency = std::chrono::milliseconds(opts.get<uint32_t>("latency", 0));
+            config.rate = opts.get<uint64_t>("rate", 0);
+            config.dropAfter = std::chrono::seconds(opts.get<uint32_t>("drop-after", 0));
+            return runRelay(io, static_cast<uint16_t>(std::stoi(args[1])), args[2], args[3],
+                config);
+        }
+    } catch (std::exception const& e) {
+        spdlog::error("{}", e.what());
+        return 1;
+    }
+
+    spdlog::error("usage: kq-tunnel-loadgen target [port]\n"
+        "       kq-tunnel-loadgen drive [host] [port] [--echo-streams=N] [--echo-size=B]\n"
+        "           [--echo-interval=MS] [--bulk-up[=B/s]] [--bulk-down[=B/s]]\n"
+        "           [--bulk-chunk=B] [--duration=S] [--report=S] [--stall=S]\n"
+        "           [--watch=PID] [--max-rss=MB] [--max-growth=MB] [--allow-drops]\n"
+        "       kq-tunnel-loadgen relay <port> <host> <port> [--latency=MS] [--rate=B/s]\n"
+        "           [--drop-after=S]");
+    return 2;
+}
@@ -2,11 +2,24 @@
 #include <initguid.h>
 #include <tsvirtualchannels.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <vector>
 
+#include "doorbell.hpp"
+#include "dvc_chunking.hpp"
 #include "protocol.hpp"
+#include "shaper.hpp"
+#include "shm_ring.hpp"
+#include "spill_queue.hpp"
+#include "stripe.hpp"
+#include "trace.hpp"
 
 // {8B6D78AA-856B-4D4F-A2A2-0C0CCC4B4E18}
 // clang-format off
@@ -17,15 +30,58 @@ DEFINE_GUID(CLSID_KqTunnelPlugin,
 
 namespace {
 
+namespace trace = kq::trace;
+
+using Clock = std::chrono::steady_clock;
+
 LONG g_dllRefCount = 0;
+LONG g_sessionCount = 0;
+LONG g_tunnelCount = 0;
 
 constexpr size_t maxQueueBytes = 32 * 1024 * 1024;
 
-bool issueRead(HANDLE pipe, std::vector<BYTE>& buf, OVERLAPPED& ov)
+// Optional tuning values live next to the AddIn registration that
+// install.bat creates; anything missing keeps its default.
+constexpr char const* settingsKey =
+    R"(Software\Microsoft\Terminal Server Client\Default\AddIns\KqTunnel)";
+
+DWORD readSetting(char const* name, DWORD fallback)
+{
+    DWORD value = 0;
+    DWORD size = sizeof(value);
+    if (RegGetValueA(HKEY_CURRENT_USER, settingsKey, name, RRF_RT_REG_DWORD,
+            nullptr, &value, &size) != ERROR_SUCCESS)
+        return fallback;
+    return value;
+}
+
+std::string readSetting(char const* name)
+{
+    char value[MAX_PATH] = {};
+    DWORD size = sizeof(value);
+    if (RegGetValueA(HKEY_CURRENT_USER, settingsKey, name, RRF_RT_REG_SZ,
+            nullptr, value, &size) != ERROR_SUCCESS)
+        return {};
+    return value;
+}
+
+// Fixed rate only: IWTSVirtualChannel::Write returns once the data is
+// queued, not sent, so its duration says nothing about congestion and the
+// adaptive mode has no signal on this side.
+kq::ShaperConfig readShaperConfig()
+{
+    kq::ShaperConfig config;
+    config.rate = readSetting("RateLimit", 0);
+    config.burst = readSetting("RateBurst", static_cast<DWORD>(config.burst));
+    return config;
+}
+
+// Reads into the free tail of `buf`, after the `offset` bytes still held back.
+bool issueRead(HANDLE pipe, std::vector<BYTE>& buf, size_t offset, OVERLAPPED& ov)
 {
     ResetEvent(ov.hEvent);
     DWORD bytesRead = 0;
-    BOOL ok = ReadFile(pipe, buf.data(), static_cast<DWORD>(buf.size()),
+    BOOL ok = ReadFile(pipe, buf.data() + offset, static_cast<DWORD>(buf.size() - offset),
                        &bytesRead, &ov);
     if (ok)
         return true;
@@ -43,91 +99,369 @@ bool issueWrite(HANDLE pipe, std::vector<BYTE> const& buf, OVERLAPPED& ov)
     return GetLastError() == ERROR_IO_PENDING;
 }
 
-class KqTunnelChannelCallback : public IWTSVirtualChannelCallback
+// Reads or writes all of `len` bytes on the overlapped pipe, giving up when
+// `cancelEvent` is set or nothing moves for `timeoutMs`.
+bool transferAll(HANDLE pipe, OVERLAPPED& ov, HANDLE cancelEvent, bool write,
+    void* data, DWORD len, DWORD timeoutMs)
+{
+    auto* p = static_cast<BYTE*>(data);
+    DWORD done = 0;
+    while (done < len) {
+        ResetEvent(ov.hEvent);
+        BOOL ok = write ? WriteFile(pipe, p + done, len - done, nullptr, &ov)
+                        : ReadFile(pipe, p + done, len - done, nullptr, &ov);
+        if (!ok && GetLastError() != ERROR_IO_PENDING)
+            return false;
+
+        HANDLE handles[] = {ov.hEvent, cancelEvent};
+        DWORD n = 0;
+        if (WaitForMultipleObjects(2, handles, FALSE, timeoutMs) != WAIT_OBJECT_0) {
+            CancelIoEx(pipe, &ov);
+            GetOverlappedResult(pipe, &ov, &n, TRUE);
+            return false;
+        }
+        if (!GetOverlappedResult(pipe, &ov, &n, FALSE) || n == 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// The client end of a tunnel: the pipe itself, or the shared-memory rings
+// the client offered in its PipeWelcome. Either way the I/O thread starts
+// an operation, waits for its event and then finishes it, as with
+// overlapped pipe I/O. In shared-memory mode a one-byte read stays pending
+// on the pipe and completes when the client goes away.
+class ClientLink
+{
+public:
+    explicit ClientLink(HANDLE pipe) : pipe_(pipe)
+    {
+        readOv_.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        writeOv_.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        watchOv_.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+    }
+
+    ~ClientLink()
+    {
+        cancel();
+        CloseHandle(readOv_.hEvent);
+        CloseHandle(writeOv_.hEvent);
+        CloseHandle(watchOv_.hEvent);
+    }
+
+    bool useSharedMemory(char const* name)
+    {
+        if (!shm_.open(name))
+            return false;
+        shared_ = true;
+        ResetEvent(watchOv_.hEvent);
+        watchPending_ = ReadFile(pipe_, &watchByte_, 1, nullptr, &watchOv_)
+            || GetLastError() == ERROR_IO_PENDING;
+        return watchPending_;
+    }
+
+    bool shared() const { return shared_; }
+
+    // Cancels pending pipe I/O and waits for it to finish; the pipe must
+    // still be open.
+    void cancel()
+    {
+        cancel(readOv_, readPending_);
+        cancel(writeOv_, writePending_);
+        cancel(watchOv_, watchPending_);
+    }
+
+    // Signalled when the client has gone away (shared memory only).
+    HANDLE closedEvent() const { return watchOv_.hEvent; }
+
+    // Reads into `buf` after the first `offset` bytes.
+    bool startRead(std::vector<BYTE>& buf, size_t offset)
+    {
+        if (!shared_)
+            return readPending_ = issueRead(pipe_, buf, offset, readOv_);
+        readBuf_ = &buf;
+        readOffset_ = offset;
+        if (!shm_.rx().parkReader())
+            SetEvent(shm_.rxReady());
+        return true;
+    }
+
+    HANDLE readEvent() const { return shared_ ? shm_.rxReady() : readOv_.hEvent; }
+
+    // Completes the read readEvent() signalled; `n` may be 0.
+    bool finishRead(DWORD& n)
+    {
+        if (!shared_) {
+            readPending_ = false;
+            return GetOverlappedResult(pipe_, &readOv_, &n, FALSE);
+        }
+        n = static_cast<DWORD>(shm_.rx().read(
+            reinterpret_cast<char*>(readBuf_->data() + readOffset_),
+            readBuf_->size() - readOffset_));
+        shm_.notifyRead();
+        return true;
+    }
+
+    // Reads what the client wrote to the rx ring before it went away
+    // (shared memory only); 0 once the ring is empty.
+    DWORD readLeft(std::vector<BYTE>& buf, size_t offset)
+    {
+        auto n = static_cast<DWORD>(shm_.rx().read(
+            reinterpret_cast<char*>(buf.data() + offset), buf.size() - offset));
+        if (n > 0)
+            shm_.notifyRead();
+        return n;
+    }
+
+    // Whether more client data is already waiting to be read.
+    bool morePending()
+    {
+        if (shared_)
+            return shm_.rx().readable() > 0;
+        DWORD available = 0;
+        return PeekNamedPipe(pipe_, nullptr, 0, nullptr, &available, nullptr)
+            && available > 0;
+    }
+
+    // `buf` must stay untouched until finishWrite() reports it done.
+    bool startWrite(std::vector<BYTE> const& buf)
+    {
+        if (!shared_)
+            return writePending_ = issueWrite(pipe_, buf, writeOv_);
+        writeData_ = reinterpret_cast<char const*>(buf.data());
+        writeLeft_ = buf.size();
+        if (pumpWrite())
+            SetEvent(shm_.txReady());
+        return true;
+    }
+
+    HANDLE writeEvent() const { return shared_ ? shm_.txReady() : writeOv_.hEvent; }
+
+    // Continues the write writeEvent() signalled; `done` once all of it
+    // has been written.
+    bool finishWrite(DWORD& n, bool& done)
+    {
+        if (!shared_) {
+            writePending_ = false;
+            done = true;
+            return GetOverlappedResult(pipe_, &writeOv_, &n, FALSE);
+        }
+        size_t before = writeLeft_;
+        done = pumpWrite();
+        n = static_cast<DWORD>(before - writeLeft_);
+        return true;
+    }
+
+private:
+    // Copies as much as fits into the ring; parks when it is full. True
+    // once everything is written.
+    bool pumpWrite()
+    {
+        while (writeLeft_ > 0) {
+            size_t n = shm_.tx().write(writeData_, writeLeft_);
+            if (n > 0)
+                shm_.notifyWritten();
+            writeData_ += n;
+            writeLeft_ -= n;
+            if (n == 0 && shm_.tx().parkWriter())
+                return false;
+        }
+        return true;
+    }
+
+    void cancel(OVERLAPPED& ov, bool& pending)
+    {
+        if (!pending)
+            return;
+        CancelIoEx(pipe_, &ov);
+        DWORD dummy;
+        GetOverlappedResult(pipe_, &ov, &dummy, TRUE);
+        pending = false;
+    }
+
+    HANDLE pipe_;
+    OVERLAPPED readOv_{};
+    OVERLAPPED writeOv_{};
+    OVERLAPPED watchOv_{};
+    bool readPending_ = false;
+    bool writePending_ = false;
+    bool watchPending_ = false;
+    BYTE watchByte_ = 0;
+
+    bool shared_ = false;
+    kq::shm::Transport shm_;
+    std::vector<BYTE>* readBuf_ = nullptr;
+    size_t readOffset_ = 0;
+    char const* writeData_ = nullptr;
+    size_t writeLeft_ = 0;
+};
+
+// The pipe side of one tunnel and the DVC channel(s) feeding it. A plain
+// tunnel has the single unframed KQTUNNEL channel; a striped one has up to
+// maxStripes KQTUNNEL<i> channels carrying sequence-numbered frames, which
+// are put back in order before reaching the pipe (see stripe.hpp).
+class Tunnel
 {
 public:
-    explicit KqTunnelChannelCallback(IWTSVirtualChannel* channel)
-        : refCount_(1), channel_(channel)
+    Tunnel(bool striped, uint32_t session)
+        : striped_(striped), session_(session),
+          queue_(readSetting("SpillDir").empty() ? maxQueueBytes
+                                    : readSetting("SpillThresholdMB", 4) * uint64_t{1 << 20}),
+          reorder_(maxQueueBytes),
+          spin_(std::chrono::microseconds(readSetting("SpinLimitUs", 50)))
     {
         InterlockedIncrement(&g_dllRefCount);
-        channel_->AddRef();
         shutdownEvent_ = CreateEventA(nullptr, TRUE, FALSE, nullptr);
-        queueEvent_ = CreateEventA(nullptr, TRUE, FALSE, nullptr);
 
-        // Start background thread that connects to the pipe and handles all
-        // pipe I/O. This is the sole owner of the pipe handle.
-        channel_->AddRef();
-        ioThread_ = std::thread(&KqTunnelChannelCallback::ioThreadFunc, this);
+        // With SpillDir set, what the pipe cannot take yet goes to a spill
+        // file past SpillThresholdMB instead of overflowing the channel. The
+        // file is only created once a tunnel actually spills.
+        std::string dir = readSetting("SpillDir");
+        if (!dir.empty()) {
+            auto path = dir + "\\kq-spill-" + std::to_string(GetCurrentProcessId()) + "-"
+                + std::to_string(InterlockedIncrement(&g_tunnelCount)) + ".tmp";
+            auto capacity = readSetting("SpillSizeMB", kq::defaultSpillCapacity >> 20);
+            queue_.enableSpill(path, capacity * uint64_t{1 << 20});
+        }
     }
 
-    ~KqTunnelChannelCallback()
+    ~Tunnel()
     {
-        shutdown();
-        if (channel_)
-            channel_->Release();
-        CloseHandle(queueEvent_);
+        close();
+        for (auto* channel : channels_) {
+            if (channel)
+                channel->Release();
+        }
         CloseHandle(shutdownEvent_);
         InterlockedDecrement(&g_dllRefCount);
     }
 
-    // IUnknown
-    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppv) override
+    bool striped() const { return striped_; }
+
+    // Registers channel `index` (always 0 for a plain tunnel). The first one
+    // starts the background thread that connects to the pipe and handles
+    // all pipe I/O; that thread is the sole owner of the pipe handle.
+    void attach(size_t index, IWTSVirtualChannel* channel)
     {
-        if (!ppv) return E_INVALIDARG;
-        if (riid == IID_IUnknown || riid == __uuidof(IWTSVirtualChannelCallback)) {
-            *ppv = static_cast<IWTSVirtualChannelCallback*>(this);
-            AddRef();
-            return S_OK;
+        channel->AddRef();
+        {
+            std::lock_guard lock(channelsMtx_);
+            if (channels_[index])
+                channels_[index]->Release();
+            channels_[index] = channel;
+        }
+        std::lock_guard lock(threadMtx_);
+        if (!started_) {
+            started_ = true;
+            ioThread_ = std::thread(&Tunnel::ioThreadFunc, this);
         }
-        *ppv = nullptr;
-        return E_NOINTERFACE;
     }
 
-    ULONG STDMETHODCALLTYPE AddRef() override { return InterlockedIncrement(&refCount_); }
-    ULONG STDMETHODCALLTYPE Release() override
+    void detach(size_t index)
     {
-        auto count = InterlockedDecrement(&refCount_);
-        if (count == 0) delete this;
-        return count;
+        std::lock_guard lock(channelsMtx_);
+        if (channels_[index]) {
+            channels_[index]->Release();
+            channels_[index] = nullptr;
+        }
     }
 
-    // IWTSVirtualChannelCallback
-    HRESULT STDMETHODCALLTYPE OnDataReceived(ULONG size, BYTE* data) override
+    // Stops the I/O thread. Any channel closing ends the whole tunnel: a
+    // striped stream cannot continue with a stripe missing.
+    void close()
+    {
+        SetEvent(shutdownEvent_);
+        std::lock_guard lock(threadMtx_);
+        if (ioThread_.joinable())
+            ioThread_.join();
+    }
+
+    void onDataReceived(ULONG size, BYTE* data)
     {
         try {
             std::lock_guard lock(bufMtx_);
-            if (queue_.size() + size > maxQueueBytes) {
-                SetEvent(shutdownEvent_);
-                return S_OK;
+            if (!striped_) {
+                if (!queue_.push(data, size))
+                    return overflow(size);
+            } else {
+                // The server writes exactly one frame per DVC message and
+                // OnDataReceived delivers whole messages.
+                kq::StripeFrameHeader header;
+                if (size < sizeof(header))
+                    return overflow(size);
+                std::memcpy(&header, data, sizeof(header));
+                if (header.length != size - sizeof(header))
+                    return overflow(size);
+                ordered_.clear();
+                if (!reorder_.push(header.seq,
+                        reinterpret_cast<char const*>(data) + sizeof(header),
+                        header.length, ordered_)
+                    || !queue_.push(ordered_.data(), ordered_.size())
+                    || queue_.inMemory() + reorder_.buffered() > maxQueueBytes)
+                    return overflow(size);
             }
-            queue_.insert(queue_.end(), data, data + size);
+            trace::record(trace::Event::read, trace::Direction::dvcToPipe,
+                size, queue_.size(), data, size);
+            if (!queue_.empty())
+                queued_.store(true, std::memory_order_relaxed);
+            spin_.onArrival(Clock::now());
         } catch (...) {
             SetEvent(shutdownEvent_);
-            return S_OK;
+            return;
         }
-        SetEvent(queueEvent_);
-        return S_OK;
+        // Only costs a SetEvent when the IO thread is parked on the queue;
+        // while it is busy writing or spinning, it finds queued_ by itself.
+        doorbell_.ring();
     }
 
-    HRESULT STDMETHODCALLTYPE OnClose() override
+private:
+    // Called under bufMtx_ on the RDP callback thread, so the trace dump is
+    // left to the IO thread on its way out.
+    void overflow(ULONG size)
     {
-        shutdown();
-        if (channel_) {
-            channel_->Release();
-            channel_ = nullptr;
-        }
-        return S_OK;
+        trace::record(trace::Event::error, trace::Direction::dvcToPipe,
+            size, queue_.size());
+        overflowed_.store(true, std::memory_order_relaxed);
+        SetEvent(shutdownEvent_);
     }
 
-private:
-    void shutdown()
+    // Sends `n` payload bytes to the server. In striped mode `frame` starts
+    // with stripeFrameHeaderSize bytes of headroom for the header, and
+    // frames go round-robin over whichever stripes are open.
+    bool writeChannel(BYTE* frame, size_t n)
     {
-        SetEvent(shutdownEvent_);
-        if (ioThread_.joinable())
-            ioThread_.join();
+        std::lock_guard lock(channelsMtx_);
+        if (!striped_) {
+            auto* channel = channels_[0];
+            return channel && SUCCEEDED(channel->Write(static_cast<ULONG>(n), frame, nullptr));
+        }
+
+        IWTSVirtualChannel* open[kq::maxStripes];
+        size_t count = 0;
+        for (auto* channel : channels_) {
+            if (channel)
+                open[count++] = channel;
+        }
+        if (count == 0)
+            return false;
+
+        kq::StripeFrameHeader header{sendSeq_, static_cast<uint32_t>(n)};
+        std::memcpy(frame, &header, sizeof(header));
+        auto* channel = open[sendSeq_ % count];
+        ++sendSeq_;
+        return SUCCEEDED(channel->Write(
+            static_cast<ULONG>(sizeof(header) + n), frame, nullptr));
     }
 
     void ioThreadFunc()
+    {
+        relay();
+        if (overflowed_.load(std::memory_order_relaxed))
+            trace::Recorder::instance().dump();
+    }
+
+    void relay()
     {
         // Phase 1: Connect to the named pipe.
         // Pipe handle is local — only this thread ever touches it.
@@ -146,40 +480,75 @@ private:
                 break;
 
             DWORD err = GetLastError();
-            if (err != ERROR_FILE_NOT_FOUND && err != ERROR_PIPE_BUSY) {
-                channel_->Release();
+            if (err != ERROR_FILE_NOT_FOUND && err != ERROR_PIPE_BUSY)
                 return;
-            }
 
-            if (WaitForSingleObject(shutdownEvent_, 500) == WAIT_OBJECT_0) {
-                channel_->Release();
+            if (WaitForSingleObject(shutdownEvent_, 500) == WAIT_OBJECT_0)
                 return;
-            }
         }
 
         DWORD mode = PIPE_READMODE_BYTE;
         SetNamedPipeHandleState(pipe, &mode, nullptr, nullptr);
 
-        // Phase 2: Set up overlapped I/O and kick off first read.
-        // Any data queued by OnDataReceived during connection will be picked
-        // up by the main loop via the already-signaled queueEvent_.
-        OVERLAPPED readOv{};
-        readOv.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
-        OVERLAPPED writeOv{};
-        writeOv.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        // Phase 2: Agree on the transport and kick off the first read.
+        // Any data queued by OnDataReceived meanwhile will be picked up by
+        // the main loop, which checks queued_ before it waits.
+        ClientLink link(pipe);
+        if (!negotiate(pipe, link)) {
+            CloseHandle(pipe);
+            return;
+        }
 
-        std::vector<BYTE> readBuf(kq::bufferSize);
+        // Client data is read after `headroom` bytes reserved for the stripe
+        // frame header; `buffered` bytes of it are not yet sent.
+        size_t headroom = striped_ ? kq::stripeFrameHeaderSize : 0;
+        std::vector<BYTE> readBuf(headroom + kq::bufferSize);
+        size_t buffered = 0;
         std::vector<BYTE> writeBuf;
-        bool readPending = issueRead(pipe, readBuf, readOv);
+        bool readPending = link.startRead(readBuf, headroom + buffered);
         bool writePending = false;
 
+        // Channel writes are sized to fill whole DVC PDUs while more client
+        // data is waiting; the partial tail stays at the front of readBuf.
+        kq::DvcChunking chunking(readSetting("DvcChunkSize", kq::defaultDvcChunkSize));
+
+        // Client data held back by the shaper is sent once releaseAt passes;
+        // no further read is issued meanwhile, so the client's writes back
+        // up instead of the DVC.
+        kq::Shaper<> shaper(readShaperConfig(), Clock::now());
+        DWORD heldBytes = 0;
+        Clock::time_point releaseAt{};
+
+        auto sendToChannel = [&](DWORD n) {
+            bool ok = writeChannel(readBuf.data(), n);
+            trace::record(trace::Event::write, trace::Direction::pipeToDvc, n);
+            buffered -= n;
+            std::memmove(readBuf.data() + headroom, readBuf.data() + headroom + n, buffered);
+            return ok;
+        };
+
         // Phase 3: Multiplexed I/O loop.
         // Wait on a compact array built each iteration from the active events.
-        enum WaitId { SHUTDOWN, PIPE_READ, QUEUE_READY, PIPE_WRITE };
+        // Queued channel data is taken without waiting when it is already
+        // there or turns up within the adaptive spin; only then is the
+        // doorbell armed and waited on.
+        enum WaitId { SHUTDOWN, PIPE_READ, QUEUE_READY, PIPE_WRITE, CLIENT_CLOSED };
+
+        auto hasQueued = [this] { return queued_.load(std::memory_order_relaxed); };
 
-        while (readPending || writePending) {
-            HANDLE handles[4];
-            WaitId ids[4];
+        while (readPending || writePending || heldBytes) {
+            if (!writePending && (hasQueued() || spin_.spin(hasQueued))) {
+                takeQueued(writeBuf);
+                if (!writeBuf.empty()) {
+                    writePending = link.startWrite(writeBuf);
+                    if (!writePending)
+                        break;
+                }
+                continue;
+            }
+
+            HANDLE handles[5];
+            WaitId ids[5];
             DWORD count = 0;
 
             auto addWait = [&](WaitId id, HANDLE h) {
@@ -189,17 +558,46 @@ private:
             };
 
             addWait(SHUTDOWN, shutdownEvent_);
-            if (writePending)
-                addWait(PIPE_WRITE, writeOv.hEvent);
-            else
-                addWait(QUEUE_READY, queueEvent_);
+            if (link.shared())
+                addWait(CLIENT_CLOSED, link.closedEvent());
+            if (writePending) {
+                addWait(PIPE_WRITE, link.writeEvent());
+            } else {
+                doorbell_.arm();
+                if (hasQueued()) {
+                    doorbell_.disarm();
+                    continue;
+                }
+                addWait(QUEUE_READY, doorbell_.event());
+            }
             if (readPending)
-                addWait(PIPE_READ, readOv.hEvent);
+                addWait(PIPE_READ, link.readEvent());
 
-            DWORD result = WaitForMultipleObjects(count, handles, FALSE, INFINITE);
+            DWORD timeout = INFINITE;
+            if (heldBytes) {
+                auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+                    releaseAt - Clock::now()).count();
+                timeout = static_cast<DWORD>(std::max<int64_t>(remaining, 0));
+            }
+
+            int64_t waitStart = trace::nowNs();
+            DWORD result = WaitForMultipleObjects(count, handles, FALSE, timeout);
+            doorbell_.disarm();
+            trace::record(trace::Event::wait, trace::Direction::none,
+                0, trace::nowNs() - waitStart);
             if (result == WAIT_FAILED)
                 break;
 
+            if (result == WAIT_TIMEOUT) {
+                if (!sendToChannel(heldBytes))
+                    break;
+                heldBytes = 0;
+                readPending = link.startRead(readBuf, headroom + buffered);
+                if (!readPending)
+                    break;
+                continue;
+            }
+
             DWORD index = result - WAIT_OBJECT_0;
             if (index >= count)
                 break;
@@ -209,70 +607,224 @@ private:
             if (signaled == SHUTDOWN)
                 break;
 
+            // The client's last writes may still be in the rx ring when it
+            // closes the pipe; they go to the channel, unshaped and along
+            // with anything held back, before the tunnel closes.
+            if (signaled == CLIENT_CLOSED) {
+                for (;;) {
+                    DWORD n = link.readLeft(readBuf, headroom + buffered);
+                    if (n > 0) {
+                        trace::record(trace::Event::read, trace::Direction::pipeToDvc, n, 0,
+                            readBuf.data() + headroom + buffered, n);
+                        buffered += n;
+                    }
+                    if (buffered == 0 || !sendToChannel(static_cast<DWORD>(buffered)))
+                        break;
+                }
+                break;
+            }
+
             if (signaled == PIPE_READ) {
                 DWORD bytesRead = 0;
-                if (!GetOverlappedResult(pipe, &readOv, &bytesRead, FALSE))
-                    break;
-                if (bytesRead > 0)
-                    channel_->Write(bytesRead, readBuf.data(), nullptr);
-                readPending = issueRead(pipe, readBuf, readOv);
-                if (!readPending)
+                if (!link.finishRead(bytesRead))
                     break;
-            }
-
-            if (signaled == QUEUE_READY) {
-                {
-                    std::lock_guard lock(bufMtx_);
-                    writeBuf.swap(queue_);
-                    ResetEvent(queueEvent_);
+                if (bytesRead > 0) {
+                    trace::record(trace::Event::read, trace::Direction::pipeToDvc,
+                        bytesRead, 0, readBuf.data() + headroom + buffered, bytesRead);
+                    buffered += bytesRead;
                 }
-                if (!writeBuf.empty()) {
-                    writePending = issueWrite(pipe, writeBuf, writeOv);
-                    if (!writePending)
+
+                bool morePending = headroom + buffered < readBuf.size() && link.morePending();
+                size_t frameLen = chunking.writeSize(headroom + buffered, morePending);
+                auto len = static_cast<DWORD>(frameLen > headroom ? frameLen - headroom : 0);
+                if (len > 0) {
+                    auto delay = shaper.reserve(len, Clock::now());
+                    if (delay > Clock::duration::zero()) {
+                        heldBytes = len;
+                        releaseAt = Clock::now() + delay;
+                        readPending = false;
+                        continue;
+                    }
+                    if (!sendToChannel(len))
                         break;
                 }
+                readPending = link.startRead(readBuf, headroom + buffered);
+                if (!readPending)
+                    break;
             }
 
+            // The doorbell may also be left over from a ring that raced
+            // with disarm(), in which case the next iteration finds nothing
+            // queued and arms it again.
+            if (signaled == QUEUE_READY)
+                continue;
+
             if (signaled == PIPE_WRITE) {
                 DWORD bytesWritten = 0;
-                if (!GetOverlappedResult(pipe, &writeOv, &bytesWritten, FALSE))
+                bool done = false;
+                if (!link.finishWrite(bytesWritten, done))
                     break;
-                writePending = false;
-                writeBuf.clear();
+                trace::record(trace::Event::write, trace::Direction::dvcToPipe, bytesWritten);
+                if (done) {
+                    writePending = false;
+                    writeBuf.clear();
+                }
             }
         }
 
-        // Phase 4: Cancel any in-flight I/O before closing handles.
-        if (readPending) {
-            CancelIoEx(pipe, &readOv);
-            DWORD dummy;
-            GetOverlappedResult(pipe, &readOv, &dummy, TRUE);
-        }
-        if (writePending) {
-            CancelIoEx(pipe, &writeOv);
-            DWORD dummy;
-            GetOverlappedResult(pipe, &writeOv, &dummy, TRUE);
+        // Phase 4: Cancel any in-flight I/O before closing.
+        link.cancel();
+        CloseHandle(pipe);
+    }
+
+    // Moves what OnDataReceived queued into `out`, clearing queued_ once
+    // the queue is drained.
+    void takeQueued(std::vector<BYTE>& out)
+    {
+        {
+            std::lock_guard lock(bufMtx_);
+            queue_.pop(out);
+            if (queue_.empty())
+                queued_.store(false, std::memory_order_relaxed);
         }
+        trace::record(trace::Event::queue, trace::Direction::dvcToPipe, 0, out.size());
+    }
 
-        CloseHandle(readOv.hEvent);
-        CloseHandle(writeOv.hEvent);
-        CloseHandle(pipe);
-        channel_->Release();
+    // Sends the PipeHello and switches `link` to shared memory if the
+    // client's PipeWelcome asks for it; false if the client does not answer
+    // in time or speaks another protocol.
+    bool negotiate(HANDLE pipe, ClientLink& link)
+    {
+        kq::PipeHello hello{};
+        std::memcpy(hello.magic, kq::pipeMagic, sizeof(hello.magic));
+        hello.version = kq::pipeProtocolVersion;
+        hello.flags = readSetting("SharedMemory", 1) ? kq::pipeFlagSharedMemory : 0;
+        hello.processId = GetCurrentProcessId();
+        hello.session = session_;
+
+        kq::PipeWelcome welcome{};
+        OVERLAPPED ov{};
+        ov.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        bool ok = transferAll(pipe, ov, shutdownEvent_, true, &hello, sizeof(hello),
+                      kq::pipeHandshakeTimeoutMs)
+            && transferAll(pipe, ov, shutdownEvent_, false, &welcome, sizeof(welcome),
+                kq::pipeHandshakeTimeoutMs);
+        CloseHandle(ov.hEvent);
+
+        if (!ok || std::memcmp(welcome.magic, kq::pipeMagic, sizeof(welcome.magic)) != 0
+            || welcome.version != kq::pipeProtocolVersion)
+            return false;
+        if (welcome.transport == kq::PipeTransport::sharedMemory) {
+            welcome.mapping[sizeof(welcome.mapping) - 1] = '\0';
+            return link.useSharedMemory(welcome.mapping);
+        }
+        return true;
     }
 
-    LONG refCount_;
-    IWTSVirtualChannel* channel_;
+    bool const striped_;
+    uint32_t const session_;
     HANDLE shutdownEvent_;
-    HANDLE queueEvent_;
+    std::atomic<bool> overflowed_{false};
+    std::mutex threadMtx_;
     std::thread ioThread_;
+    bool started_ = false;
+    std::mutex channelsMtx_;
+    IWTSVirtualChannel* channels_[kq::maxStripes] = {};
+    uint32_t sendSeq_ = 0;
     std::mutex bufMtx_;
-    std::vector<BYTE> queue_;
+    kq::SpillQueue<std::vector<BYTE>> queue_;
+    std::vector<BYTE> ordered_;
+    kq::ReorderBuffer reorder_;
+
+    // Set by OnDataReceived with data in queue_, cleared by the IO thread
+    // when it drains it; the doorbell wakes the IO thread only if it is
+    // parked waiting for that.
+    std::atomic<bool> queued_{false};
+    kq::Doorbell doorbell_;
+    kq::AdaptiveSpin spin_;
+};
+
+// Stripes of one striped tunnel open in order, KQTUNNEL0 first; the later
+// ones join the tunnel the most recent stripe 0 created.
+struct StripeRendezvous {
+    std::mutex mtx;
+    std::weak_ptr<Tunnel> current;
+};
+
+class KqTunnelChannelCallback : public IWTSVirtualChannelCallback
+{
+public:
+    KqTunnelChannelCallback(std::shared_ptr<Tunnel> tunnel, size_t index,
+        IWTSVirtualChannel* channel)
+        : refCount_(1), tunnel_(std::move(tunnel)), index_(index)
+    {
+        InterlockedIncrement(&g_dllRefCount);
+        tunnel_->attach(index_, channel);
+    }
+
+    ~KqTunnelChannelCallback()
+    {
+        if (tunnel_) {
+            tunnel_->close();
+            tunnel_->detach(index_);
+        }
+        InterlockedDecrement(&g_dllRefCount);
+    }
+
+    // IUnknown
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppv) override
+    {
+        if (!ppv) return E_INVALIDARG;
+        if (riid == IID_IUnknown || riid == __uuidof(IWTSVirtualChannelCallback)) {
+            *ppv = static_cast<IWTSVirtualChannelCallback*>(this);
+            AddRef();
+            return S_OK;
+        }
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override { return InterlockedIncrement(&refCount_); }
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        auto count = InterlockedDecrement(&refCount_);
+        if (count == 0) delete this;
+        return count;
+    }
+
+    // IWTSVirtualChannelCallback
+    HRESULT STDMETHODCALLTYPE OnDataReceived(ULONG size, BYTE* data) override
+    {
+        if (tunnel_)
+            tunnel_->onDataReceived(size, data);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnClose() override
+    {
+        if (tunnel_) {
+            tunnel_->close();
+            tunnel_->detach(index_);
+            tunnel_.reset();
+        }
+        trace::Recorder::instance().dump();
+        return S_OK;
+    }
+
+private:
+    LONG refCount_;
+    std::shared_ptr<Tunnel> tunnel_;
+    size_t index_;
 };
 
 class KqTunnelListenerCallback : public IWTSListenerCallback
 {
 public:
-    KqTunnelListenerCallback() : refCount_(1)
+    // `stripe` is the KQTUNNEL<i> index this listener serves, or -1 for the
+    // plain KQTUNNEL channel; `session` identifies the plugin instance.
+    KqTunnelListenerCallback(int stripe, uint32_t session,
+        std::shared_ptr<StripeRendezvous> rendezvous)
+        : refCount_(1), stripe_(stripe), session_(session), rendezvous_(std::move(rendezvous))
     {
         InterlockedIncrement(&g_dllRefCount);
     }
@@ -310,14 +862,36 @@ public:
         BOOL* accept,
         IWTSVirtualChannelCallback** callback) override
     {
+        std::shared_ptr<Tunnel> tunnel;
+        if (stripe_ < 0) {
+            tunnel = std::make_shared<Tunnel>(false, session_);
+        } else {
+            std::lock_guard lock(rendezvous_->mtx);
+            if (stripe_ == 0) {
+                tunnel = std::make_shared<Tunnel>(true, session_);
+                rendezvous_->current = tunnel;
+            } else {
+                tunnel = rendezvous_->current.lock();
+            }
+        }
+        if (!tunnel) {
+            *accept = FALSE;
+            *callback = nullptr;
+            return S_OK;
+        }
+
         *accept = TRUE;
-        auto* cb = new KqTunnelChannelCallback(channel);
+        auto* cb = new KqTunnelChannelCallback(
+            std::move(tunnel), stripe_ < 0 ? 0 : static_cast<size_t>(stripe_), channel);
         *callback = cb;
         return S_OK;
     }
 
 private:
     LONG refCount_;
+    int stripe_;
+    uint32_t session_;
+    std::shared_ptr<StripeRendezvous> rendezvous_;
 };
 
 class KqTunnelPlugin : public IWTSPlugin
@@ -357,10 +931,22 @@ public:
     // IWTSPlugin
     HRESULT STDMETHODCALLTYPE Initialize(IWTSVirtualChannelManager* channelMgr) override
     {
-        auto* listener = new KqTunnelListenerCallback();
-        HRESULT hr = channelMgr->CreateListener(
-            kq::channelName, 0, listener, nullptr);
-        listener->Release();
+        std::string tracePath = readSetting("TraceFile");
+        if (!tracePath.empty())
+            trace::Recorder::instance().enable(tracePath, readSetting("TracePayload", 0));
+
+        // Every Initialize is a separate RDP connection (RDCMan hosts many
+        // in one process); the client routes each session's tunnels apart.
+        auto session = static_cast<uint32_t>(InterlockedIncrement(&g_sessionCount));
+        auto rendezvous = std::make_shared<StripeRendezvous>();
+        HRESULT hr = S_OK;
+        for (int stripe = -1; SUCCEEDED(hr) && stripe < static_cast<int>(kq::maxStripes); ++stripe) {
+            std::string name = stripe < 0 ? std::string(kq::channelName)
+                                          : kq::stripeChannelName(static_cast<size_t>(stripe));
+            auto* listener = new KqTunnelListenerCallback(stripe, session, rendezvous);
+            hr = channelMgr->CreateListener(name.c_str(), 0, listener, nullptr);
+            listener->Release();
+        }
         return hr;
     }
 
@@ -1,3 +1,8 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
 #include <thread>
@@ -9,18 +14,63 @@
 #include <windows.h>
 #include <wtsapi32.h>
 
+#include "dedup.hpp"
+#include "dvc_chunking.hpp"
+#include "options.hpp"
 #include "protocol.hpp"
+#include "shaper.hpp"
+#include "spill_queue.hpp"
+#include "stripe.hpp"
+#include "trace.hpp"
 
 namespace {
 
+namespace trace = kq::trace;
+
 // ReadFile on a DVC file handle returns CHANNEL_PDU_HEADER (8 bytes) + payload.
 // WriteFile takes raw payload (no header needed).
 constexpr DWORD channelPduHeaderSize = 8;
 
-bool waitForIo(HANDLE file, OVERLAPPED& ov, DWORD& bytes, HANDLE cancelEvent)
+using Clock = std::chrono::steady_clock;
+
+struct SpillConfig {
+    std::string path;   // empty = DVC reads wait for TCP writes
+    uint64_t threshold = kq::defaultSpillThreshold;
+    uint64_t capacity = kq::defaultSpillCapacity;
+};
+
+// Per-session write tuning shared by both relay directions: shaping of DVC
+// writes, PDU-aligned write sizes, (optionally) learning the chunk size
+// from the PDUs read on the other direction, the dedup codec when the
+// stream is deduplicated, and where DVC data waiting for TCP may spill.
+struct RelayTuning {
+    kq::Shaper<> shaper;
+    kq::DvcChunking chunking{kq::defaultDvcChunkSize};
+    kq::DvcChunkProbe probe{};
+    bool probeChunkSize = false;
+    kq::dedup::Codec* dedup = nullptr;
+    SpillConfig spill;
+};
+
+void observePdu(RelayTuning& tuning, char const* pdu, DWORD payloadLen)
+{
+    if (!tuning.probeChunkSize)
+        return;
+    uint32_t flags = 0;
+    std::memcpy(&flags, pdu + sizeof(uint32_t), sizeof(flags));
+    if (tuning.probe.observe(payloadLen, flags)) {
+        tuning.chunking.setChunkSize(tuning.probe.chunkSize());
+        spdlog::info("DVC chunk size measured: {} bytes", tuning.probe.chunkSize());
+    }
+}
+
+bool waitForIo(HANDLE file, OVERLAPPED& ov, DWORD& bytes, HANDLE cancelEvent,
+    trace::Direction direction)
 {
     HANDLE handles[] = {ov.hEvent, cancelEvent};
+    int64_t start = trace::nowNs();
     DWORD wait = WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+    trace::record(trace::Event::wait, direction, 0, trace::nowNs() - start);
     if (wait == WAIT_OBJECT_0) {
         return GetOverlappedResult(file, &ov, &bytes, FALSE);
     }
@@ -29,27 +79,168 @@ bool waitForIo(HANDLE file, OVERLAPPED& ov, DWORD& bytes, HANDLE cancelEvent)
     return false;
 }
 
-void dvcToTcp(HANDLE fileHandle, asio::ip::tcp::socket& socket, HANDLE cancelEvent)
+// Decouples dvcToTcp's DVC reads from its TCP writes: data is queued in a
+// SpillQueue that a writer thread drains, so a slow TCP peer fills memory
+// and then the spill file instead of stalling the DVC reader. The reader
+// only waits once both tiers are full, or for a piece larger than both
+// until the queue is empty. The file is created on the first spill.
+class SpillWriter
 {
-    std::vector<char> buf(kq::bufferSize);
+public:
+    SpillWriter(asio::ip::tcp::socket& socket, SpillConfig const& config)
+        : socket_(socket), queue_(config.threshold), path_(config.path)
+    {
+        queue_.enableSpill(config.path, config.capacity);
+        writer_ = std::thread(&SpillWriter::drain, this);
+    }
+
+    ~SpillWriter() { finish(); }
+
+    // Queues `len` bytes; false once writing to TCP has failed.
+    bool push(char const* data, size_t len)
+    {
+        std::unique_lock lock(mtx_);
+        cv_.wait(lock, [&] { return failed_ || queue_.push(data, len); });
+        if (queue_.spillFailed() && !warned_) {
+            spdlog::warn("Cannot open spill file '{}', buffering in memory only", path_);
+            warned_ = true;
+        }
+        cv_.notify_all();
+        return !failed_;
+    }
+
+    // Returns once everything queued is written or writing has failed.
+    void finish()
+    {
+        {
+            std::lock_guard lock(mtx_);
+            finishing_ = true;
+        }
+        cv_.notify_all();
+        if (!writer_.joinable())
+            return;
+        writer_.join();
+        if (queue_.peakSpilled())
+            spdlog::info("Spill: up to {} bytes were queued on disk", queue_.peakSpilled());
+    }
+
+private:
+    void drain()
+    {
+        std::vector<char> buf;
+        for (;;) {
+            {
+                std::unique_lock lock(mtx_);
+                cv_.wait(lock, [&] { return finishing_ || !queue_.empty(); });
+                if (queue_.empty())
+                    return;
+                buf.clear();
+                queue_.pop(buf);
+            }
+            cv_.notify_all();
+
+            asio::error_code ec;
+            asio::write(socket_, asio::buffer(buf), ec);
+            if (ec) {
+                spdlog::info("TCP write failed: {}", ec.message());
+                std::lock_guard lock(mtx_);
+                failed_ = true;
+                cv_.notify_all();
+                return;
+            }
+            trace::record(trace::Event::write, trace::Direction::dvcToTcp, buf.size());
+        }
+    }
+
+    asio::ip::tcp::socket& socket_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    kq::SpillQueue<> queue_;
+    std::string path_;
+    bool warned_ = false;
+    bool finishing_ = false;
+    bool failed_ = false;
+    std::thread writer_;
+};
+
+// Reads that complete without blocking land back to back in one arena and
+// go out as a single gather write, skipping each PDU header in place; the
+// batch is sent as soon as a read has to wait, or when it reaches the caps.
+void dvcToTcp(HANDLE fileHandle, asio::ip::tcp::socket& socket, HANDLE cancelEvent,
+    RelayTuning& tuning)
+{
+    std::vector<char> arena(kq::maxGatherBytes + kq::bufferSize);
+    size_t used = 0;
+    size_t reads = 0;
+    std::vector<asio::const_buffer> batch;
+    std::vector<char> decoded;
     OVERLAPPED ov{};
     ov.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
 
+    std::unique_ptr<SpillWriter> spill;
+    if (!tuning.spill.path.empty())
+        spill = std::make_unique<SpillWriter>(socket, tuning.spill);
+
+    auto flush = [&] {
+        if (tuning.dedup && !decoded.empty())
+            batch.assign(1, asio::buffer(decoded));
+        if (batch.empty())
+            return true;
+        size_t len = asio::buffer_size(batch);
+        asio::error_code ec;
+        if (spill) {
+            for (auto const& piece : batch) {
+                if (!spill->push(static_cast<char const*>(piece.data()), piece.size())) {
+                    ec = asio::error::broken_pipe;
+                    break;
+                }
+            }
+        } else {
+            asio::write(socket, batch, ec);
+        }
+        batch.clear();
+        decoded.clear();
+        reads = 0;
+        if (ec) {
+            if (!spill)
+                spdlog::info("TCP write failed: {}", ec.message());
+            return false;
+        }
+        if (!spill)
+            trace::record(trace::Event::write, trace::Direction::dvcToTcp, len);
+        return true;
+    };
+
     for (;;) {
+        if (reads == kq::maxGatherReads || arena.size() - used < kq::bufferSize
+            || decoded.size() >= kq::maxGatherBytes) {
+            if (!flush())
+                break;
+            used = 0;
+        }
+
+        char* buf = arena.data() + used;
         DWORD bytesRead = 0;
         ResetEvent(ov.hEvent);
-        BOOL ok = ReadFile(fileHandle, buf.data(),
-            static_cast<DWORD>(buf.size()), &bytesRead, &ov);
+        BOOL ok = ReadFile(fileHandle, buf,
+            static_cast<DWORD>(kq::bufferSize), &bytesRead, &ov);
 
         if (!ok) {
             DWORD err = GetLastError();
             if (err == ERROR_IO_PENDING) {
-                if (!waitForIo(fileHandle, ov, bytesRead, cancelEvent)) {
+                if (!flush()) {
+                    CancelIoEx(fileHandle, &ov);
+                    GetOverlappedResult(fileHandle, &ov, &bytesRead, TRUE);
+                    break;
+                }
+                if (!waitForIo(fileHandle, ov, bytesRead, cancelEvent,
+                        trace::Direction::dvcToTcp)) {
                     spdlog::info("DVC read ended ({})", GetLastError());
                     break;
                 }
             } else {
                 spdlog::info("DVC read ended ({})", err);
+                trace::record(trace::Event::error, trace::Direction::dvcToTcp, 0, err);
                 break;
             }
         }
@@ -57,58 +248,555 @@ void dvcToTcp(HANDLE fileHandle, asio::ip::tcp::socket& socket, HANDLE cancelEve
         if (bytesRead <= channelPduHeaderSize)
             continue;
 
-        auto* payload = buf.data() + channelPduHeaderSize;
+        auto* payload = buf + channelPduHeaderSize;
         auto payloadLen = bytesRead - channelPduHeaderSize;
+        trace::record(trace::Event::read, trace::Direction::dvcToTcp,
+            payloadLen, 0, payload, payloadLen);
+        observePdu(tuning, buf, payloadLen);
+        used += bytesRead;
+        ++reads;
 
-        asio::error_code ec;
-        asio::write(socket, asio::buffer(payload, payloadLen), ec);
-        if (ec) {
-            spdlog::info("TCP write failed: {}", ec.message());
+        if (!tuning.dedup) {
+            batch.push_back(asio::buffer(payload, payloadLen));
+            continue;
+        }
+        if (!tuning.dedup->decode(payload, payloadLen, decoded)) {
+            spdlog::error("Dedup stream error: {}", tuning.dedup->error());
             break;
         }
     }
+    flush();
+    if (spill)
+        spill->finish();
     CloseHandle(ov.hEvent);
     SetEvent(cancelEvent);
     asio::error_code ec;
     socket.close(ec);
 }
 
-void tcpToDvc(asio::ip::tcp::socket& socket, HANDLE fileHandle, HANDLE cancelEvent)
+// Waits out the shaper's delay for `n` bytes; false if cancelled meanwhile.
+bool throttle(kq::Shaper<>& shaper, size_t n, HANDLE cancelEvent)
+{
+    auto delay = shaper.reserve(n, Clock::now());
+    if (delay <= Clock::duration::zero())
+        return true;
+    auto ms = std::chrono::ceil<std::chrono::milliseconds>(delay).count();
+    return WaitForSingleObject(cancelEvent, static_cast<DWORD>(ms)) == WAIT_TIMEOUT;
+}
+
+void tcpToDvc(asio::ip::tcp::socket& socket, HANDLE fileHandle, HANDLE cancelEvent,
+    RelayTuning& tuning)
 {
     std::vector<char> buf(kq::bufferSize);
+    size_t buffered = 0;
+    std::vector<char> encoded;
     OVERLAPPED ov{};
     ov.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
 
-    for (;;) {
-        asio::error_code ec;
-        auto n = socket.read_some(asio::buffer(buf), ec);
-        if (ec) {
-            spdlog::info("TCP read ended: {}", ec.message());
-            break;
-        }
+    auto writeDvc = [&](char const* data, size_t len) {
+        if (!throttle(tuning.shaper, len, cancelEvent))
+            return false;
 
+        auto writeStart = Clock::now();
         DWORD bytesWritten = 0;
         ResetEvent(ov.hEvent);
-        BOOL ok = WriteFile(fileHandle, buf.data(),
-            static_cast<DWORD>(n), &bytesWritten, &ov);
+        BOOL ok = WriteFile(fileHandle, data,
+            static_cast<DWORD>(len), &bytesWritten, &ov);
 
         if (!ok) {
             DWORD err = GetLastError();
             if (err == ERROR_IO_PENDING) {
-                if (!waitForIo(fileHandle, ov, bytesWritten, cancelEvent)) {
+                if (!waitForIo(fileHandle, ov, bytesWritten, cancelEvent,
+                        trace::Direction::tcpToDvc)) {
                     spdlog::info("DVC write failed ({})", GetLastError());
-                    break;
+                    return false;
                 }
             } else {
                 spdlog::info("DVC write failed ({})", err);
-                break;
+                trace::record(trace::Event::error, trace::Direction::tcpToDvc, 0, err);
+                return false;
             }
         }
+        trace::record(trace::Event::write, trace::Direction::tcpToDvc, len);
+        auto writeEnd = Clock::now();
+        tuning.shaper.onWriteComplete(writeEnd - writeStart, writeEnd);
+        return true;
+    };
+
+    // The dedup hello goes out before anything is read, so the peer can
+    // sync its encoder even if this direction stays silent.
+    bool running = true;
+    if (tuning.dedup) {
+        tuning.dedup->hello(encoded);
+        running = writeDvc(encoded.data(), encoded.size());
+        encoded.clear();
+    }
+
+    while (running) {
+        asio::error_code ec;
+        auto n = socket.read_some(
+            asio::buffer(buf.data() + buffered, buf.size() - buffered), ec);
+        if (ec) {
+            spdlog::info("TCP read ended: {}", ec.message());
+            break;
+        }
+        trace::record(trace::Event::read, trace::Direction::tcpToDvc,
+            n, 0, buf.data() + buffered, n);
+        buffered += n;
+
+        // A partial trailing PDU is only held back while more data is
+        // already waiting in the socket, so it never delays a lone write.
+        bool morePending = buffered < buf.size() && socket.available(ec) > 0;
+
+        // With dedup the DVC carries the encoder's output instead, which
+        // keeps its own partial tail between reads.
+        if (tuning.dedup) {
+            tuning.dedup->encode(buf.data(), buffered, !morePending, encoded);
+            buffered = 0;
+            size_t len = tuning.chunking.writeSize(encoded.size(), morePending);
+            if (len == 0)
+                continue;
+            if (!writeDvc(encoded.data(), len))
+                break;
+            encoded.erase(encoded.begin(), encoded.begin() + static_cast<ptrdiff_t>(len));
+            continue;
+        }
+
+        size_t len = tuning.chunking.writeSize(buffered, morePending);
+        if (len == 0)
+            continue;
+        if (!writeDvc(buf.data(), len))
+            break;
+
+        buffered -= len;
+        std::memmove(buf.data(), buf.data() + len, buffered);
     }
     CloseHandle(ov.hEvent);
     SetEvent(cancelEvent);
 }
 
+// Single-threaded relay driven by the io_context's completion port. The DVC
+// file handle is overlapped, so it can share the port with the socket and one
+// thread services both directions instead of one blocked thread per direction.
+class IocpRelay
+{
+public:
+    IocpRelay(asio::io_context& io, HANDLE fileHandle, asio::ip::tcp::socket& socket,
+        RelayTuning& tuning)
+        : io_(io), dvc_(io), socket_(socket), tuning_(tuning), throttle_(io),
+          dvcBuf_(kq::bufferSize), tcpBuf_(kq::bufferSize)
+    {
+        // The stream handle closes what it owns; give it a duplicate so the
+        // caller's handle stays valid for WTSVirtualChannelClose ordering.
+        HANDLE dup = nullptr;
+        if (DuplicateHandle(GetCurrentProcess(), fileHandle,
+                GetCurrentProcess(), &dup, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+            asio::error_code ec;
+            dvc_.assign(dup, ec);
+            if (ec) {
+                spdlog::error("Failed to attach DVC handle to IOCP: {}", ec.message());
+                CloseHandle(dup);
+            }
+        } else {
+            spdlog::error("DuplicateHandle failed (error {})", GetLastError());
+        }
+    }
+
+    bool valid() const { return dvc_.is_open(); }
+
+    void run()
+    {
+        readDvc();
+        readTcp();
+        io_.run();
+        io_.restart();
+    }
+
+private:
+    void readDvc()
+    {
+        dvc_.async_read_some(asio::buffer(dvcBuf_),
+            [this](asio::error_code ec, std::size_t n) {
+                if (ec) {
+                    spdlog::info("DVC read ended: {}", ec.message());
+                    return stop();
+                }
+                if (n <= channelPduHeaderSize)
+                    return readDvc();
+
+                auto* payload = dvcBuf_.data() + channelPduHeaderSize;
+                auto payloadLen = n - channelPduHeaderSize;
+                trace::record(trace::Event::read, trace::Direction::dvcToTcp,
+                    payloadLen, 0, payload, payloadLen);
+                observePdu(tuning_, dvcBuf_.data(), static_cast<DWORD>(payloadLen));
+
+                asio::async_write(socket_, asio::buffer(payload, payloadLen),
+                    [this](asio::error_code ec, std::size_t written) {
+                        if (ec) {
+                            spdlog::info("TCP write failed: {}", ec.message());
+                            return stop();
+                        }
+                        trace::record(trace::Event::write,
+                            trace::Direction::dvcToTcp, written);
+                        readDvc();
+                    });
+            });
+    }
+
+    void readTcp()
+    {
+        socket_.async_read_some(
+            asio::buffer(tcpBuf_.data() + buffered_, tcpBuf_.size() - buffered_),
+            [this](asio::error_code ec, std::size_t n) {
+                if (ec) {
+                    spdlog::info("TCP read ended: {}", ec.message());
+                    return stop();
+                }
+                trace::record(trace::Event::read, trace::Direction::tcpToDvc,
+                    n, 0, tcpBuf_.data() + buffered_, n);
+                buffered_ += n;
+
+                bool morePending = buffered_ < tcpBuf_.size() && socket_.available(ec) > 0;
+                size_t len = tuning_.chunking.writeSize(buffered_, morePending);
+                if (len == 0)
+                    return readTcp();
+
+                auto delay = tuning_.shaper.reserve(len, Clock::now());
+                if (delay <= Clock::duration::zero())
+                    return writeDvc(len);
+
+                throttle_.expires_after(delay);
+                throttle_.async_wait([this, len](asio::error_code ec) {
+                    if (ec)
+                        return stop();
+                    writeDvc(len);
+                });
+            });
+    }
+
+    void writeDvc(std::size_t len)
+    {
+        auto writeStart = Clock::now();
+        asio::async_write(dvc_, asio::buffer(tcpBuf_.data(), len),
+            [this, writeStart](asio::error_code ec, std::size_t written) {
+                if (ec) {
+                    spdlog::info("DVC write failed: {}", ec.message());
+                    return stop();
+                }
+                trace::record(trace::Event::write, trace::Direction::tcpToDvc, written);
+                auto writeEnd = Clock::now();
+                tuning_.shaper.onWriteComplete(writeEnd - writeStart, writeEnd);
+
+                buffered_ -= written;
+                std::memmove(tcpBuf_.data(), tcpBuf_.data() + written, buffered_);
+                readTcp();
+            });
+    }
+
+    // Either direction ending tears down both, like cancelEvent does for the
+    // threaded relay; the pending operations complete with operation_aborted.
+    void stop()
+    {
+        asio::error_code ec;
+        socket_.close(ec);
+        dvc_.close(ec);
+        throttle_.cancel();
+    }
+
+    asio::io_context& io_;
+    asio::windows::stream_handle dvc_;
+    asio::ip::tcp::socket& socket_;
+    RelayTuning& tuning_;
+    asio::steady_timer throttle_;
+    std::vector<char> dvcBuf_;
+    std::vector<char> tcpBuf_;
+    size_t buffered_ = 0;
+};
+
+// Relay over several DVCs carrying one TCP stream (see stripe.hpp). One
+// thread per stripe reads and reassembles frames into a shared reorder
+// buffer that a writer thread drains to TCP; the TCP reader round-robins
+// frames over the stripes with up to one write in flight per stripe.
+class StripedRelay
+{
+public:
+    StripedRelay(std::vector<HANDLE> const& files, asio::ip::tcp::socket& socket,
+        HANDLE cancelEvent, RelayTuning& tuning)
+        : files_(files), socket_(socket), cancelEvent_(cancelEvent), tuning_(tuning),
+          reorder_(maxReorderBytes)
+    {
+    }
+
+    void run()
+    {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < files_.size(); ++i)
+            threads.emplace_back(&StripedRelay::stripeToReorder, this, i);
+        threads.emplace_back(&StripedRelay::reorderToTcp, this);
+        threads.emplace_back(&StripedRelay::tcpToStripes, this);
+        for (auto& t : threads)
+            t.join();
+
+        spdlog::info("Reorder buffer peak: {} bytes", reorder_.peak());
+    }
+
+private:
+    static constexpr size_t maxReorderBytes = 32 * 1024 * 1024;
+
+    // In-order data waiting for the TCP writer. Past this the stripe readers
+    // block, so a slow TCP peer pushes back on the DVCs as a blocking write
+    // would.
+    static constexpr size_t maxReadyBytes = 4 * 1024 * 1024;
+
+    struct Outgoing {
+        std::vector<char> frame;
+        OVERLAPPED ov{};
+        bool pending = false;
+        Clock::time_point start;
+    };
+
+    void stop()
+    {
+        SetEvent(cancelEvent_);
+        {
+            std::lock_guard lock(mtx_);
+            stopping_ = true;
+        }
+        readyCv_.notify_all();
+        spaceCv_.notify_all();
+    }
+
+    void stripeToReorder(size_t index)
+    {
+        HANDLE file = files_[index];
+        std::vector<char> buf(kq::bufferSize);
+        kq::StripeFrameParser parser;
+        OVERLAPPED ov{};
+        ov.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+
+        bool stopped = false;
+        auto onFrame = [&](uint32_t seq, char const* data, size_t len) {
+            {
+                std::unique_lock lock(mtx_);
+                spaceCv_.wait(lock, [this] { return stopping_ || ready_.size() < maxReadyBytes; });
+                if (stopping_) {
+                    stopped = true;
+                    return false;
+                }
+                if (!reorder_.push(seq, data, len, ready_))
+                    return false;
+            }
+            readyCv_.notify_one();
+            return true;
+        };
+
+        for (;;) {
+            DWORD bytesRead = 0;
+            ResetEvent(ov.hEvent);
+            BOOL ok = ReadFile(file, buf.data(),
+                static_cast<DWORD>(buf.size()), &bytesRead, &ov);
+
+            if (!ok) {
+                DWORD err = GetLastError();
+                if (err != ERROR_IO_PENDING) {
+                    spdlog::info("Stripe {} read ended ({})", index, err);
+                    break;
+                }
+                if (!waitForIo(file, ov, bytesRead, cancelEvent_,
+                        trace::Direction::dvcToTcp)) {
+                    spdlog::info("Stripe {} read ended ({})", index, GetLastError());
+                    break;
+                }
+            }
+
+            if (bytesRead <= channelPduHeaderSize)
+                continue;
+
+            auto* payload = buf.data() + channelPduHeaderSize;
+            auto payloadLen = bytesRead - channelPduHeaderSize;
+            trace::record(trace::Event::read, trace::Direction::dvcToTcp,
+                payloadLen, index, payload, payloadLen);
+            if (index == 0)
+                observePdu(tuning_, buf.data(), payloadLen);
+
+            if (!parser.feed(payload, payloadLen, onFrame)) {
+                if (!stopped)
+                    spdlog::error("Stripe {}: malformed frame or reorder buffer full", index);
+                break;
+            }
+        }
+        CloseHandle(ov.hEvent);
+        stop();
+    }
+
+    // Keeps writing after a stripe closed until what was already put back in
+    // order has gone out.
+    void reorderToTcp()
+    {
+        std::vector<char> out;
+        for (;;) {
+            {
+                std::unique_lock lock(mtx_);
+                readyCv_.wait(lock, [this] { return stopping_ || !ready_.empty(); });
+                if (ready_.empty())
+                    break;
+                out.swap(ready_);
+            }
+            spaceCv_.notify_all();
+
+            asio::error_code ec;
+            asio::write(socket_, asio::buffer(out), ec);
+            if (ec) {
+                spdlog::info("TCP write failed: {}", ec.message());
+                break;
+            }
+            trace::record(trace::Event::write, trace::Direction::dvcToTcp, out.size());
+            out.clear();
+        }
+        stop();
+        asio::error_code ec;
+        socket_.close(ec);
+    }
+
+    void tcpToStripes()
+    {
+        constexpr size_t headroom = kq::stripeFrameHeaderSize;
+        std::vector<char> buf(headroom + kq::bufferSize);
+        size_t buffered = 0;
+        uint32_t seq = 0;
+
+        std::vector<Outgoing> out(files_.size());
+        for (auto& o : out)
+            o.ov.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+
+        // Waits for the stripe's previous write before its frame is reused.
+        auto complete = [&](size_t index) {
+            Outgoing& o = out[index];
+            if (!o.pending)
+                return true;
+            DWORD written = 0;
+            bool ok = waitForIo(files_[index], o.ov, written, cancelEvent_,
+                trace::Direction::tcpToDvc);
+            o.pending = false;
+            if (!ok) {
+                spdlog::info("Stripe {} write failed ({})", index, GetLastError());
+                return false;
+            }
+            trace::record(trace::Event::write, trace::Direction::tcpToDvc, written, index);
+            auto end = Clock::now();
+            tuning_.shaper.onWriteComplete(end - o.start, end);
+            return true;
+        };
+
+        for (;;) {
+            asio::error_code ec;
+            auto n = socket_.read_some(asio::buffer(buf.data() + headroom + buffered,
+                buf.size() - headroom - buffered), ec);
+            if (ec) {
+                spdlog::info("TCP read ended: {}", ec.message());
+                break;
+            }
+            trace::record(trace::Event::read, trace::Direction::tcpToDvc,
+                n, 0, buf.data() + headroom + buffered, n);
+            buffered += n;
+
+            bool morePending = headroom + buffered < buf.size() && socket_.available(ec) > 0;
+            size_t frameLen = tuning_.chunking.writeSize(headroom + buffered, morePending);
+            if (frameLen <= headroom)
+                continue;
+            size_t len = frameLen - headroom;
+
+            if (!throttle(tuning_.shaper, len, cancelEvent_))
+                break;
+
+            size_t index = seq % files_.size();
+            if (!complete(index))
+                break;
+
+            Outgoing& o = out[index];
+            kq::StripeFrameHeader header{seq, static_cast<uint32_t>(len)};
+            o.frame.resize(frameLen);
+            std::memcpy(o.frame.data(), &header, sizeof(header));
+            std::memcpy(o.frame.data() + headroom, buf.data() + headroom, len);
+
+            o.start = Clock::now();
+            ResetEvent(o.ov.hEvent);
+            BOOL ok = WriteFile(files_[index], o.frame.data(),
+                static_cast<DWORD>(frameLen), nullptr, &o.ov);
+            if (!ok && GetLastError() != ERROR_IO_PENDING) {
+                spdlog::info("Stripe {} write failed ({})", index, GetLastError());
+                break;
+            }
+            o.pending = true;
+            ++seq;
+
+            buffered -= len;
+            std::memmove(buf.data() + headroom, buf.data() + headroom + len, buffered);
+        }
+
+        stop();
+        for (size_t i = 0; i < out.size(); ++i) {
+            if (out[i].pending) {
+                CancelIoEx(files_[i], &out[i].ov);
+                DWORD dummy;
+                GetOverlappedResult(files_[i], &out[i].ov, &dummy, TRUE);
+            }
+            CloseHandle(out[i].ov.hEvent);
+        }
+    }
+
+    std::vector<HANDLE> const& files_;
+    asio::ip::tcp::socket& socket_;
+    HANDLE cancelEvent_;
+    RelayTuning& tuning_;
+
+    std::mutex mtx_;
+    std::condition_variable readyCv_;
+    std::condition_variable spaceCv_;
+    kq::ReorderBuffer reorder_;
+    std::vector<char> ready_;
+    bool stopping_ = false;
+};
+
+enum class Relay { threads, iocp };
+
+void runRelay(Relay relay, asio::io_context& io, std::vector<HANDLE> const& files,
+    asio::ip::tcp::socket& socket, HANDLE cancelEvent, RelayTuning& tuning)
+{
+    if (files.size() > 1) {
+        if (relay == Relay::iocp)
+            spdlog::warn("IOCP relay does not support striping, using threads");
+        StripedRelay(files, socket, cancelEvent, tuning).run();
+        return;
+    }
+
+    HANDLE fileHandle = files.front();
+    if (relay == Relay::iocp && tuning.dedup) {
+        spdlog::warn("IOCP relay does not support dedup, using threads");
+        relay = Relay::threads;
+    }
+    if (relay == Relay::iocp && !tuning.spill.path.empty()) {
+        spdlog::warn("IOCP relay does not support spilling, using threads");
+        relay = Relay::threads;
+    }
+    if (relay == Relay::iocp) {
+        IocpRelay iocp(io, fileHandle, socket, tuning);
+        if (iocp.valid()) {
+            iocp.run();
+            return;
+        }
+        spdlog::warn("IOCP relay unavailable, falling back to threads");
+    }
+
+    std::thread t1(dvcToTcp, fileHandle, std::ref(socket), cancelEvent,
+        std::ref(tuning));
+    std::thread t2(tcpToDvc, std::ref(socket), fileHandle, cancelEvent,
+        std::ref(tuning));
+
+    t1.join();
+    t2.join();
+}
+
 } // namespace
 
 struct DvcHandles {
@@ -116,19 +804,19 @@ struct DvcHandles {
     HANDLE file;
 };
 
-DvcHandles openDvc()
+DvcHandles openDvc(std::string const& name)
 {
     HANDLE dvc = WTSVirtualChannelOpenEx(
         WTS_CURRENT_SESSION,
-        const_cast<LPSTR>(kq::channelName),
+        const_cast<LPSTR>(name.c_str()),
         WTS_CHANNEL_OPTION_DYNAMIC);
 
     if (dvc == nullptr) {
         spdlog::error("Failed to open DVC '{}' (error {})",
-            kq::channelName, GetLastError());
+            name, GetLastError());
         return {nullptr, nullptr};
     }
-    spdlog::info("DVC opened");
+    spdlog::info("DVC '{}' opened", name);
 
     PVOID buffer = nullptr;
     DWORD len = 0;
@@ -154,29 +842,139 @@ DvcHandles openDvc()
     return {dvc, dupHandle};
 }
 
+void closeDvcs(std::vector<DvcHandles> const& dvcs)
+{
+    for (auto const& [dvc, file] : dvcs) {
+        CloseHandle(file);
+        WTSVirtualChannelClose(dvc);
+    }
+}
+
 int main(int argc, char* argv[])
 {
     enum class Mode { connect, listen };
     Mode mode = Mode::connect;
-    int argOffset = 1;
 
-    if (argc >= 2) {
-        std::string_view cmd = argv[1];
+    kq::Options opts(argc, argv);
+    auto const& args = opts.positional();
+    size_t argOffset = 0;
+
+    if (!args.empty()) {
+        std::string_view cmd = args[0];
         if (cmd == "connect") {
             mode = Mode::connect;
-            argOffset = 2;
+            argOffset = 1;
         } else if (cmd == "listen") {
             mode = Mode::listen;
-            argOffset = 2;
+            argOffset = 1;
         }
     }
 
+    std::string relayName = opts.get("relay", "threads");
+    Relay relay = Relay::threads;
+    if (relayName == "iocp") {
+        relay = Relay::iocp;
+    } else if (relayName != "threads") {
+        spdlog::error("Unknown relay '{}' (expected threads or iocp)", relayName);
+        return 1;
+    }
+
+    auto stripes = opts.get<size_t>("stripes", 1);
+    if (stripes < 1 || stripes > kq::maxStripes) {
+        spdlog::error("--stripes must be between 1 and {}", kq::maxStripes);
+        return 1;
+    }
+
     spdlog::info("kq-tunnel-server starting");
     spdlog::info("  channel: {}", kq::channelName);
+    spdlog::info("  relay: {}", relayName);
+    if (stripes > 1)
+        spdlog::info("  stripes: {}", stripes);
 
-    auto [dvc, fileHandle] = openDvc();
-    if (dvc == nullptr)
-        return 1;
+    if (opts.has("trace")) {
+        std::string tracePath = opts.get("trace", "");
+        if (tracePath.empty())
+            tracePath = "kq-tunnel-server.trace";
+        trace::Recorder::instance().enable(tracePath,
+            opts.get<size_t>("trace-payload", 0));
+        trace::installDumpHandlers();
+        spdlog::info("  trace: {} (Ctrl+Break dumps)", tracePath);
+    }
+
+    kq::ShaperConfig shaping;
+    shaping.rate = opts.get<uint64_t>("rate", 0);
+    shaping.burst = opts.get<uint64_t>("burst", shaping.burst);
+    if (opts.has("adaptive"))
+        shaping.adaptiveTargetMs = opts.get<uint32_t>("adaptive", 20);
+    RelayTuning tuning{kq::Shaper<>(shaping, Clock::now())};
+    if (tuning.shaper.active()) {
+        spdlog::info("  shaping: {} B/s, burst {} B{}", tuning.shaper.rate(),
+            shaping.burst, tuning.shaper.adaptive() ? ", adaptive" : "");
+    }
+
+    // --dvc-chunk=auto (default) starts from CHANNEL_CHUNK_LENGTH and follows
+    // the PDUs actually read; a number pins it, 0 turns alignment off.
+    std::string dvcChunk = opts.get("dvc-chunk", "auto");
+    if (dvcChunk == "auto") {
+        tuning.probeChunkSize = true;
+    } else {
+        tuning.chunking.setChunkSize(opts.get<size_t>("dvc-chunk", kq::defaultDvcChunkSize));
+    }
+    spdlog::info("  dvc chunk: {}", dvcChunk);
+
+    // --dedup=DIR must be given on both ends: it changes what goes over the
+    // channel in both directions.
+    std::unique_ptr<kq::dedup::Codec> dedup;
+    if (opts.has("dedup")) {
+        if (stripes > 1) {
+            spdlog::error("--dedup cannot be combined with --stripes");
+            return 1;
+        }
+        std::string dir = opts.get("dedup", "");
+        if (dir.empty())
+            dir = "kq-tunnel-cache";
+        auto cacheMb = opts.get<uint64_t>("dedup-cache", kq::dedup::defaultCacheBytes >> 20);
+        dedup = std::make_unique<kq::dedup::Codec>();
+        if (!dedup->open(dir, cacheMb << 20)) {
+            spdlog::error("Cannot open dedup cache in '{}' (in use by another process?)", dir);
+            return 1;
+        }
+        tuning.dedup = dedup.get();
+        spdlog::info("  dedup: {} ({} MiB per direction)", dir, cacheMb);
+    }
+
+    // --spill[=DIR] lets DVC data the TCP peer is not taking yet overflow
+    // into a file-backed ring instead of stalling the channel.
+    if (opts.has("spill")) {
+        if (stripes > 1) {
+            spdlog::error("--spill cannot be combined with --stripes");
+            return 1;
+        }
+        std::string dir = opts.get("spill", "");
+        if (dir.empty())
+            dir = ".";
+        tuning.spill.path = dir + "/kq-spill-" + std::to_string(GetCurrentProcessId()) + ".tmp";
+        tuning.spill.threshold = opts.get<uint64_t>("spill-threshold",
+            kq::defaultSpillThreshold >> 20) << 20;
+        tuning.spill.capacity = opts.get<uint64_t>("spill-size",
+            kq::defaultSpillCapacity >> 20) << 20;
+        spdlog::info("  spill: {} after {} MiB in memory, up to {} MiB", tuning.spill.path,
+            tuning.spill.threshold >> 20, tuning.spill.capacity >> 20);
+    }
+
+    // A single stripe is the plain, unframed KQTUNNEL channel. Stripes are
+    // opened in order, so the plugin sees KQTUNNEL0 before the rest.
+    std::vector<DvcHandles> dvcs;
+    std::vector<HANDLE> files;
+    for (size_t i = 0; i < stripes; ++i) {
+        auto handles = openDvc(stripes == 1 ? kq::channelName : kq::stripeChannelName(i));
+        if (handles.channel == nullptr) {
+            closeDvcs(dvcs);
+            return 1;
+        }
+        dvcs.push_back(handles);
+        files.push_back(handles.file);
+    }
 
     asio::io_context io;
     HANDLE cancelEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
@@ -184,10 +982,10 @@ int main(int argc, char* argv[])
     if (mode == Mode::connect) {
         std::string host = kq::defaultTargetHost;
         std::string port = std::to_string(kq::defaultTargetPort);
-        if (argOffset < argc)
-            host = argv[argOffset];
-        if (argOffset + 1 < argc)
-            port = argv[argOffset + 1];
+        if (argOffset < args.size())
+            host = args[argOffset];
+        if (argOffset + 1 < args.size())
+            port = args[argOffset + 1];
 
         spdlog::info("  mode: connect");
         spdlog::info("  target: {}:{}", host, port);
@@ -201,21 +999,16 @@ int main(int argc, char* argv[])
         } catch (std::exception const& e) {
             spdlog::error("TCP connect to {}:{} failed: {}", host, port, e.what());
             CloseHandle(cancelEvent);
-            CloseHandle(fileHandle);
-            WTSVirtualChannelClose(dvc);
+            closeDvcs(dvcs);
             return 1;
         }
         spdlog::info("Connected to {}:{}", host, port);
 
-        std::thread t1(dvcToTcp, fileHandle, std::ref(socket), cancelEvent);
-        std::thread t2(tcpToDvc, std::ref(socket), fileHandle, cancelEvent);
-
-        t1.join();
-        t2.join();
+        runRelay(relay, io, files, socket, cancelEvent, tuning);
     } else {
         uint16_t port = kq::defaultTargetPort;
-        if (argOffset < argc)
-            port = static_cast<uint16_t>(std::stoi(argv[argOffset]));
+        if (argOffset < args.size())
+            port = static_cast<uint16_t>(std::stoi(args[argOffset]));
 
         spdlog::info("  mode: listen");
         spdlog::info("  listen port: {}", port);
@@ -228,16 +1021,19 @@ int main(int argc, char* argv[])
         acceptor.accept(socket);
         spdlog::info("TCP connection accepted");
 
-        std::thread t1(dvcToTcp, fileHandle, std::ref(socket), cancelEvent);
-        std::thread t2(tcpToDvc, std::ref(socket), fileHandle, cancelEvent);
+        runRelay(relay, io, files, socket, cancelEvent, tuning);
+    }
 
-        t1.join();
-        t2.join();
+    if (dedup) {
+        auto const& stats = dedup->stats();
+        spdlog::info("Dedup: {} bytes sent as {} ({} chunk references, {} bytes), "
+            "encoder {:.0f} MB/s", stats.bytesIn, stats.bytesOut, stats.refs, stats.refBytes,
+            stats.encodeNs ? stats.bytesIn * 1e3 / static_cast<double>(stats.encodeNs) : 0.0);
     }
 
     spdlog::info("Shutting down");
+    trace::Recorder::instance().dump();
     CloseHandle(cancelEvent);
-    CloseHandle(fileHandle);
-    WTSVirtualChannelClose(dvc);
+    closeDvcs(dvcs);
     return 0;
 }
@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <spdlog/fmt/fmt.h>
+
+#include "options.hpp"
+#include "trace.hpp"
+
+// Decodes a kq-tunnel trace dump into a merged timeline on stdout, or into a
+// pcap file (LINKTYPE_USER0) where every read/write becomes a packet carrying
+// the recorded payload prefix, with the original length set to the full size.
+
+namespace {
+
+using kq::trace::Direction;
+using kq::trace::Event;
+using kq::trace::Record;
+
+constexpr uint32_t linkTypeUser0 = 147;
+
+struct Dump {
+    kq::trace::FileHeader header;
+    std::vector<Record> records;
+};
+
+bool load(std::string const& path, Dump& dump)
+{
+    std::FILE* f = std::fopen(path.c_str(), "rb");
+    if (!f) {
+        std::fprintf(stderr, "Cannot open %s\n", path.c_str());
+        return false;
+    }
+
+    bool ok = std::fread(&dump.header, sizeof(dump.header), 1, f) == 1
+        && std::memcmp(dump.header.magic, kq::trace::fileMagic, sizeof(dump.header.magic)) == 0
+        && dump.header.version == kq::trace::fileVersion
+        && dump.header.recordSize == sizeof(Record);
+
+    for (uint32_t i = 0; ok && i < dump.header.ringCount; ++i) {
+        kq::trace::RingHeader rh{};
+        ok = std::fread(&rh, sizeof(rh), 1, f) == 1;
+        if (!ok)
+            break;
+        auto offset = dump.records.size();
+        dump.records.resize(offset + rh.count);
+        ok = std::fread(dump.records.data() + offset, sizeof(Record), rh.count, f) == rh.count;
+        // prefixLen sizes what is read from the fixed prefix array.
+        ok = ok && std::all_of(dump.records.begin() + static_cast<ptrdiff_t>(offset),
+            dump.records.end(),
+            [](Record const& rec) { return rec.prefixLen <= kq::trace::maxPrefix; });
+    }
+    std::fclose(f);
+
+    if (!ok) {
+        std::fprintf(stderr, "%s is not a valid kq-tunnel trace\n", path.c_str());
+        return false;
+    }
+
+    std::stable_sort(dump.records.begin(), dump.records.end(),
+        [](Record const& a, Record const& b) { return a.timestampNs < b.timestampNs; });
+    return true;
+}
+
+std::string_view eventName(Event event)
+{
+    switch (event) {
+    case Event::read: return "read";
+    case Event::write: return "write";
+    case Event::wait: return "wait";
+    case Event::queue: return "queue";
+    case Event::error: return "error";
+    }
+    return "?";
+}
+
+std::string_view directionName(Direction direction)
+{
+    switch (direction) {
+    case Direction::none: return "-";
+    case Direction::dvcToTcp: return "dvc->tcp";
+    case Direction::tcpToDvc: return "tcp->dvc";
+    case Direction::pipeToTcp: return "pipe->tcp";
+    case Direction::tcpToPipe: return "tcp->pipe";
+    case Direction::dvcToPipe: return "dvc->pipe";
+    case Direction::pipeToDvc: return "pipe->dvc";
+    }
+    return "?";
+}
+
+void printTimeline(Dump const& dump)
+{
+    if (dump.records.empty())
+        return;
+
+    int64_t origin = dump.records.front().timestampNs;
+    int64_t wallOrigin = dump.header.systemNs - (dump.header.steadyNs - origin);
+    std::printf("# first event at %lld ns since the Unix epoch, %zu events\n",
+        static_cast<long long>(wallOrigin), dump.records.size());
+
+    for (auto const& rec : dump.records) {
+        std::string line = fmt::format("{:>14.6f} t{:<3} {:<9} {:<5}",
+            static_cast<double>(rec.timestampNs - origin) / 1e6, rec.thread,
+            directionName(rec.direction), eventName(rec.event));
+
+        switch (rec.event) {
+        case Event::read:
+        case Event::write:
+            line += fmt::format(" {} bytes", rec.size);
+            break;
+        case Event::wait:
+            line += fmt::format(" {:.3f} ms", static_cast<double>(rec.value) / 1e6);
+            break;
+        case Event::queue:
+            line += fmt::format(" depth {}", rec.value);
+            break;
+        case Event::error:
+            line += fmt::format(" code {}", rec.value);
+            break;
+        }
+
+        if (rec.prefixLen) {
+            line += "  |";
+            for (uint16_t i = 0; i < rec.prefixLen && i < kq::trace::maxPrefix; ++i)
+                line += fmt::format(" {:02x}", rec.prefix[i]);
+        }
+        line += '\n';
+        std::fputs(line.c_str(), stdout);
+    }
+}
+
+bool writePcap(Dump const& dump, std::string const& path)
+{
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    if (!f) {
+        std::fprintf(stderr, "Cannot create %s\n", path.c_str());
+        return false;
+    }
+
+    struct {
+        uint32_t magic = 0xa1b23c4d; // nanosecond timestamps
+        uint16_t major = 2;
+        uint16_t minor = 4;
+        int32_t thiszone = 0;
+        uint32_t sigfigs = 0;
+        uint32_t snaplen = kq::trace::maxPrefix;
+        uint32_t network = linkTypeUser0;
+    } global;
+    bool ok = std::fwrite(&global, sizeof(global), 1, f) == 1;
+
+    int64_t offset = dump.header.systemNs - dump.header.steadyNs;
+    for (auto const& rec : dump.records) {
+        if (rec.event != Event::read && rec.event != Event::write)
+            continue;
+        int64_t wall = rec.timestampNs + offset;
+        struct {
+            uint32_t sec;
+            uint32_t nsec;
+            uint32_t inclLen;
+            uint32_t origLen;
+        } packet{
+            static_cast<uint32_t>(wall / 1'000'000'000),
+            static_cast<uint32_t>(wall % 1'000'000'000),
+            rec.prefixLen,
+            static_cast<uint32_t>(std::max<uint64_t>(rec.size, rec.prefixLen)),
+        };
+        ok = ok && std::fwrite(&packet, sizeof(packet), 1, f) == 1;
+        if (rec.prefixLen)
+            ok = ok && std::fwrite(rec.prefix, rec.prefixLen, 1, f) == 1;
+    }
+    ok = std::fclose(f) == 0 && ok;
+
+    if (!ok)
+        std::fprintf(stderr, "Failed to write %s\n", path.c_str());
+    return ok;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    kq::Options opts(argc, argv);
+    auto const& args = opts.positional();
+    if (args.size() != 1) {
+        std::fprintf(stderr, "usage: kq-tunnel-tracedump <dump> [--pcap=<out.pcap>]\n");
+        return 2;
+    }
+
+    Dump dump;
+    if (!load(args[0], dump))
+        return 1;
+
+    if (opts.has("pcap"))
+        return writePcap(dump, opts.get("pcap", "")) ? 0 : 1;
+
+    printTimeline(dump);
+    return 0;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Minimal test harness: KQ_TEST(name) { ... } defines a case, CHECK(cond)
+// fails it. main.cpp runs every case of the executable in order.
+namespace kq::test {
+
+struct Case {
+    char const* name;
+    void (*fn)();
+};
+
+inline std::vector<Case>& cases()
+{
+    static std::vector<Case> all;
+    return all;
+}
+
+struct Register {
+    Register(char const* name, void (*fn)()) { cases().push_back({name, fn}); }
+};
+
+} // namespace kq::test
+
+#define KQ_TEST(name)                                                  \
+    static void name();                                                \
+    static ::kq::test::Register name##Registration(#name, name);       \
+    static void name()
+
+#define CHECK(cond)                                                    \
+    do {                                                               \
+        if (!(cond)) {                                                 \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n",          \
+                __FILE__, __LINE__, #cond);                            \
+            std::exit(1);                                              \
+        }                                                              \
+    } while (0)
@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "check.hpp"
+#include "dedup.hpp"
+
+namespace dd = kq::dedup;
+
+namespace {
+
+std::vector<char> randomBytes(size_t n, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<char> data(n);
+    for (auto& c : data)
+        c = static_cast<char>(rng());
+    return data;
+}
+
+// Temporary store directory, removed again at the end of the case.
+struct TempDir {
+    explicit TempDir(char const* name)
+        : path((std::filesystem::temp_directory_path() / name).string())
+    {
+        std::filesystem::remove_all(path);
+    }
+    ~TempDir() { std::filesystem::remove_all(path); }
+
+    std::string path;
+};
+
+// Cut points, as (offset, length) pairs, of `data` fed in pieces of `piece`.
+std::vector<std::pair<size_t, size_t>> chunks(std::vector<char> const& data, size_t piece)
+{
+    dd::Chunker chunker;
+    std::vector<std::pair<size_t, size_t>> cuts;
+    size_t offset = 0;
+    for (size_t pos = 0; pos < data.size(); pos += piece) {
+        size_t n = std::min(piece, data.size() - pos);
+        chunker.feed(data.data() + pos, n, false,
+            [&](char const*, size_t len, size_t) {
+                cuts.emplace_back(offset, len);
+                offset += len;
+            },
+            [](char const*, size_t) {});
+    }
+    return cuts;
+}
+
+// One direction of a dedup link: `from` encodes, `to` decodes.
+struct Link {
+    Link(std::string const& fromDir, std::string const& toDir, uint64_t capacity)
+    {
+        CHECK(from->open(fromDir, capacity));
+        CHECK(to->open(toDir, capacity));
+        // The receiving end's hello travels the other way and tells the
+        // sender what its mirror holds; the sender's own hello opens its
+        // stream.
+        std::vector<char> back, ignored;
+        to->hello(back);
+        CHECK(from->decode(back.data(), back.size(), ignored));
+        CHECK(ignored.empty());
+        std::vector<char> hello;
+        from->hello(hello);
+        CHECK(to->decode(hello.data(), hello.size(), ignored));
+    }
+
+    // Sends `data` in pieces of `piece` bytes, flushing the last one, and
+    // returns the number of encoded bytes; the decoded stream must match.
+    size_t send(std::vector<char> const& data, size_t piece)
+    {
+        std::vector<char> wire, decoded;
+        for (size_t pos = 0; pos < data.size(); pos += piece) {
+            size_t n = std::min(piece, data.size() - pos);
+            from->encode(data.data() + pos, n, pos + n == data.size(), wire);
+        }
+        CHECK(to->decode(wire.data(), wire.size(), decoded));
+        CHECK(decoded == data);
+        return wire.size();
+    }
+
+    std::unique_ptr<dd::Codec> from = std::make_unique<dd::Codec>();
+    std::unique_ptr<dd::Codec> to = std::make_unique<dd::Codec>();
+};
+
+} // namespace
+
+KQ_TEST(chunkBoundariesDoNotDependOnReadSizes)
+{
+    auto data = randomBytes(2 << 20, 1);
+    auto whole = chunks(data, data.size());
+    CHECK(whole == chunks(data, 1500));
+    CHECK(whole == chunks(data, 65536));
+    for (size_t i = 0; i < whole.size(); ++i) {
+        CHECK(whole[i].second <= dd::maxChunk);
+        CHECK(whole[i].second >= dd::minChunk);
+    }
+    // Average near the 8 KiB target.
+    size_t average = whole.back().first / whole.size();
+    CHECK(average > dd::avgChunk / 2 && average < dd::avgChunk * 2);
+}
+
+KQ_TEST(insertionOnlyChangesNearbyChunks)
+{
+    auto data = randomBytes(1 << 20, 2);
+    auto before = chunks(data, data.size());
+    data.insert(data.begin() + (512 << 10), 'x');
+    auto after = chunks(data, data.size());
+
+    std::vector<size_t> lengthsBefore, lengthsAfter;
+    for (auto [off, len] : before)
+        lengthsBefore.push_back(len);
+    for (auto [off, len] : after)
+        lengthsAfter.push_back(len);
+    size_t same = 0;
+    for (size_t len : lengthsAfter)
+        same += std::count(lengthsBefore.begin(), lengthsBefore.end(), len) > 0;
+    CHECK(same + 3 >= lengthsAfter.size());
+}
+
+KQ_TEST(flushSendsTheTailWithoutMovingCutPoints)
+{
+    auto data = randomBytes(300 << 10, 3);
+    dd::Chunker chunker;
+    std::vector<char> flushed, chunked;
+    size_t chunkBytes = 0;
+    for (size_t pos = 0; pos < data.size(); pos += 1000) {
+        size_t n = std::min<size_t>(1000, data.size() - pos);
+        chunker.feed(data.data() + pos, n, true,
+            [&](char const* chunk, size_t len, size_t sent) {
+                chunked.insert(chunked.end(), chunk + sent, chunk + len);
+                chunkBytes += len;
+            },
+            [&](char const* tail, size_t len) { chunked.insert(chunked.end(), tail, tail + len); });
+        flushed.insert(flushed.end(), data.begin() + static_cast<ptrdiff_t>(pos),
+            data.begin() + static_cast<ptrdiff_t>(pos + n));
+        CHECK(chunked == flushed);   // nothing held back
+    }
+    auto cuts = chunks(data, data.size());
+    size_t expected = 0;
+    for (auto [off, len] : cuts)
+        expected += len;
+    CHECK(chunkBytes == expected);
+}
+
+KQ_TEST(secondTransferGoesAsReferences)
+{
+    TempDir a("kq-dedup-test-a"), b("kq-dedup-test-b");
+    auto data = randomBytes(4 << 20, 4);
+    Link link(a.path, b.path, 16 << 20);
+    size_t first = link.send(data, 8192);
+    size_t second = link.send(data, 8192);
+    CHECK(first > data.size());
+    // The stream goes on where the first copy's flushed tail left off, so
+    // its first chunk and its unfinished last one still go as literals.
+    CHECK(second < data.size() / 50);
+    CHECK(link.from->stats().refs > 0);
+}
+
+KQ_TEST(cacheSurvivesReconnect)
+{
+    TempDir a("kq-dedup-test-a"), b("kq-dedup-test-b");
+    auto data = randomBytes(2 << 20, 5);
+    {
+        Link link(a.path, b.path, 16 << 20);
+        link.send(data, 16384);
+    }
+    Link link(a.path, b.path, 16 << 20);
+    CHECK(link.send(data, 4000) < data.size() / 50);
+}
+
+KQ_TEST(lostMirrorFallsBackToLiterals)
+{
+    TempDir a("kq-dedup-test-a"), b("kq-dedup-test-b");
+    auto data = randomBytes(2 << 20, 6);
+    {
+        Link link(a.path, b.path, 16 << 20);
+        link.send(data, 8192);
+    }
+    std::filesystem::remove_all(b.path);
+    Link link(a.path, b.path, 16 << 20);
+    CHECK(link.send(data, 8192) > data.size());
+}
+
+KQ_TEST(modifiedArtifactReusesUnchangedChunks)
+{
+    TempDir a("kq-dedup-test-a"), b("kq-dedup-test-b");
+    auto data = randomBytes(4 << 20, 7);
+    Link link(a.path, b.path, 16 << 20);
+    link.send(data, 8192);
+    for (size_t at : {100000, 1500000, 3000000})
+        data[at] ^= 1;
+    data.insert(data.begin() + 2000000, 10, 'z');
+    CHECK(link.send(data, 8192) < data.size() / 20);
+}
+
+KQ_TEST(streamWithoutHelloIsRejected)
+{
+    TempDir a("kq-dedup-test-a");
+    dd::Codec codec;
+    CHECK(codec.open(a.path, 1 << 20));
+    dd::RecordHeader header{dd::RecordType::raw, {}, 0};
+    std::vector<char> out;
+    CHECK(!codec.decode(reinterpret_cast<char const*>(&header), sizeof(header), out));
+    CHECK(!codec.error().empty());
+}
@@ -0,0 +1,114 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "check.hpp"
+#include "doorbell.hpp"
+
+using namespace std::chrono_literals;
+using Clock = kq::AdaptiveSpin::Clock;
+
+namespace {
+
+// Feeds `count` arrivals `gap` apart, starting at `t`; returns the time of
+// the last one.
+Clock::time_point arrive(kq::AdaptiveSpin& spin, Clock::time_point t, Clock::duration gap,
+    int count)
+{
+    for (int i = 0; i < count; ++i) {
+        t += gap;
+        spin.onArrival(t);
+    }
+    return t;
+}
+
+} // namespace
+
+KQ_TEST(ringIsFreeWhileTheConsumerIsNotArmed)
+{
+    kq::Doorbell bell;
+    for (int i = 0; i < 100; ++i)
+        CHECK(!bell.ring());
+    bell.arm();
+    bell.disarm();
+    CHECK(!bell.ring());
+    CHECK(bell.wakeups() == 0);
+}
+
+KQ_TEST(armedConsumerIsWokenOncePerArm)
+{
+    kq::Doorbell bell;
+    bell.arm();
+    CHECK(bell.ring());
+    CHECK(!bell.ring());
+    CHECK(bell.wakeups() == 1);
+}
+
+KQ_TEST(waitReturnsWhenRung)
+{
+    kq::Doorbell bell;
+    std::atomic<bool> work{false};
+    std::thread producer([&] {
+        std::this_thread::sleep_for(20ms);
+        work.store(true);
+        bell.ring();
+    });
+    while (!work.load()) {
+        bell.arm();
+        if (!work.load())
+            bell.wait(5000);
+        bell.disarm();
+    }
+    producer.join();
+}
+
+KQ_TEST(singleCpuNeverSpins)
+{
+    kq::AdaptiveSpin spin(50us, 1);
+    arrive(spin, Clock::now(), 2us, 100);
+    CHECK(spin.budget() == 0ns);
+    int polls = 0;
+    CHECK(!spin.spin([&] { return ++polls, false; }));
+    CHECK(polls == 0);
+}
+
+KQ_TEST(budgetFollowsTheArrivalGap)
+{
+    kq::AdaptiveSpin spin(50us, 4);
+    CHECK(spin.budget() == 0ns);   // nothing learned yet
+    auto t = arrive(spin, Clock::now(), 5us, 200);
+    CHECK(spin.budget() >= 9us && spin.budget() <= 11us);
+    // Gaps past the limit stop the spinning within a few arrivals.
+    arrive(spin, t, 1s, 20);
+    CHECK(spin.budget() == 0ns);
+}
+
+KQ_TEST(spinReturnsAsSoonAsWorkIsThere)
+{
+    kq::AdaptiveSpin spin(50us, 4);
+    arrive(spin, Clock::now(), 20us, 200);
+    int polls = 0;
+    CHECK(spin.spin([&] { return ++polls == 3; }));
+    CHECK(polls == 3);
+}
+
+// After a burst the learned gap stays short; a spin that found nothing must
+// not be repeated on every loop iteration until something arrives again.
+KQ_TEST(emptySpinIsNotRepeatedBeforeTheNextArrival)
+{
+    kq::AdaptiveSpin spin(50us, 4);
+    auto t = arrive(spin, Clock::now(), 10us, 200);
+    int polls = 0;
+    auto never = [&] { return ++polls, false; };
+    CHECK(!spin.spin(never));
+    CHECK(polls > 0);
+
+    polls = 0;
+    for (int i = 0; i < 10; ++i)
+        CHECK(!spin.spin(never));
+    CHECK(polls == 0);
+
+    spin.onArrival(t + 10us);
+    CHECK(!spin.spin(never));
+    CHECK(polls > 0);
+}
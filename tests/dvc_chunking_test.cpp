@@ -0,0 +1,119 @@
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "check.hpp"
+#include "dvc_chunking.hpp"
+
+using kq::DvcChunking;
+using kq::DvcChunkProbe;
+
+namespace {
+
+struct Pdu {
+    size_t header;   // command/channel id, plus the length on a DataFirst
+    size_t payload;
+    bool last;
+};
+
+// Reference fragmentation of one DVC message (MS-RDPEDYC 2.2.3).
+std::vector<Pdu> fragment(size_t len, size_t chunk)
+{
+    size_t single = chunk - DvcChunking::dataHeaderSize;
+    if (len <= single)
+        return {{DvcChunking::dataHeaderSize, len, true}};
+    size_t lenBytes = len <= 0xFF ? 1 : len <= 0xFFFF ? 2 : 4;
+    std::vector<Pdu> pdus;
+    size_t first = single - lenBytes;
+    pdus.push_back({DvcChunking::dataHeaderSize + lenBytes, first, false});
+    for (size_t left = len - first; left > 0;) {
+        size_t n = std::min(left, single);
+        left -= n;
+        pdus.push_back({DvcChunking::dataHeaderSize, n, left == 0});
+    }
+    return pdus;
+}
+
+bool allFull(size_t len, size_t chunk)
+{
+    for (auto const& pdu : fragment(len, chunk)) {
+        if (pdu.header + pdu.payload != chunk)
+            return false;
+    }
+    return true;
+}
+
+} // namespace
+
+KQ_TEST(pdusForMatchesTheReferenceFragmenter)
+{
+    for (size_t chunk : {64, 1600, 8192}) {
+        DvcChunking chunking(chunk);
+        for (size_t len = 1; len < 200000; len += len < 4000 ? 1 : 97)
+            CHECK(chunking.pdusFor(len) == fragment(len, chunk).size());
+    }
+}
+
+KQ_TEST(alignedLengthFillsEveryPdu)
+{
+    for (size_t chunk : {64, 1600, 8192}) {
+        DvcChunking chunking(chunk);
+        for (size_t available = 0; available < 100000; available += 13) {
+            size_t len = chunking.alignedLength(available);
+            CHECK(len <= available);
+            if (len == 0) {
+                CHECK(available < chunk - DvcChunking::dataHeaderSize);
+                continue;
+            }
+            CHECK(allFull(len, chunk));
+            // Nothing longer that still fits is also all full.
+            for (size_t longer = len + 1; longer <= std::min(available, len + chunk); ++longer)
+                CHECK(!allFull(longer, chunk));
+        }
+    }
+}
+
+KQ_TEST(writeSizeOnlyHoldsBackWhileMoreIsPending)
+{
+    DvcChunking chunking(1600);
+    CHECK(chunking.writeSize(5000, false) == 5000);
+    CHECK(chunking.writeSize(5000, true) == chunking.alignedLength(5000));
+    CHECK(chunking.writeSize(100, true) == 0);
+}
+
+KQ_TEST(zeroOrTinyChunkDisablesAlignment)
+{
+    for (size_t chunk : {0, 1, 6}) {
+        DvcChunking chunking(chunk);
+        CHECK(!chunking.enabled());
+        CHECK(chunking.writeSize(12345, true) == 12345);
+    }
+}
+
+// What the probe learns from the PDUs of real messages is the chunk size
+// DvcChunking was configured with, not the payload size.
+KQ_TEST(probeLearnsTheChunkSizeInDvcChunkingUnits)
+{
+    for (size_t chunk : {1600, 1024, 8192}) {
+        DvcChunkProbe probe;
+        for (size_t len : {100, 5000, 70000, 300}) {
+            for (auto const& pdu : fragment(len, chunk))
+                probe.observe(pdu.payload, pdu.last ? DvcChunkProbe::flagLast : 0);
+        }
+        CHECK(probe.chunkSize() == chunk);
+
+        DvcChunking learned(probe.chunkSize());
+        CHECK(allFull(learned.alignedLength(100000), chunk));
+    }
+}
+
+KQ_TEST(probeIgnoresLastPdusAndSmallerPayloads)
+{
+    DvcChunkProbe probe;
+    CHECK(!probe.observe(5000, DvcChunkProbe::flagLast));
+    CHECK(probe.chunkSize() == 0);
+    CHECK(probe.observe(1598, 0));
+    CHECK(!probe.observe(1598, 0));
+    CHECK(!probe.observe(1000, 0));
+    CHECK(probe.chunkSize() == 1600);
+}
@@ -0,0 +1,13 @@
+#include <cstdio>
+
+#include "check.hpp"
+
+int main()
+{
+    for (auto const& c : kq::test::cases()) {
+        std::printf("%s\n", c.name);
+        c.fn();
+    }
+    std::printf("%zu passed\n", kq::test::cases().size());
+    return 0;
+}
@@ -0,0 +1,392 @@
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "check.hpp"
+#include "protocol.hpp"
+#include "session_router.hpp"
+
+namespace {
+
+// --- Unix-socket stand-ins ---------------------------------------------------
+
+int listenUnix(std::string const& path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+    CHECK(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    CHECK(listen(fd, 16) == 0);
+    return fd;
+}
+
+int connectUnix(std::string const& path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    CHECK(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    return fd;
+}
+
+bool writeAll(int fd, void const* data, size_t len)
+{
+    auto const* p = static_cast<char const*>(data);
+    while (len > 0) {
+        ssize_t n = ::send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// False on end of stream before `len` bytes.
+bool readAll(int fd, void* data, size_t len)
+{
+    auto* p = static_cast<char*>(data);
+    while (len > 0) {
+        ssize_t n = ::read(fd, p, len);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+std::vector<char> pattern(size_t len, uint32_t seed)
+{
+    std::vector<char> data(len);
+    for (size_t i = 0; i < len; ++i)
+        data[i] = static_cast<char>(seed * 131 + i * 7 + (i >> 9));
+    return data;
+}
+
+// kq-tunnel-client's session handling over Unix sockets: one listener stands
+// in for the named pipe, each slot gets its own listener standing in for
+// its TCP port. A session waits for its TCP connection and for its plugin
+// at once (poll() where the client waits on the accept and a pipe read),
+// keeps what the plugin sends meanwhile, and gives up if the plugin goes
+// away first. The stand-in names the slot in PipeWelcome::mapping.
+class ClientStandIn
+{
+public:
+    explicit ClientStandIn(size_t slots)
+        : dir_(std::filesystem::temp_directory_path()
+              / ("kq-router-test-" + std::to_string(getpid()))),
+          router_(slots)
+    {
+        std::filesystem::create_directories(dir_);
+        pipe_ = listenUnix(pipePath());
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~ClientStandIn()
+    {
+        shutdown(pipe_, SHUT_RDWR);
+        thread_.join();
+        close(pipe_);
+        for (auto& t : sessions_)
+            t.join();
+        std::filesystem::remove_all(dir_);
+    }
+
+    std::string pipePath() const { return (dir_ / "pipe").string(); }
+
+    std::string slotPath(int slot) const
+    {
+        return (dir_ / ("slot" + std::to_string(slot))).string();
+    }
+
+    // Waits until `n` sessions have ended in total.
+    void waitEnded(size_t n)
+    {
+        std::unique_lock lock(mtx_);
+        cv_.wait(lock, [&] { return ended_ >= n; });
+    }
+
+private:
+    void run()
+    {
+        for (;;) {
+            int fd = accept(pipe_, nullptr, nullptr);
+            if (fd < 0)
+                return;
+            sessions_.emplace_back([this, fd] { serve(fd); });
+        }
+    }
+
+    void serve(int plugin)
+    {
+        kq::PipeHello hello{};
+        int slot = -1;
+        if (readAll(plugin, &hello, sizeof(hello))
+            && std::memcmp(hello.magic, kq::pipeMagic, sizeof(hello.magic)) == 0)
+            slot = router_.acquire({hello.processId, hello.session});
+        if (slot < 0) {
+            close(plugin);
+            finished();
+            return;
+        }
+
+        int listener = listenUnix(slotPath(slot));
+        kq::PipeWelcome welcome{};
+        std::memcpy(welcome.magic, kq::pipeMagic, sizeof(welcome.magic));
+        welcome.version = kq::pipeProtocolVersion;
+        std::snprintf(welcome.mapping, sizeof(welcome.mapping), "%d", slot);
+        int tcp = -1;
+        std::vector<char> early;
+        if (writeAll(plugin, &welcome, sizeof(welcome)))
+            tcp = acceptWhilePluginAlive(listener, plugin, early);
+        close(listener);
+        unlink(slotPath(slot).c_str());
+
+        if (tcp >= 0 && writeAll(tcp, early.data(), early.size()))
+            relay(plugin, tcp);
+        if (tcp >= 0)
+            close(tcp);
+        close(plugin);
+        router_.release(slot);
+        finished();
+    }
+
+    static int acceptWhilePluginAlive(int listener, int plugin, std::vector<char>& early)
+    {
+        for (;;) {
+            pollfd fds[] = {{listener, POLLIN, 0}, {plugin, POLLIN, 0}};
+            CHECK(poll(fds, 2, -1) > 0);
+            if (fds[1].revents) {
+                char buf[kq::bufferSize];
+                ssize_t n = read(plugin, buf, sizeof(buf));
+                if (n <= 0)
+                    return -1;
+                early.insert(early.end(), buf, buf + n);
+            }
+            if (fds[0].revents)
+                return accept(listener, nullptr, nullptr);
+        }
+    }
+
+    // Both directions until either side closes.
+    static void relay(int a, int b)
+    {
+        char buf[kq::bufferSize];
+        for (;;) {
+            pollfd fds[] = {{a, POLLIN, 0}, {b, POLLIN, 0}};
+            CHECK(poll(fds, 2, -1) > 0);
+            for (int i = 0; i < 2; ++i) {
+                if (!fds[i].revents)
+                    continue;
+                ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+                if (n <= 0 || !writeAll(fds[1 - i].fd, buf, static_cast<size_t>(n)))
+                    return;
+            }
+        }
+    }
+
+    void finished()
+    {
+        std::lock_guard lock(mtx_);
+        ++ended_;
+        cv_.notify_all();
+    }
+
+    std::filesystem::path dir_;
+    kq::SessionRouter router_;
+    int pipe_ = -1;
+    std::thread thread_;
+    std::vector<std::thread> sessions_;   // only touched by thread_ until it ends
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    size_t ended_ = 0;
+};
+
+// One plugin instance: connects to the pipe stand-in and introduces itself
+// as RDP connection `session` of process `processId`.
+struct Plugin {
+    Plugin(ClientStandIn const& client, uint32_t processId, uint32_t session)
+        : fd(connectUnix(client.pipePath()))
+    {
+        kq::PipeHello hello{};
+        std::memcpy(hello.magic, kq::pipeMagic, sizeof(hello.magic));
+        hello.version = kq::pipeProtocolVersion;
+        hello.processId = processId;
+        hello.session = session;
+        CHECK(writeAll(fd, &hello, sizeof(hello)));
+        kq::PipeWelcome welcome{};
+        if (readAll(fd, &welcome, sizeof(welcome)))
+            slot = std::atoi(welcome.mapping);
+    }
+
+    ~Plugin() { close(fd); }
+
+    int fd;
+    int slot = -1;   // -1: rejected
+};
+
+// Carries `seed`'s data each way through slot `plugin.slot`: first what the
+// plugin sent before the TCP side connected, then a reply. Ends the session.
+void exchange(ClientStandIn const& client, Plugin& plugin, uint32_t seed)
+{
+    auto early = pattern(20000, seed);
+    CHECK(writeAll(plugin.fd, early.data(), early.size()));
+
+    int tcp = connectUnix(client.slotPath(plugin.slot));
+    auto late = pattern(70000, seed + 1000);
+    CHECK(writeAll(plugin.fd, late.data(), late.size()));
+    std::vector<char> got(early.size() + late.size());
+    CHECK(readAll(tcp, got.data(), got.size()));
+    CHECK(std::equal(early.begin(), early.end(), got.begin()));
+    CHECK(std::equal(late.begin(), late.end(), got.begin() + static_cast<ptrdiff_t>(early.size())));
+
+    auto reply = pattern(50000, seed + 2000);
+    CHECK(writeAll(tcp, reply.data(), reply.size()));
+    std::vector<char> back(reply.size());
+    CHECK(readAll(plugin.fd, back.data(), back.size()));
+    CHECK(back == reply);
+
+    close(tcp);
+    char byte;
+    CHECK(!readAll(plugin.fd, &byte, 1));
+}
+
+} // namespace
+
+// --- SessionRouter -------------------------------------------------------------
+
+KQ_TEST(sessionGetsItsSlotBack)
+{
+    kq::SessionRouter router(4);
+    int a = router.acquire({100, 1});
+    int b = router.acquire({100, 2});
+    CHECK(a != b);
+    router.release(a);
+    router.release(b);
+    CHECK(router.acquire({100, 2}) == b);
+    CHECK(router.acquire({100, 1}) == a);
+}
+
+KQ_TEST(newSessionsPreferNeverUsedSlots)
+{
+    kq::SessionRouter router(3);
+    int a = router.acquire({1, 0});
+    router.release(a);
+    int b = router.acquire({2, 0});
+    CHECK(b != a);
+    int c = router.acquire({3, 0});
+    CHECK(c != a && c != b);
+}
+
+KQ_TEST(slotReleasedLongestAgoIsReusedFirst)
+{
+    kq::SessionRouter router(2);
+    int a = router.acquire({1, 0});
+    int b = router.acquire({2, 0});
+    router.release(b);
+    router.release(a);
+    CHECK(router.acquire({3, 0}) == b);
+    CHECK(router.acquire({4, 0}) == a);
+}
+
+KQ_TEST(busySlotsAreNotHandedOut)
+{
+    kq::SessionRouter router(2);
+    int a = router.acquire({1, 0});
+    CHECK(router.acquire({2, 0}) >= 0);
+    CHECK(router.acquire({3, 0}) == -1);
+    // Not even to the session that owns it: a second connection from the
+    // same plugin instance waits for the first one to end.
+    CHECK(router.acquire({1, 0}) == -1);
+    router.release(a);
+    CHECK(router.acquire({3, 0}) == a);
+}
+
+// --- Simulated plugins -------------------------------------------------------
+
+KQ_TEST(concurrentPluginsGetSeparateSessions)
+{
+    ClientStandIn client(8);
+    std::vector<std::unique_ptr<Plugin>> plugins;
+    std::set<int> slots;
+    for (uint32_t i = 0; i < 6; ++i) {
+        plugins.push_back(std::make_unique<Plugin>(client, 4000 + i % 2, i));
+        CHECK(plugins.back()->slot >= 0);
+        slots.insert(plugins.back()->slot);
+    }
+    CHECK(slots.size() == plugins.size());
+
+    std::vector<std::thread> users;
+    for (uint32_t i = 0; i < plugins.size(); ++i)
+        users.emplace_back([&, i] { exchange(client, *plugins[i], i); });
+    for (auto& t : users)
+        t.join();
+    client.waitEnded(plugins.size());
+}
+
+KQ_TEST(reconnectingPluginGetsItsSlotBack)
+{
+    ClientStandIn client(4);
+    int first;
+    {
+        Plugin a(client, 7, 1);
+        first = a.slot;
+        exchange(client, a, 1);
+    }
+    client.waitEnded(1);
+    Plugin b(client, 7, 2);
+    CHECK(b.slot >= 0 && b.slot != first);
+    Plugin again(client, 7, 1);
+    CHECK(again.slot == first);
+    exchange(client, again, 2);
+    exchange(client, b, 3);
+    client.waitEnded(3);
+}
+
+KQ_TEST(pluginLeavingBeforeTcpFreesItsSlot)
+{
+    ClientStandIn client(1);
+    {
+        Plugin a(client, 9, 1);
+        CHECK(a.slot == 0);
+        char hello[] = "sent before anyone connected";
+        CHECK(writeAll(a.fd, hello, sizeof(hello)));
+    }
+    client.waitEnded(1);
+    Plugin b(client, 9, 2);
+    CHECK(b.slot == 0);
+    exchange(client, b, 4);
+    client.waitEnded(2);
+}
+
+KQ_TEST(pluginsBeyondTheSlotsAreRejected)
+{
+    ClientStandIn client(2);
+    Plugin a(client, 1, 0);
+    Plugin b(client, 2, 0);
+    Plugin c(client, 3, 0);
+    CHECK(a.slot >= 0 && b.slot >= 0);
+    CHECK(c.slot == -1);
+    exchange(client, a, 5);
+    exchange(client, b, 6);
+    client.waitEnded(3);
+}
@@ -0,0 +1,169 @@
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "check.hpp"
+#include "shaper.hpp"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+// Time only moves when a test moves it.
+struct SimClock {
+    using rep = int64_t;
+    using period = std::nano;
+    using duration = std::chrono::nanoseconds;
+    using time_point = std::chrono::time_point<SimClock>;
+    static constexpr bool is_steady = true;
+};
+
+using Bucket = kq::TokenBucket<SimClock>;
+using Shaper = kq::Shaper<SimClock>;
+
+SimClock::time_point const t0{};
+
+kq::ShaperConfig adaptiveConfig(uint64_t rate, uint32_t targetMs)
+{
+    kq::ShaperConfig config;
+    config.rate = rate;
+    config.adaptiveTargetMs = targetMs;
+    return config;
+}
+
+} // namespace
+
+KQ_TEST(unlimitedBucketNeverDelays)
+{
+    Bucket bucket(0, 1024, t0);
+    for (int i = 0; i < 100; ++i)
+        CHECK(bucket.reserve(1 << 20, t0) == 0ns);
+}
+
+KQ_TEST(burstIsFreeThenDelayFollowsRate)
+{
+    Bucket bucket(1000, 500, t0);          // 1000 B/s, 500 B deep
+    CHECK(bucket.reserve(500, t0) == 0ns);
+    CHECK(bucket.reserve(100, t0) == 100ms);
+    CHECK(bucket.reserve(100, t0) == 200ms);
+}
+
+KQ_TEST(debtIsPaidBackBeforeTheNextWrite)
+{
+    Bucket bucket(1000, 500, t0);
+    CHECK(bucket.reserve(1500, t0) == 1s);  // oversize write goes into debt
+    CHECK(bucket.reserve(1, t0 + 500ms) == 501ms);
+    CHECK(bucket.reserve(0, t0 + 2s) == 0ns);
+}
+
+KQ_TEST(idleRefillIsCappedAtBurst)
+{
+    Bucket bucket(1000, 500, t0);
+    CHECK(bucket.reserve(500, t0) == 0ns);
+    CHECK(bucket.reserve(500, t0 + 1h) == 0ns);
+    CHECK(bucket.reserve(100, t0 + 1h) == 100ms);
+}
+
+KQ_TEST(clockGoingBackwardsDoesNotMint)
+{
+    Bucket bucket(1000, 500, t0 + 10s);
+    CHECK(bucket.reserve(500, t0 + 10s) == 0ns);
+    CHECK(bucket.reserve(100, t0) == 100ms);
+}
+
+KQ_TEST(sustainedRateMatchesConfiguration)
+{
+    Bucket bucket(1'000'000, 64 * 1024, t0);
+    auto now = t0;
+    uint64_t sent = 0;
+    while (now < t0 + 10s) {
+        now += bucket.reserve(1600, now);
+        sent += 1600;
+    }
+    // 10 s at 1 MB/s plus the initial burst, give or take one write.
+    uint64_t expected = 10'000'000 + 64 * 1024;
+    CHECK(sent >= expected - 1600 && sent <= expected + 1600);
+}
+
+KQ_TEST(setRateKeepsTokensEarnedAtTheOldRate)
+{
+    Bucket bucket(1000, 1000, t0);
+    CHECK(bucket.reserve(1000, t0) == 0ns);
+    bucket.setRate(2000, t0 + 500ms);       // 500 tokens earned at 1000 B/s
+    CHECK(bucket.rate() == 2000);
+    CHECK(bucket.reserve(500, t0 + 500ms) == 0ns);
+    CHECK(bucket.reserve(200, t0 + 500ms) == 100ms);
+}
+
+KQ_TEST(fixedShaperIgnoresLatency)
+{
+    kq::ShaperConfig config;
+    config.rate = 100'000;
+    Shaper shaper(config, t0);
+    CHECK(shaper.active());
+    CHECK(!shaper.adaptive());
+    shaper.onWriteComplete(10s, t0 + 1s);
+    CHECK(shaper.rate() == 100'000);
+}
+
+KQ_TEST(inactiveWithoutRateOrTarget)
+{
+    Shaper shaper(kq::ShaperConfig{}, t0);
+    CHECK(!shaper.active());
+    CHECK(shaper.reserve(1 << 30, t0) == 0ns);
+}
+
+KQ_TEST(adaptiveWithoutRateUsesTheCeiling)
+{
+    Shaper shaper(adaptiveConfig(0, 20), t0);
+    CHECK(shaper.active());
+    CHECK(shaper.adaptive());
+    CHECK(shaper.rate() == kq::adaptiveCeiling);
+}
+
+KQ_TEST(adaptiveBacksOffOncePerIntervalAfterSlowWrites)
+{
+    Shaper shaper(adaptiveConfig(1'000'000, 20), t0);
+    shaper.onWriteComplete(50ms, t0 + 10ms);
+    CHECK(shaper.rate() == 1'000'000);     // window not over yet
+    shaper.onWriteComplete(1ms, t0 + Shaper::interval);
+    CHECK(shaper.rate() == 700'000);       // worst in the window was slow
+    shaper.onWriteComplete(1ms, t0 + 2 * Shaper::interval);
+    CHECK(shaper.rate() == 750'000);       // recovers by ceiling / 20
+}
+
+KQ_TEST(adaptiveStaysBetweenFloorAndCeiling)
+{
+    Shaper shaper(adaptiveConfig(1'000'000, 20), t0);
+    auto now = t0;
+    for (int i = 0; i < 100; ++i) {
+        now += Shaper::interval;
+        shaper.onWriteComplete(1s, now);
+    }
+    CHECK(shaper.rate() == kq::adaptiveFloor);
+    for (int i = 0; i < 100; ++i) {
+        now += Shaper::interval;
+        shaper.onWriteComplete(1ms, now);
+    }
+    CHECK(shaper.rate() == 1'000'000);
+}
+
+// Same inputs, same delays: nothing in the shaper reads a real clock.
+KQ_TEST(simulationIsDeterministic)
+{
+    auto run = [] {
+        Shaper shaper(adaptiveConfig(2'000'000, 20), t0);
+        std::vector<SimClock::duration> delays;
+        auto now = t0;
+        for (int i = 0; i < 5000; ++i) {
+            auto delay = shaper.reserve(1600 + static_cast<uint64_t>(i % 7) * 1000, now);
+            delays.push_back(delay);
+            now += delay + 50us;
+            // Latency climbs with the rate, like a channel queueing up.
+            auto latency = std::chrono::microseconds(shaper.rate() / 50'000);
+            shaper.onWriteComplete(latency, now);
+        }
+        return delays;
+    };
+    CHECK(run() == run());
+}
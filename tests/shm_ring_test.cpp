@@ -0,0 +1,170 @@
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "check.hpp"
+#include "shm_ring.hpp"
+
+namespace shm = kq::shm;
+
+namespace {
+
+// Byte `i` of the test stream.
+char at(uint64_t i)
+{
+    return static_cast<char>(i * 31 + (i >> 11));
+}
+
+std::string mappingName(char const* what)
+{
+    return "/kq-shm-test-" + std::string(what) + "-" + std::to_string(getpid());
+}
+
+} // namespace
+
+KQ_TEST(ringWrapsAroundInAnyPieceSizes)
+{
+    shm::RingControl control{};
+    std::vector<char> data(64);
+    shm::SpscRing ring(&control, data.data(), data.size());
+
+    uint64_t written = 0, read = 0;
+    for (size_t round = 0; round < 500; ++round) {
+        char piece[64];
+        size_t want = round * 7 % 50 + 1;
+        for (size_t i = 0; i < want; ++i)
+            piece[i] = at(written + i);
+        written += ring.write(piece, want);
+        CHECK(ring.readable() == written - read);
+
+        size_t n = ring.read(piece, round * 5 % 45 + 1);
+        for (size_t i = 0; i < n; ++i)
+            CHECK(piece[i] == at(read + i));
+        read += n;
+    }
+    CHECK(written > 10 * data.size());
+}
+
+KQ_TEST(writeStopsWhenFull)
+{
+    shm::RingControl control{};
+    std::vector<char> data(16);
+    shm::SpscRing ring(&control, data.data(), data.size());
+    char buf[32] = {};
+    CHECK(ring.write(buf, 10) == 10);
+    CHECK(ring.write(buf, 10) == 6);
+    CHECK(ring.writable() == 0);
+    CHECK(ring.write(buf, 1) == 0);
+    CHECK(ring.read(buf, 4) == 4);
+    CHECK(ring.writable() == 4);
+}
+
+KQ_TEST(parkingFailsOnceTheOtherSideMoved)
+{
+    shm::RingControl control{};
+    std::vector<char> data(16);
+    shm::SpscRing ring(&control, data.data(), data.size());
+    char buf[16] = {};
+
+    // Nobody parked: writes do not ask for a wakeup.
+    ring.write(buf, 1);
+    CHECK(!ring.unparkReader());
+    // Data waiting: the reader may not sleep.
+    CHECK(!ring.parkReader());
+    ring.read(buf, 1);
+    CHECK(ring.parkReader());
+    ring.write(buf, 1);
+    CHECK(ring.unparkReader());
+    CHECK(!ring.unparkReader());   // one wakeup per park
+
+    ring.write(buf, 15);
+    CHECK(ring.parkWriter());
+    ring.read(buf, 1);
+    CHECK(ring.unparkWriter());
+    CHECK(!ring.parkWriter());     // space again
+}
+
+KQ_TEST(transportCarriesAStreamBetweenThreads)
+{
+    shm::Transport client, plugin;
+    std::string name = mappingName("stream");
+    CHECK(client.create(name, 4096));
+    CHECK(plugin.open(name));
+
+    constexpr uint64_t total = 8 << 20;
+    std::thread writer([&] {
+        char piece[1500];
+        for (uint64_t sent = 0; sent < total;) {
+            size_t want = std::min<uint64_t>(sizeof(piece), total - sent);
+            for (size_t i = 0; i < want; ++i)
+                piece[i] = at(sent + i);
+            size_t n = client.tx().write(piece, want);
+            if (n > 0)
+                client.notifyWritten();
+            else if (client.tx().parkWriter())
+                client.waitTx(100);
+            sent += n;
+        }
+    });
+
+    char buf[3000];
+    for (uint64_t received = 0; received < total;) {
+        size_t n = plugin.rx().read(buf, sizeof(buf));
+        if (n > 0)
+            plugin.notifyRead();
+        else if (plugin.rx().parkReader())
+            plugin.waitRx(100);
+        for (size_t i = 0; i < n; ++i)
+            CHECK(buf[i] == at(received + i));
+        received += n;
+    }
+    writer.join();
+}
+
+// What the plugin does when the client closes its pipe: the bytes the
+// client wrote last are still in the ring and can be read out after it is
+// gone.
+KQ_TEST(ringIsReadableAfterTheWriterLeft)
+{
+    shm::Transport plugin;
+    std::string name = mappingName("closed");
+    {
+        shm::Transport client;
+        CHECK(client.create(name, 4096));
+        CHECK(plugin.open(name));
+        char piece[1000];
+        for (size_t i = 0; i < sizeof(piece); ++i)
+            piece[i] = at(i);
+        CHECK(client.tx().write(piece, sizeof(piece)) == sizeof(piece));
+        client.notifyWritten();
+    }
+
+    std::vector<char> left;
+    char buf[300];
+    while (size_t n = plugin.rx().read(buf, sizeof(buf)))
+        left.insert(left.end(), buf, buf + n);
+    CHECK(left.size() == 1000);
+    for (size_t i = 0; i < left.size(); ++i)
+        CHECK(left[i] == at(i));
+}
+
+KQ_TEST(openRejectsMissingOrForeignMappings)
+{
+    shm::Transport plugin;
+    CHECK(!plugin.open(mappingName("missing")));
+
+    kq::SharedMemory foreign;
+    std::string name = mappingName("foreign");
+    CHECK(foreign.create(name, 4096));
+    CHECK(!plugin.open(name));
+}
+
+KQ_TEST(createRejectsCapacitiesThatAreNotPowersOfTwo)
+{
+    shm::Transport client;
+    CHECK(!client.create(mappingName("capacity"), 3000));
+    CHECK(!client.create(mappingName("capacity"), 0));
+}
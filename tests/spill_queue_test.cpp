@@ -0,0 +1,143 @@
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "check.hpp"
+#include "spill_queue.hpp"
+
+namespace {
+
+std::vector<char> pattern(size_t len, uint64_t offset)
+{
+    std::vector<char> data(len);
+    for (size_t i = 0; i < len; ++i)
+        data[i] = static_cast<char>((offset + i) * 13 + ((offset + i) >> 10));
+    return data;
+}
+
+std::string spillPath(char const* name)
+{
+    return (std::filesystem::temp_directory_path() / name).string();
+}
+
+// Pops everything, checking it continues the pattern at `offset`.
+void drainAndCheck(kq::SpillQueue<>& queue, uint64_t& offset)
+{
+    std::vector<char> out;
+    while (!queue.empty()) {
+        out.clear();
+        size_t n = queue.pop(out);
+        CHECK(n == out.size());
+        CHECK(out == pattern(n, offset));
+        offset += n;
+    }
+}
+
+} // namespace
+
+KQ_TEST(memoryOnlyQueueRefusesPastItsLimit)
+{
+    kq::SpillQueue<> queue(100);
+    CHECK(queue.push(pattern(60, 0).data(), 60));
+    CHECK(!queue.push(pattern(60, 60).data(), 60));
+    CHECK(queue.push(pattern(40, 60).data(), 40));
+    CHECK(queue.size() == 100);
+    uint64_t offset = 0;
+    drainAndCheck(queue, offset);
+    CHECK(offset == 100);
+}
+
+KQ_TEST(emptyQueueTakesAPieceLargerThanBothTiers)
+{
+    auto path = spillPath("kq-spill-test-oversize.tmp");
+    kq::SpillQueue<> queue(1000);
+    queue.enableSpill(path, 4096);
+    auto big = pattern(10000, 0);
+    CHECK(queue.push(big.data(), big.size()));
+    CHECK(queue.inMemory() == big.size());
+    // Nothing else fits behind it until it is gone.
+    CHECK(!queue.push(big.data(), big.size()));
+    uint64_t offset = 0;
+    drainAndCheck(queue, offset);
+    CHECK(queue.push(pattern(10000, offset).data(), 10000));
+    drainAndCheck(queue, offset);
+    CHECK(offset == 20000);
+}
+
+KQ_TEST(spillFileIsCreatedOnFirstSpillAndRemovedAfter)
+{
+    auto path = spillPath("kq-spill-test-lazy.tmp");
+    std::filesystem::remove(path);
+    {
+        kq::SpillQueue<> queue(1000);
+        queue.enableSpill(path, 1 << 20);
+        CHECK(queue.spillEnabled());
+        CHECK(queue.push(pattern(800, 0).data(), 800));
+        CHECK(!std::filesystem::exists(path));
+        CHECK(queue.push(pattern(800, 800).data(), 800));
+        CHECK(std::filesystem::exists(path));
+        CHECK(queue.spilled() == 800);
+        uint64_t offset = 0;
+        drainAndCheck(queue, offset);
+        CHECK(offset == 1600);
+    }
+    CHECK(!std::filesystem::exists(path));
+}
+
+KQ_TEST(orderIsKeptAcrossTiersAndFileWraparound)
+{
+    auto path = spillPath("kq-spill-test-order.tmp");
+    kq::SpillQueue<> queue(5000);
+    queue.enableSpill(path, 64 * 1024);
+    uint64_t pushed = 0, popped = 0;
+    std::vector<char> out;
+    for (size_t round = 0; round < 2000; ++round) {
+        size_t len = round * 977 % 9000 + 1;
+        if (queue.push(pattern(len, pushed).data(), len))
+            pushed += len;
+        if (round % 3 == 0) {
+            out.clear();
+            size_t n = queue.pop(out);
+            CHECK(out == pattern(n, popped));
+            popped += n;
+        }
+        CHECK(queue.size() == pushed - popped);
+    }
+    CHECK(queue.peakSpilled() > 32 * 1024);
+    drainAndCheck(queue, popped);
+    CHECK(popped == pushed);
+    CHECK(pushed > 10 * 64 * 1024);
+}
+
+KQ_TEST(spilledDataDrainsInBoundedPieces)
+{
+    auto path = spillPath("kq-spill-test-bounded.tmp");
+    kq::SpillQueue<> queue(1024);
+    queue.enableSpill(path, 8 << 20);
+    std::vector<char> piece(64 * 1024);
+    CHECK(queue.push(piece.data(), 512));
+    for (size_t i = 0; i < 64; ++i)
+        CHECK(queue.push(piece.data(), piece.size()));
+    std::vector<char> out;
+    CHECK(queue.pop(out) == 512);
+    while (!queue.empty()) {
+        out.clear();
+        CHECK(queue.pop(out) <= kq::spillReadSize);
+    }
+}
+
+KQ_TEST(unusableSpillFileLeavesTheQueueInMemory)
+{
+    auto path = spillPath("kq-spill-test-missing-dir/spill.tmp");
+    std::filesystem::remove_all(spillPath("kq-spill-test-missing-dir"));
+    kq::SpillQueue<> queue(1000);
+    queue.enableSpill(path, 1 << 20);
+    CHECK(queue.push(pattern(900, 0).data(), 900));
+    CHECK(!queue.spillFailed());
+    CHECK(!queue.push(pattern(900, 900).data(), 900));
+    CHECK(queue.spillFailed());
+    uint64_t offset = 0;
+    drainAndCheck(queue, offset);
+    CHECK(queue.push(pattern(900, offset).data(), 900));
+}
@@ -0,0 +1,99 @@
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "check.hpp"
+#include "stripe.hpp"
+
+namespace {
+
+std::vector<char> frame(uint32_t seq, std::string const& payload)
+{
+    kq::StripeFrameHeader header{seq, static_cast<uint32_t>(payload.size())};
+    std::vector<char> out(sizeof(header) + payload.size());
+    std::memcpy(out.data(), &header, sizeof(header));
+    std::memcpy(out.data() + sizeof(header), payload.data(), payload.size());
+    return out;
+}
+
+} // namespace
+
+KQ_TEST(parserReassemblesFramesSplitAnywhere)
+{
+    std::vector<char> stream;
+    for (uint32_t seq = 0; seq < 50; ++seq) {
+        auto f = frame(seq, std::string(seq * 37 % 500, static_cast<char>('a' + seq % 26)));
+        stream.insert(stream.end(), f.begin(), f.end());
+    }
+
+    std::mt19937 rng(1);
+    for (int round = 0; round < 20; ++round) {
+        kq::StripeFrameParser parser;
+        uint32_t expected = 0;
+        auto onFrame = [&](uint32_t seq, char const* data, size_t len) {
+            CHECK(seq == expected);
+            CHECK(len == seq * 37 % 500);
+            for (size_t i = 0; i < len; ++i)
+                CHECK(data[i] == static_cast<char>('a' + seq % 26));
+            ++expected;
+            return true;
+        };
+        std::uniform_int_distribution<size_t> piece(1, 700);
+        for (size_t pos = 0; pos < stream.size();) {
+            size_t n = std::min(piece(rng), stream.size() - pos);
+            CHECK(parser.feed(stream.data() + pos, n, onFrame));
+            pos += n;
+        }
+        CHECK(expected == 50);
+    }
+}
+
+KQ_TEST(parserRejectsOversizeFrames)
+{
+    kq::StripeFrameHeader header{0, static_cast<uint32_t>(kq::maxStripeFrame + 1)};
+    kq::StripeFrameParser parser;
+    CHECK(!parser.feed(reinterpret_cast<char const*>(&header), sizeof(header),
+        [](uint32_t, char const*, size_t) { return true; }));
+}
+
+KQ_TEST(reorderRestoresSequenceOrder)
+{
+    kq::ReorderBuffer reorder(1 << 20);
+    std::string out;
+    CHECK(reorder.push(2, "cc", 2, out));
+    CHECK(reorder.push(1, "b", 1, out));
+    CHECK(out.empty());
+    CHECK(reorder.heldFrames() == 2);
+    CHECK(reorder.buffered() == 3);
+    CHECK(reorder.push(0, "a", 1, out));
+    CHECK(out == "abcc");
+    CHECK(reorder.buffered() == 0);
+    CHECK(reorder.peak() == 3);
+}
+
+KQ_TEST(reorderRejectsDuplicatesStaleFramesAndOverflow)
+{
+    kq::ReorderBuffer reorder(4);
+    std::string out;
+    CHECK(reorder.push(0, "a", 1, out));
+    CHECK(!reorder.push(0, "a", 1, out));       // stale
+    CHECK(reorder.push(2, "cc", 2, out));
+    CHECK(!reorder.push(2, "cc", 2, out));      // duplicate
+    CHECK(!reorder.push(3, "ddd", 3, out));     // would hold 5 > 4 bytes
+    CHECK(reorder.push(1, "b", 1, out));
+    CHECK(out == "abcc");
+}
+
+// Sequence numbers are 32-bit on the wire and read relative to the next
+// expected one, so anything half the space or more behind counts as stale.
+KQ_TEST(reorderTreatsFarSequencesAsStale)
+{
+    kq::ReorderBuffer reorder(1 << 20);
+    std::string out;
+    CHECK(!reorder.push(0x80000000u, "x", 1, out));
+    CHECK(reorder.push(0x7FFFFFFFu, "y", 1, out));
+    CHECK(reorder.heldFrames() == 1);
+    CHECK(out.empty());
+}
@@ -0,0 +1,133 @@
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "check.hpp"
+#include "trace.hpp"
+
+using namespace kq::trace;
+
+namespace {
+
+std::string tempPath(char const* name)
+{
+    return (std::filesystem::temp_directory_path() / name).string();
+}
+
+// Ring id -> records, as kq-tunnel-tracedump reads them.
+std::map<uint32_t, std::vector<Record>> load(std::string const& path)
+{
+    std::map<uint32_t, std::vector<Record>> rings;
+    std::FILE* f = std::fopen(path.c_str(), "rb");
+    CHECK(f);
+    FileHeader header{};
+    CHECK(std::fread(&header, sizeof(header), 1, f) == 1);
+    CHECK(std::memcmp(header.magic, fileMagic, sizeof(header.magic)) == 0);
+    CHECK(header.version == fileVersion);
+    CHECK(header.recordSize == sizeof(Record));
+    for (uint32_t i = 0; i < header.ringCount; ++i) {
+        RingHeader rh{};
+        CHECK(std::fread(&rh, sizeof(rh), 1, f) == 1);
+        auto& records = rings[rh.id];
+        records.resize(rh.count);
+        if (rh.count)
+            CHECK(std::fread(records.data(), sizeof(Record), rh.count, f) == rh.count);
+    }
+    std::fclose(f);
+    std::filesystem::remove(path);
+    return rings;
+}
+
+// Each case records from a thread of its own with its own direction. Rings
+// are recycled between threads, so a ring may still start with records of
+// an earlier case.
+std::vector<Record> recordsOf(std::map<uint32_t, std::vector<Record>> const& rings,
+    Direction direction)
+{
+    std::vector<Record> found;
+    for (auto const& [id, records] : rings) {
+        for (auto const& rec : records) {
+            if (rec.direction == direction)
+                found.push_back(rec);
+        }
+    }
+    return found;
+}
+
+} // namespace
+
+KQ_TEST(recordsComeBackInOrder)
+{
+    auto path = tempPath("kq-trace-test-order.bin");
+    Recorder::instance().enable(path, 8);
+    std::thread([] {
+        char payload[16] = "0123456789abcde";
+        for (uint64_t i = 0; i < 100; ++i)
+            record(Event::read, Direction::dvcToPipe, i, 2 * i, payload, sizeof(payload));
+    }).join();
+    CHECK(Recorder::instance().dump());
+
+    auto records = recordsOf(load(path), Direction::dvcToPipe);
+    CHECK(records.size() == 100);
+    for (uint64_t i = 0; i < records.size(); ++i) {
+        CHECK(records[i].event == Event::read);
+        CHECK(records[i].size == i);
+        CHECK(records[i].value == 2 * i);
+        CHECK(records[i].prefixLen == 8);
+        CHECK(std::memcmp(records[i].prefix, "01234567", 8) == 0);
+        CHECK(i == 0 || records[i].timestampNs >= records[i - 1].timestampNs);
+    }
+}
+
+KQ_TEST(wrappedRingKeepsTheNewestRecords)
+{
+    auto path = tempPath("kq-trace-test-wrap.bin");
+    Recorder::instance().enable(path, 0);
+    uint64_t const total = 3 * ringCapacity + 5;
+    std::thread([total] {
+        for (uint64_t i = 0; i < total; ++i)
+            record(Event::write, Direction::tcpToPipe, i);
+    }).join();
+    CHECK(Recorder::instance().dump());
+
+    auto records = recordsOf(load(path), Direction::tcpToPipe);
+    CHECK(records.size() == ringCapacity);
+    for (uint64_t i = 0; i < records.size(); ++i)
+        CHECK(records[i].size == total - ringCapacity + i);
+}
+
+// Dumps while a thread keeps recording: whatever comes out must be whole
+// records (size, value and prefix written together) in recording order.
+KQ_TEST(dumpDuringWritesSkipsTornRecords)
+{
+    auto path = tempPath("kq-trace-test-race.bin");
+    Recorder::instance().enable(path, maxPrefix);
+    std::atomic<bool> stop{false};
+    std::thread writer([&] {
+        uint8_t payload[maxPrefix];
+        for (uint64_t i = 0; !stop.load(std::memory_order_relaxed); ++i) {
+            std::memset(payload, static_cast<int>(i & 0xFF), sizeof(payload));
+            record(Event::queue, Direction::pipeToDvc, i, ~i, payload, sizeof(payload));
+        }
+    });
+
+    for (int round = 0; round < 20; ++round) {
+        CHECK(Recorder::instance().dump());
+        auto records = recordsOf(load(path), Direction::pipeToDvc);
+        for (size_t i = 0; i < records.size(); ++i) {
+            auto const& rec = records[i];
+            CHECK(rec.value == ~rec.size);
+            CHECK(rec.prefixLen == maxPrefix);
+            for (auto b : rec.prefix)
+                CHECK(b == static_cast<uint8_t>(rec.size & 0xFF));
+            CHECK(i == 0 || rec.size > records[i - 1].size);
+        }
+    }
+    stop = true;
+    writer.join();
+}